@@ -0,0 +1,404 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "f439.h"
+
+/**
+ * analyze reports how well an image uses its space, to decide when it is
+ * worth repacking:
+ *
+ *      analyze [-j threads] <image>
+ *
+ * For every file: its blocks, its extents (runs of physically adjacent
+ * blocks, ascending or descending, like in index.h), the average run length
+ * and the slack, i.e. the bytes of its blocks that hold no data (the 8 byte
+ * header and the unused end of the last block). For the whole image: how
+ * much is used, free, lost (neither in a file nor on the free list) or
+ * claimed twice, a histogram of the runs of free blocks, and how the free
+ * list is ordered. mkfs allocates from the top of the disk down, so a free
+ * list that still descends one block at a time gives new files one extent.
+ *
+ * The chains are walked by several threads at once, one file at a time,
+ * and the fat is then swept in segments, one per thread. Only the free list
+ * is walked by one thread: it is a single chain.
+ */
+
+/* one byte of state per block */
+enum {
+    BLOCK_USED = 1,
+    BLOCK_FREE = 2,
+    BLOCK_SHARED = 4,   /* in more than one chain (shared chunks) */
+};
+
+/* free runs of 1, 2-3, 4-7, ... blocks; the last bucket takes the rest */
+#define N_BUCKETS 24
+
+typedef struct {
+    char name[F439_NAME_LEN + 1];
+    uint32_t type;
+    uint32_t size;
+    uint64_t blocks;
+    uint64_t extents;
+    uint64_t slack;
+    int broken;          /* the chain ends early or leaves the disk */
+} FileStats;
+
+/* what one thread found in its segment of the fat */
+typedef struct {
+    uint32_t lo, hi;
+    uint64_t used, free, lost, shared, adjacent, links;
+    uint64_t buckets[N_BUCKETS];
+    uint32_t leading;    /* free blocks at the start of the segment */
+    uint32_t trailing;   /* free blocks at the end of the segment */
+    uint32_t longest;    /* longest free run strictly inside the segment */
+} Segment;
+
+typedef struct {
+    const Image *img;
+    _Atomic uint8_t *state;
+    FileStats *files;
+    uint32_t nFiles;
+    atomic_uint next;    /* the next file to walk */
+} Analyzer;
+
+
+static int bucketOf(uint64_t run) {
+    int k = 0;
+    while (run > 1 && k < N_BUCKETS - 1) {
+        run >>= 1;
+        k++;
+    }
+    return k;
+}
+
+/**
+ * @brief walk the chain at @b, marking its blocks and counting them and
+ *        their extents into @s.
+ */
+static void walkChain(Analyzer *a, uint32_t b, FileStats *s) {
+    uint32_t nBlocks = a->img->super->nBlocks;
+    uint32_t first = imageFirstData(nBlocks);
+    int64_t step = 0;
+    uint32_t prev = 0;
+    for (uint64_t n = 0; b != 0; n++) {
+        if (b < first || b >= nBlocks || n == nBlocks) {
+            s->broken = 1;
+            return;
+        }
+        uint8_t old = atomic_fetch_or(&a->state[b], BLOCK_USED);
+        if (old & BLOCK_USED) {
+            atomic_fetch_or(&a->state[b], BLOCK_SHARED);
+        }
+        int64_t d = (int64_t)b - prev;
+        if (n > 0 && (d == 1 || d == -1) && (step == 0 || step == d)) {
+            step = d;
+        } else {
+            s->extents++;
+            step = 0;
+        }
+        s->blocks++;
+        prev = b;
+        b = a->img->fat[b];
+    }
+}
+
+static void walkFile(Analyzer *a, uint32_t i) {
+    const Image *img = a->img;
+    const DirEntry *e = imageDirEntry(img, i);
+    FileStats *s = &a->files[i];
+    memcpy(s->name, e->name, F439_NAME_LEN);
+    if (e->start == 0 || e->start >= img->super->nBlocks) {
+        s->broken = 1;
+        return;
+    }
+    s->type = imageFileType(img, e->start);
+    s->size = imageFileSize(img, e->start);
+    walkChain(a, e->start, s);
+
+    /* the chunks of a chunked file hold its data; shared ones are counted
+       with every file that refers to them */
+    uint64_t stored = s->size;
+    if (s->type == F439_TYPE_CHUNKED && !s->broken) {
+        ChunkCursor c;
+        ChunkRef ref;
+        imageChunkStart(img, e->start, &c);
+        uint64_t listBytes = 0;
+        while (imageChunkNext(img, &c, &ref) > 0) {
+            walkChain(a, ref.start, s);
+            listBytes += sizeof(ChunkRef);
+        }
+        stored = s->size + listBytes;
+    }
+    uint64_t capacity = s->blocks * F439_BLOCK_SIZE;
+    s->slack = capacity > stored ? capacity - stored : 0;
+}
+
+static void *fileThread(void *arg) {
+    Analyzer *a = arg;
+    for (;;) {
+        uint32_t i = atomic_fetch_add(&a->next, 1);
+        if (i >= a->nFiles) {
+            return NULL;
+        }
+        walkFile(a, i);
+    }
+}
+
+typedef struct {
+    Analyzer *a;
+    Segment *g;
+} SegmentJob;
+
+/* sweep one segment of the fat and of the block states */
+static void *sweepThread(void *arg) {
+    SegmentJob *job = arg;
+    const Image *img = job->a->img;
+    Segment *g = job->g;
+    uint32_t run = 0;
+    int atStart = 1;
+    for (uint32_t b = g->lo; b < g->hi; b++) {
+        uint8_t st = atomic_load_explicit(&job->a->state[b],
+                                          memory_order_relaxed);
+        if (st & BLOCK_FREE) {
+            g->free++;
+            run++;
+        } else {
+            if (run) {
+                if (atStart) {
+                    g->leading = run;
+                } else {
+                    g->buckets[bucketOf(run)]++;
+                    if (run > g->longest) {
+                        g->longest = run;
+                    }
+                }
+            }
+            run = 0;
+            atStart = 0;
+        }
+        if ((st & BLOCK_SHARED) || ((st & BLOCK_USED) && (st & BLOCK_FREE))) {
+            g->shared++;
+        }
+        if (st & BLOCK_USED) {
+            g->used++;
+            uint32_t next = img->fat[b];
+            if (next != 0) {
+                g->links++;
+                if (next == b + 1 || next + 1 == b) {
+                    g->adjacent++;
+                }
+            }
+        } else if (st == 0) {
+            g->lost++;
+        }
+    }
+    if (atStart) {
+        g->leading = run;   /* the whole segment is free */
+    } else {
+        g->trailing = run;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int nThreads = 4;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nThreads = atoi(argv[++i]);
+        } else {
+            break;
+        }
+    }
+    if (i + 1 != argc || nThreads < 1) {
+        fprintf(stderr, "usage: %s [-j threads] <image>\n", argv[0]);
+        exit(1);
+    }
+
+    Image img;
+    if (imageOpen(&img, argv[i], PROT_READ) < 0) {
+        exit(1);
+    }
+    uint32_t nBlocks = img.super->nBlocks;
+    uint32_t first = imageFirstData(nBlocks);
+
+    Analyzer a;
+    memset(&a, 0, sizeof(a));
+    a.img = &img;
+    a.nFiles = imageDirCount(&img);
+    a.state = calloc(nBlocks, 1);
+    a.files = calloc(a.nFiles ? a.nFiles : 1, sizeof(FileStats));
+    if (a.state == NULL || a.files == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    atomic_store(&a.state[img.super->root], BLOCK_USED);
+
+    /* 1. the chains, file by file */
+    pthread_t *threads = malloc(nThreads * sizeof(pthread_t));
+    Segment *segments = calloc(nThreads, sizeof(Segment));
+    SegmentJob *jobs = malloc(nThreads * sizeof(SegmentJob));
+    if (threads == NULL || segments == NULL || jobs == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    int started = 0;
+    while (started < nThreads) {
+        int err = pthread_create(&threads[started], NULL, fileThread, &a);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+        started++;
+    }
+    if (started < nThreads) {
+        /* whatever the threads do not get to is walked on this one */
+        fileThread(&a);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    /* 2. the free list, in list order */
+    uint64_t onList = 0, down = 0, up = 0, jumps = 0;
+    int listBroken = 0;
+    for (uint32_t b = img.super->avail, prev = 0; b != 0; b = img.fat[b]) {
+        if (b < first || b >= nBlocks ||
+            (atomic_fetch_or(&a.state[b], BLOCK_FREE) & BLOCK_FREE)) {
+            listBroken = 1;   /* off the disk, or a cycle */
+            break;
+        }
+        if (onList > 0) {
+            if (b + 1 == prev) {
+                down++;
+            } else if (b == prev + 1) {
+                up++;
+            } else {
+                jumps++;
+            }
+        }
+        onList++;
+        prev = b;
+    }
+
+    /* 3. the fat, in segments */
+    started = 0;
+    uint32_t per = (nBlocks - first + nThreads - 1) / nThreads;
+    for (int t = 0; t < nThreads; t++) {
+        uint64_t lo = first + (uint64_t)t * per;
+        uint64_t hi = lo + per;
+        segments[t].lo = lo < nBlocks ? lo : nBlocks;
+        segments[t].hi = hi < nBlocks ? hi : nBlocks;
+        jobs[t].a = &a;
+        jobs[t].g = &segments[t];
+        if (started == t) {
+            int err = pthread_create(&threads[t], NULL, sweepThread, &jobs[t]);
+            if (err) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            } else {
+                started++;
+            }
+        }
+    }
+    /* the segments without a thread are swept on this one */
+    for (int t = started; t < nThreads; t++) {
+        sweepThread(&jobs[t]);
+    }
+    Segment total;
+    memset(&total, 0, sizeof(total));
+    uint64_t run = 0;   /* free run carried over segment boundaries */
+    for (int t = 0; t < nThreads; t++) {
+        if (t < started) {
+            pthread_join(threads[t], NULL);
+        }
+        Segment *g = &segments[t];
+        total.used += g->used;
+        total.free += g->free;
+        total.lost += g->lost;
+        total.shared += g->shared;
+        total.links += g->links;
+        total.adjacent += g->adjacent;
+        for (int k = 0; k < N_BUCKETS; k++) {
+            total.buckets[k] += g->buckets[k];
+        }
+        if (g->longest > total.longest) {
+            total.longest = g->longest;
+        }
+        run += g->leading;
+        if (g->leading == g->hi - g->lo) {
+            continue;   /* all free: the run goes on */
+        }
+        if (run) {
+            total.buckets[bucketOf(run)]++;
+            if (run > total.longest) {
+                total.longest = run;
+            }
+        }
+        run = g->trailing;
+    }
+    if (run) {
+        total.buckets[bucketOf(run)]++;
+        if (run > total.longest) {
+            total.longest = run;
+        }
+    }
+
+    printf("%-12s %4s %10s %8s %7s %8s %8s\n", "file", "type", "bytes",
+           "blocks", "extents", "avg run", "slack");
+    uint64_t slack = 0, fileBlocks = 0, extents = 0;
+    for (uint32_t f = 0; f < a.nFiles; f++) {
+        FileStats *s = &a.files[f];
+        printf("%-12s %4u %10u %8lu %7lu %8.1f %8lu%s\n", s->name, s->type,
+               s->size, (unsigned long)s->blocks, (unsigned long)s->extents,
+               s->extents ? (double)s->blocks / s->extents : 0.0,
+               (unsigned long)s->slack, s->broken ? "  BROKEN CHAIN" : "");
+        slack += s->slack;
+        fileBlocks += s->blocks;
+        extents += s->extents;
+    }
+
+    uint64_t data = nBlocks - first;
+    printf("\nblocks: %u total, %u metadata, %lu used, %lu free, %lu lost, "
+           "%lu shared or cross-linked\n", nBlocks, first,
+           (unsigned long)total.used, (unsigned long)total.free,
+           (unsigned long)total.lost, (unsigned long)total.shared);
+    printf("space:  %.1f%% of data blocks used, %lu bytes of slack "
+           "(%.1f%% of file blocks)\n",
+           data ? 100.0 * total.used / data : 0.0, (unsigned long)slack,
+           fileBlocks ? 100.0 * slack / (fileBlocks * F439_BLOCK_SIZE) : 0.0);
+    printf("runs:   %lu extents, %.1f blocks per extent, %.1f%% of links "
+           "to an adjacent block\n", (unsigned long)extents,
+           extents ? (double)fileBlocks / extents : 0.0,
+           total.links ? 100.0 * total.adjacent / total.links : 100.0);
+    printf("free list: %lu blocks%s, %.1f%% descending by one, "
+           "%.1f%% ascending by one, %lu jumps\n", (unsigned long)onList,
+           listBroken ? " (BROKEN)" : "",
+           onList > 1 ? 100.0 * down / (onList - 1) : 100.0,
+           onList > 1 ? 100.0 * up / (onList - 1) : 0.0,
+           (unsigned long)jumps);
+    printf("free runs (longest %u blocks):\n", total.longest);
+    for (int k = 0; k < N_BUCKETS; k++) {
+        if (total.buckets[k] == 0) {
+            continue;
+        }
+        char range[32];
+        if (k == 0) {
+            snprintf(range, sizeof(range), "1");
+        } else if (k == N_BUCKETS - 1) {
+            snprintf(range, sizeof(range), "%lu+", 1ul << k);
+        } else {
+            snprintf(range, sizeof(range), "%lu-%lu", 1ul << k,
+                     (2ul << k) - 1);
+        }
+        printf("  %16s blocks: %lu\n", range, (unsigned long)total.buckets[k]);
+    }
+
+    free(segments);
+    free(jobs);
+    free(threads);
+    free(a.files);
+    free((void *)a.state);
+    imageClose(&img);
+    return 0;
+}
@@ -0,0 +1,604 @@
+#define _GNU_SOURCE   /* syscall() */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "async.h"
+#include "f439.h"
+#include "probes.h"
+
+/**
+ * Every read goes through three kinds of steps, each one pread-sized I/O:
+ *
+ *      META   the [type, size] header of the first block, to clip the read
+ *      FAT    a window of the fat, to follow the file's chain further
+ *      DATA   a run of blocks the caller asked for, into its buffer
+ *
+ * A step is prepared into the read's AsyncOp and either put on the ring,
+ * or on the waiting list when @depth steps are already in flight. The next
+ * step of a read depends on the result of the previous one, so the steps of
+ * one read are never in flight together; the concurrency comes from having
+ * many reads.
+ *
+ * The chain of every file read is kept (Chain), so a file read in many
+ * pieces has its fat walked once, not once per piece. Only one read walks a
+ * chain at a time; reads that need blocks further down wait on the chain
+ * and go on when it has got longer. A FAT step reads FAT_WINDOW entries
+ * around the end of the chain and follows it as far as it stays inside,
+ * which for a file mkfs laid out in one piece is FAT_WINDOW blocks per
+ * step. Chains take 4 bytes per block and are kept until asyncClose().
+ *
+ * mkfs hands out blocks from the top of the disk down, so consecutive
+ * blocks of a file are usually adjacent on the disk, in either direction.
+ * A DATA step reads such a run of up to RUN_BLOCKS with one readv(): the
+ * blocks are scattered to their places in the buffer, and the bytes in
+ * between that were not asked for (a header, the start or the end of a
+ * block) go to a scratch block.
+ *
+ * Keeping at most @depth steps in flight (the completion ring holds twice
+ * that) means the completion ring can never overflow.
+ */
+
+#define FAT_WINDOW 1024
+#define RUN_BLOCKS 128
+
+enum {
+    OP_META,
+    OP_FAT,
+    OP_DATA,
+};
+
+typedef struct AsyncOp AsyncOp;
+typedef struct Chain Chain;
+
+struct Chain {
+    Chain *next;
+    uint32_t *blocks;     /* the chain as far as it is known; [0]: start */
+    uint32_t known, cap;
+    int ended;            /* blocks[known - 1] is the last (or a bad) one */
+    int walking;          /* a FAT step for it is in flight */
+    AsyncOp *waiters;     /* reads that need it to get longer */
+    uint32_t windowStart; /* the first entry in @window */
+    uint32_t window[FAT_WINDOW];
+};
+
+struct AsyncOp {
+    AsyncOp *next;        /* on the waiting list, or a chain's waiters */
+    int state;            /* OP_... of the step in flight */
+    Chain *chain;
+    uint32_t pos;         /* position in the chain where the data goes on */
+    uint32_t offset;      /* where the data starts in that block */
+    uint32_t run;         /* blocks in the DATA step */
+    uint32_t meta[2];     /* target of OP_META */
+    char *buf;
+    size_t length;
+    size_t done;
+    size_t wanted;        /* bytes of the DATA step that are the caller's */
+    AsyncDoneFn callback;
+    void *arg;
+    /* the step itself: one buffer, or @nIov of @iov */
+    int fd;
+    void *dst;
+    uint32_t len;
+    off_t off;
+    int nIov;
+    struct iovec iov[RUN_BLOCKS + 2];
+};
+
+struct AsyncReader {
+    Image img;
+    unsigned depth;
+    unsigned inFlight;    /* steps on the ring */
+    unsigned pending;     /* reads not completed yet */
+    AsyncOp *waitHead, *waitTail;
+    Chain *chains;
+    char scratch[F439_BLOCK_SIZE];  /* bytes of a run nobody asked for */
+
+    /* io_uring; ringFd is -1 on the pread() fallback */
+    int ringFd;
+    void *sqMap, *cqMap;
+    size_t sqMapLength, cqMapLength;
+    struct io_uring_sqe *sqes;
+    size_t sqesLength;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit;
+};
+
+
+static int ioUringSetup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                        unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+                   NULL, 0);
+}
+
+/* set up the ring and map its queues; leaves ringFd at -1 on failure */
+static void ringOpen(AsyncReader *ar) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ar->ringFd = ioUringSetup(ar->depth, &p);
+    if (ar->ringFd < 0) {
+        ar->ringFd = -1;
+        return;
+    }
+    ar->depth = p.sq_entries;
+
+    ar->sqMapLength = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ar->cqMapLength = p.cq_off.cqes +
+                      p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ar->cqMapLength > ar->sqMapLength) {
+            ar->sqMapLength = ar->cqMapLength;
+        }
+        ar->cqMapLength = 0;
+    }
+    ar->sqMap = mmap(NULL, ar->sqMapLength, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ar->ringFd, IORING_OFF_SQ_RING);
+    ar->cqMap = ar->sqMap;
+    if (ar->sqMap != MAP_FAILED && ar->cqMapLength) {
+        ar->cqMap = mmap(NULL, ar->cqMapLength, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ar->ringFd,
+                         IORING_OFF_CQ_RING);
+    }
+    ar->sqesLength = p.sq_entries * sizeof(struct io_uring_sqe);
+    ar->sqes = MAP_FAILED;
+    if (ar->sqMap != MAP_FAILED && ar->cqMap != MAP_FAILED) {
+        ar->sqes = mmap(NULL, ar->sqesLength, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ar->ringFd,
+                        IORING_OFF_SQES);
+    }
+    if (ar->sqes == MAP_FAILED) {
+        perror("io_uring mmap");
+        if (ar->cqMapLength && ar->cqMap != MAP_FAILED) {
+            munmap(ar->cqMap, ar->cqMapLength);
+        }
+        if (ar->sqMap != MAP_FAILED) {
+            munmap(ar->sqMap, ar->sqMapLength);
+        }
+        close(ar->ringFd);
+        ar->ringFd = -1;
+        return;
+    }
+
+    char *sq = ar->sqMap, *cq = ar->cqMap;
+    ar->sqHead = (unsigned *)(sq + p.sq_off.head);
+    ar->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    ar->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ar->sqArray = (unsigned *)(sq + p.sq_off.array);
+    ar->cqHead = (unsigned *)(cq + p.cq_off.head);
+    ar->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    ar->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ar->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+static void ringClose(AsyncReader *ar) {
+    if (ar->ringFd < 0) {
+        return;
+    }
+    munmap(ar->sqes, ar->sqesLength);
+    if (ar->cqMapLength) {
+        munmap(ar->cqMap, ar->cqMapLength);
+    }
+    munmap(ar->sqMap, ar->sqMapLength);
+    close(ar->ringFd);
+}
+
+/* put the step prepared in @op on the ring; there is room (see inFlight) */
+static void ringPush(AsyncReader *ar, AsyncOp *op) {
+    unsigned tail = *ar->sqTail;
+    unsigned slot = tail & *ar->sqMask;
+    struct io_uring_sqe *sqe = &ar->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    if (op->nIov) {
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uintptr_t)op->iov;
+        sqe->len = op->nIov;
+    } else {
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uintptr_t)op->dst;
+        sqe->len = op->len;
+    }
+    sqe->off = op->off;
+    sqe->user_data = (uintptr_t)op;
+    ar->sqArray[slot] = slot;
+    __atomic_store_n(ar->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ar->toSubmit++;
+    ar->inFlight++;
+}
+
+static void prepare(AsyncOp *op, int state, int fd, void *dst, uint32_t len,
+                    off_t off) {
+    op->state = state;
+    op->fd = fd;
+    op->dst = dst;
+    op->len = len;
+    op->off = off;
+    op->nIov = 0;
+}
+
+/* start the step prepared in @op now, or after the ones already waiting */
+static void queue(AsyncReader *ar, AsyncOp *op) {
+    if (ar->ringFd >= 0 && ar->inFlight < ar->depth && ar->waitHead == NULL) {
+        ringPush(ar, op);
+        return;
+    }
+    op->next = NULL;
+    if (ar->waitTail) {
+        ar->waitTail->next = op;
+    } else {
+        ar->waitHead = op;
+    }
+    ar->waitTail = op;
+}
+
+static void finish(AsyncReader *ar, AsyncOp *op, long result) {
+    ar->pending--;
+    F439_PROBE2(read_done, op->buf, result);
+    op->callback(op->arg, result);
+    free(op);
+}
+
+/* the chain starting at @start, known up to there if it is new */
+static Chain *findChain(AsyncReader *ar, uint32_t start) {
+    for (Chain *c = ar->chains; c; c = c->next) {
+        if (c->blocks[0] == start) {
+            return c;
+        }
+    }
+    Chain *c = calloc(1, sizeof(Chain));
+    if (c == NULL || (c->blocks = malloc(64 * sizeof(uint32_t))) == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->cap = 64;
+    c->blocks[0] = start;
+    c->known = 1;
+    c->next = ar->chains;
+    ar->chains = c;
+    return c;
+}
+
+/* follow @c through the fat window just read; @return -1 out of memory */
+static int extendChain(AsyncReader *ar, Chain *c) {
+    uint32_t b = c->blocks[c->known - 1];
+    while (b >= c->windowStart && b - c->windowStart < FAT_WINDOW) {
+        uint32_t next = c->window[b - c->windowStart];
+        if (next == 0 || next >= ar->img.super->nBlocks ||
+            c->known >= ar->img.super->nBlocks) {
+            c->ended = 1;      /* the end, or a broken chain */
+            break;
+        }
+        if (c->known == c->cap) {
+            uint32_t *more = realloc(c->blocks, 2 * c->cap * sizeof(uint32_t));
+            if (more == NULL) {
+                return -1;
+            }
+            c->blocks = more;
+            c->cap *= 2;
+        }
+        c->blocks[c->known++] = next;
+        b = next;
+    }
+    return 0;
+}
+
+/**
+ * @brief prepare a DATA step of @op: from block @op->pos of its chain, the
+ *        longest run of blocks that lie next to each other on the disk.
+ */
+static void prepareRun(AsyncReader *ar, AsyncOp *op) {
+    const Chain *c = op->chain;
+    off_t off[RUN_BLOCKS];
+    char *dst[RUN_BLOCKS];
+    uint32_t from[RUN_BLOCKS], len[RUN_BLOCKS];
+    int fd = imageBlockFd(&ar->img, c->blocks[op->pos], &off[0]);
+    size_t wanted = 0;
+    int dir = 0;
+    uint32_t n = 0;
+    while (n < RUN_BLOCKS && op->pos + n < c->known &&
+           op->done + wanted < op->length) {
+        if (n > 0) {
+            off_t o;
+            if (imageBlockFd(&ar->img, c->blocks[op->pos + n], &o) != fd) {
+                break;
+            }
+            int d = o == off[n - 1] + F439_BLOCK_SIZE ? 1
+                  : o == off[n - 1] - F439_BLOCK_SIZE ? -1 : 0;
+            if (d == 0 || (dir && d != dir)) {
+                break;
+            }
+            dir = d;
+            off[n] = o;
+        }
+        from[n] = n == 0 ? op->offset : 0;  /* imageLocate() skips the header */
+        len[n] = F439_BLOCK_SIZE - from[n];
+        if (len[n] > op->length - op->done - wanted) {
+            len[n] = op->length - op->done - wanted;
+        }
+        dst[n] = op->buf + op->done + wanted;
+        wanted += len[n];
+        n++;
+    }
+
+    /* the iovecs go in disk order, with the gaps to the scratch block */
+    off_t cursor = dir < 0 ? off[n - 1] + from[n - 1] : off[0] + from[0];
+    off_t startAt = cursor;
+    op->nIov = 0;
+    for (uint32_t k = 0; k < n; k++) {
+        uint32_t j = dir < 0 ? n - 1 - k : k;
+        off_t at = off[j] + from[j];
+        if (at > cursor) {
+            op->iov[op->nIov].iov_base = ar->scratch;
+            op->iov[op->nIov++].iov_len = at - cursor;
+        }
+        op->iov[op->nIov].iov_base = dst[j];
+        op->iov[op->nIov++].iov_len = len[j];
+        cursor = at + len[j];
+    }
+    op->state = OP_DATA;
+    op->fd = fd;
+    op->off = startAt;
+    op->len = cursor - startAt;
+    op->run = n;
+    op->wanted = wanted;
+}
+
+/**
+ * @brief prepare the next step of @op and queue it, or complete the read;
+ *        a read that needs more of a chain someone else walks waits on it.
+ */
+static void advance(AsyncReader *ar, AsyncOp *op) {
+    Chain *c = op->chain;
+    if (op->done >= op->length) {
+        finish(ar, op, op->done);
+        return;
+    }
+    if (op->pos < c->known) {
+        prepareRun(ar, op);
+    } else if (c->ended) {
+        finish(ar, op, -EIO);
+        return;
+    } else if (c->walking) {
+        op->next = c->waiters;
+        c->waiters = op;
+        return;
+    } else {
+        /* the fat is always in the image file itself */
+        uint32_t last = c->blocks[c->known - 1];
+        uint32_t nBlocks = ar->img.super->nBlocks;
+        c->walking = 1;
+        c->windowStart = last / FAT_WINDOW * FAT_WINDOW;
+        uint32_t n = nBlocks - c->windowStart < FAT_WINDOW
+                     ? nBlocks - c->windowStart : FAT_WINDOW;
+        prepare(op, OP_FAT, ar->img.fd, c->window, n * sizeof(uint32_t),
+                F439_BLOCK_SIZE + (off_t)c->windowStart * sizeof(uint32_t));
+    }
+    queue(ar, op);
+}
+
+/* the reads waiting on @c go on, now that it is longer or has ended */
+static void wakeChain(AsyncReader *ar, Chain *c) {
+    AsyncOp *w = c->waiters;
+    c->waiters = NULL;
+    while (w) {
+        AsyncOp *next = w->next;
+        advance(ar, w);
+        w = next;
+    }
+}
+
+/* the step of @op finished with @res (bytes read or -errno) */
+static void complete(AsyncReader *ar, AsyncOp *op, long res) {
+    if (res >= 0 && (uint32_t)res != op->len) {
+        res = -EIO;
+    }
+    if (op->state == OP_FAT) {
+        Chain *c = op->chain;
+        c->walking = 0;
+        if (res >= 0 && extendChain(ar, c) < 0) {
+            res = -ENOMEM;
+        }
+        /* on an error one of them walks again, and fails the same way */
+        wakeChain(ar, c);
+    }
+    if (res < 0) {
+        finish(ar, op, res);
+        return;
+    }
+    switch (op->state) {
+    case OP_META:
+        if (op->meta[0] != F439_TYPE_FILE) {
+            finish(ar, op, -EINVAL);
+            return;
+        }
+        if (op->done >= op->meta[1]) {
+            /* @done holds the start offset until the data is read */
+            op->length = 0;
+        } else if (op->length > op->meta[1] - op->done) {
+            op->length = op->meta[1] - op->done;
+        }
+        op->done = 0;
+        break;
+    case OP_FAT:
+        break;
+    case OP_DATA:
+        op->done += op->wanted;
+        op->pos += op->run;
+        op->offset = 0;
+        break;
+    }
+    advance(ar, op);
+}
+
+AsyncReader *asyncOpen(const char *name, unsigned depth) {
+    AsyncReader *ar = calloc(1, sizeof(AsyncReader));
+    if (ar == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return NULL;
+    }
+    if (imageOpen(&ar->img, name, PROT_READ) < 0) {
+        free(ar);
+        return NULL;
+    }
+    ar->depth = depth ? depth : 1;
+    ringOpen(ar);
+    return ar;
+}
+
+void asyncClose(AsyncReader *ar) {
+    while (ar->waitHead) {
+        AsyncOp *op = ar->waitHead;
+        ar->waitHead = op->next;
+        free(op);
+    }
+    while (ar->chains) {
+        Chain *c = ar->chains;
+        ar->chains = c->next;
+        while (c->waiters) {
+            AsyncOp *op = c->waiters;
+            c->waiters = op->next;
+            free(op);
+        }
+        free(c->blocks);
+        free(c);
+    }
+    ringClose(ar);
+    imageClose(&ar->img);
+    free(ar);
+}
+
+int asyncRead(AsyncReader *ar, const char *name, uint64_t offset, char *buf,
+              size_t length, AsyncDoneFn done, void *arg) {
+    uint32_t start = 0;
+    uint32_t n = imageDirCount(&ar->img);
+    for (uint32_t i = 0; i < n; i++) {
+        const DirEntry *e = imageDirEntry(&ar->img, i);
+        if (strncmp(e->name, name, F439_NAME_LEN) == 0) {
+            start = e->start;
+            break;
+        }
+    }
+    if (start == 0 || start >= ar->img.super->nBlocks ||
+        offset > UINT32_MAX) {
+        return -1;
+    }
+
+    AsyncOp *op = calloc(1, sizeof(AsyncOp));
+    Chain *c = findChain(ar, start);
+    if (op == NULL || c == NULL) {
+        free(op);
+        return -1;
+    }
+    imageLocate(offset, &op->pos, &op->offset);
+    op->chain = c;
+    op->buf = buf;
+    op->length = length;
+    op->done = offset;
+    op->callback = done;
+    op->arg = arg;
+    ar->pending++;
+
+    /* the first step is always the header, see complete() */
+    off_t off;
+    int fd = imageBlockFd(&ar->img, start, &off);
+    prepare(op, OP_META, fd, op->meta, sizeof(op->meta), off);
+    queue(ar, op);
+    return 0;
+}
+
+/* the pread() fallback: run every waiting step, including the ones the
+   completions queue up behind them */
+static int pollSync(AsyncReader *ar) {
+    int completed = 0;
+    while (ar->waitHead) {
+        AsyncOp *op = ar->waitHead;
+        ar->waitHead = op->next;
+        if (ar->waitHead == NULL) {
+            ar->waitTail = NULL;
+        }
+        ssize_t n = op->nIov ? preadv(op->fd, op->iov, op->nIov, op->off)
+                             : pread(op->fd, op->dst, op->len, op->off);
+        unsigned before = ar->pending;
+        complete(ar, op, n < 0 ? -errno : n);
+        completed += before - ar->pending;
+    }
+    return completed;
+}
+
+int asyncPoll(AsyncReader *ar, int wait) {
+    if (ar->ringFd < 0) {
+        return pollSync(ar);
+    }
+
+    int completed = 0;
+    for (;;) {
+        /* move waiting steps onto the ring while there is room */
+        while (ar->waitHead && ar->inFlight < ar->depth) {
+            AsyncOp *op = ar->waitHead;
+            ar->waitHead = op->next;
+            if (ar->waitHead == NULL) {
+                ar->waitTail = NULL;
+            }
+            ringPush(ar, op);
+        }
+        unsigned minComplete = (wait && completed == 0 && ar->inFlight) ? 1 : 0;
+        if (ar->toSubmit || minComplete) {
+            int rc = ioUringEnter(ar->ringFd, ar->toSubmit, minComplete,
+                                  minComplete ? IORING_ENTER_GETEVENTS : 0);
+            if (rc < 0 && errno != EINTR && errno != EAGAIN &&
+                errno != EBUSY) {
+                perror("io_uring_enter");
+                return -1;
+            }
+            if (rc > 0) {
+                ar->toSubmit -= rc;
+            }
+        }
+
+        unsigned head = *ar->cqHead;
+        unsigned tail = __atomic_load_n(ar->cqTail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            return completed;
+        }
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ar->cqes[head & *ar->cqMask];
+            AsyncOp *op = (AsyncOp *)(uintptr_t)cqe->user_data;
+            long res = cqe->res;
+            __atomic_store_n(ar->cqHead, head + 1, __ATOMIC_RELEASE);
+            ar->inFlight--;
+            unsigned before = ar->pending;
+            complete(ar, op, res);
+            completed += before - ar->pending;
+        }
+    }
+}
+
+int asyncRun(AsyncReader *ar) {
+    int completed = 0;
+    while (ar->pending) {
+        int n = asyncPoll(ar, 1);
+        if (n < 0) {
+            return -1;
+        }
+        completed += n;
+    }
+    return completed;
+}
+
+unsigned asyncPending(const AsyncReader *ar) {
+    return ar->pending;
+}
+
+int asyncIsUring(const AsyncReader *ar) {
+    return ar->ringFd >= 0;
+}
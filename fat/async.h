@@ -0,0 +1,81 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Asynchronous reads out of an image, for event driven services that
+ * cannot block a thread on the disk. A read is a small state machine that
+ * follows the file's chain through the fat, a window at a time, and then
+ * reads the data straight into the caller's buffer, a run of adjacent
+ * blocks at a time; every step is one io_uring request, so thousands of
+ * reads can be in flight on one thread and a read whose chain is cold
+ * costs no more than a few round trips to the disk. The chains are kept,
+ * so reading a file in many pieces walks its fat only once.
+ *
+ *      AsyncReader *ar = asyncOpen("image", 256);
+ *      asyncRead(ar, "name", offset, buf, length, done, arg);
+ *      ...
+ *      asyncPoll(ar, 0);   from the service's event loop, or
+ *      asyncRun(ar);       to wait for everything
+ *
+ * @done is called from asyncPoll() / asyncRun() when the read is complete,
+ * which is where a coroutine library resumes the coroutine waiting on it.
+ *
+ * The ring is set up with raw system calls (no liburing). Where io_uring is
+ * not available (old kernels, seccomp), the same API falls back to pread()
+ * inside asyncPoll(): still correct, no longer asynchronous.
+ */
+
+typedef struct AsyncReader AsyncReader;
+
+/**
+ * @brief called once per read with the number of bytes read (short at the
+ *        end of the file), or a negative errno.
+ */
+typedef void (*AsyncDoneFn)(void *arg, long result);
+
+/**
+ * @brief open @name for asynchronous reads.
+ * @param depth number of requests the ring keeps in flight at once; more
+ *        reads than that may be queued, they wait for a free slot.
+ */
+AsyncReader *asyncOpen(const char *name, unsigned depth);
+
+void asyncClose(AsyncReader *ar);
+
+/**
+ * @brief start reading @length bytes at @offset of file @name into @buf.
+ *        The directory is looked up right away, from the mapping; the fat
+ *        and the data are read asynchronously.
+ * @return 0, or -1 if there is no such (regular) file.
+ */
+int asyncRead(AsyncReader *ar, const char *name, uint64_t offset, char *buf,
+              size_t length, AsyncDoneFn done, void *arg);
+
+/**
+ * @brief submit queued requests and handle the completions that are there,
+ *        waiting for at least one if @wait and any read is outstanding.
+ * @return the number of reads completed, or -1 on a ring error.
+ */
+int asyncPoll(AsyncReader *ar, int wait);
+
+/* poll until no read is outstanding */
+int asyncRun(AsyncReader *ar);
+
+/* reads started and not yet completed */
+unsigned asyncPending(const AsyncReader *ar);
+
+/* 1 when requests go through io_uring, 0 on the pread() fallback */
+int asyncIsUring(const AsyncReader *ar);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,406 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mkfs.h"
+
+/**
+ * Batch mode builds many images in one run:
+ *
+ *      mkfs --batch <spec file> [threads]
+ *
+ * Every line of the spec file describes one image the way the normal command
+ * line does ("<image name> <nBlocks> <file0> <file1> ..."); empty lines and
+ * lines starting with '#' are skipped.
+ *
+ * Related images tend to share most of their inputs, so instead of building
+ * them one after the other, each distinct input (same device and inode) is
+ * read exactly once and every chunk read is appended to all the images that
+ * contain that file. Worker threads take inputs one at a time, so all images
+ * grow concurrently. Each image has a lock, held while a chunk is appended
+ * to it, because the free list and fat of an image are shared by all its
+ * files.
+ *
+ * The I/O limits and priority given before --batch hold for the whole
+ * batch: reads are charged here, writes by getBlock() as for any build.
+ */
+
+#define BATCH_CHUNK (1 << 20)
+
+
+typedef struct {
+    char *imageName;
+    uint32_t nBlocks;
+    char **fileNames;
+    int nFiles;
+    Image img;
+    int mapped;
+    int failed;
+    pthread_mutex_t lock;
+} BatchImage;
+
+/* one file of one image */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int image;
+    int slot;   /* position in the root directory of that image */
+} Use;
+
+/* a distinct input: a run of Uses with the same device and inode */
+typedef struct {
+    Use *uses;
+    int nUses;
+    int built;  /* taken by a worker and done with, successfully or not */
+} Input;
+
+typedef struct {
+    BatchImage *images;
+    Input *inputs;
+    int nInputs;
+    atomic_int next;
+} Batch;
+
+
+static void markFailed(BatchImage *b) {
+    pthread_mutex_lock(&b->lock);
+    b->failed = 1;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void freeImage(BatchImage *b) {
+    for (int j = 0; j < b->nFiles; j++) {
+        free(b->fileNames[j]);
+    }
+    free(b->fileNames);
+    free(b->imageName);
+    pthread_mutex_destroy(&b->lock);
+}
+
+/**
+ * @brief parse the spec file into @images.
+ * @return the number of images, -1 on failure.
+ */
+static int parseSpec(const char *specFile, BatchImage **images) {
+    FILE *f = fopen(specFile, "r");
+    if (f == NULL) {
+        perror(specFile);
+        return -1;
+    }
+    int n = 0, cap = 0, bad = 0;
+    char *line = NULL;
+    size_t lineCap = 0;
+    while (getline(&line, &lineCap, f) > 0) {
+        char *save;
+        char *tok = strtok_r(line, " \t\n", &save);
+        if (tok == NULL || tok[0] == '#') {
+            continue;
+        }
+        if (n == cap) {
+            int more = cap ? cap * 2 : 16;
+            BatchImage *p = realloc(*images, more * sizeof(BatchImage));
+            if (p == NULL) {
+                fprintf(stderr, "out of memory\n");
+                bad = 1;
+                break;
+            }
+            *images = p;
+            cap = more;
+        }
+        BatchImage *b = &(*images)[n++];
+        memset(b, 0, sizeof(*b));
+        pthread_mutex_init(&b->lock, NULL);
+        b->imageName = strdup(tok);
+        tok = strtok_r(NULL, " \t\n", &save);
+        b->nBlocks = tok ? strtoul(tok, NULL, 10) : 0;
+        int fileCap = 0;
+        int full = b->imageName == NULL;
+        while (!full && (tok = strtok_r(NULL, " \t\n", &save))) {
+            if (b->nFiles == fileCap) {
+                int more = fileCap ? fileCap * 2 : 16;
+                char **p = realloc(b->fileNames, more * sizeof(char *));
+                if (p == NULL) {
+                    full = 1;
+                    break;
+                }
+                b->fileNames = p;
+                fileCap = more;
+            }
+            char *name = strdup(tok);
+            if (name == NULL) {
+                full = 1;
+                break;
+            }
+            b->fileNames[b->nFiles++] = name;
+        }
+        if (full) {
+            fprintf(stderr, "out of memory\n");
+            bad = 1;
+            break;
+        }
+        if (b->nBlocks == 0 || b->nFiles == 0) {
+            fprintf(stderr, "%s: bad spec line for %s\n", specFile,
+                    b->imageName);
+            bad = 1;
+            break;
+        }
+    }
+    free(line);
+    fclose(f);
+    if (bad) {
+        for (int i = 0; i < n; i++) {
+            freeImage(&(*images)[i]);
+        }
+        free(*images);
+        *images = NULL;
+        return -1;
+    }
+    return n;
+}
+
+static int byInode(const void *a, const void *b) {
+    const Use *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief stat every input and group the uses of the same file together.
+ */
+static int groupInputs(Batch *batch, int nImages, Use **allUses) {
+    int nUses = 0;
+    for (int i = 0; i < nImages; i++) {
+        nUses += batch->images[i].nFiles;
+    }
+    Use *uses = malloc((nUses ? nUses : 1) * sizeof(Use));
+    if (uses == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    int k = 0;
+    for (int i = 0; i < nImages; i++) {
+        BatchImage *b = &batch->images[i];
+        for (int j = 0; j < b->nFiles; j++) {
+            struct stat st;
+            if (stat(b->fileNames[j], &st) < 0) {
+                perror(b->fileNames[j]);
+                b->failed = 1;
+                continue;
+            }
+            uses[k].dev = st.st_dev;
+            uses[k].ino = st.st_ino;
+            uses[k].image = i;
+            uses[k].slot = j;
+            k++;
+        }
+    }
+    qsort(uses, k, sizeof(Use), byInode);
+
+    batch->inputs = malloc((k ? k : 1) * sizeof(Input));
+    batch->nInputs = 0;
+    if (batch->inputs == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(uses);
+        return -1;
+    }
+    for (int i = 0; i < k;) {
+        int j = i + 1;
+        while (j < k && byInode(&uses[i], &uses[j]) == 0) {
+            j++;
+        }
+        batch->inputs[batch->nInputs].uses = &uses[i];
+        batch->inputs[batch->nInputs].nUses = j - i;
+        batch->nInputs++;
+        i = j;
+    }
+    *allUses = uses;
+    return 0;
+}
+
+/**
+ * @brief read one input once and write it into every image that has it.
+ *        A failure only affects the images involved.
+ */
+static void buildInput(Batch *batch, Input *in, char *buf) {
+    Use *first = &in->uses[0];
+    const char *path = batch->images[first->image].fileNames[first->slot];
+    FileWriter *writers = malloc(in->nUses * sizeof(FileWriter));
+    char *ok = malloc(in->nUses);
+    if (writers == NULL || ok == NULL) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        for (int u = 0; u < in->nUses; u++) {
+            markFailed(&batch->images[in->uses[u].image]);
+        }
+        free(writers);
+        free(ok);
+        return;
+    }
+
+    for (int u = 0; u < in->nUses; u++) {
+        BatchImage *b = &batch->images[in->uses[u].image];
+        pthread_mutex_lock(&b->lock);
+        ok[u] = !b->failed && writerStart(&b->img, &writers[u]) == 0;
+        if (!ok[u]) {
+            b->failed = 1;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+    }
+    int readOk = fd >= 0;
+    while (readOk) {
+        ssize_t n = read(fd, buf, BATCH_CHUNK);
+        if (n < 0) {
+            perror(path);
+            readOk = 0;
+        } else if (n == 0) {
+            break;
+        } else {
+            ioLimitRead(n);
+        }
+        for (int u = 0; readOk && u < in->nUses; u++) {
+            if (!ok[u]) {
+                continue;
+            }
+            BatchImage *b = &batch->images[in->uses[u].image];
+            pthread_mutex_lock(&b->lock);
+            if (writerAppend(&b->img, &writers[u], buf, n) < 0) {
+                ok[u] = 0;
+                b->failed = 1;
+            }
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    for (int u = 0; u < in->nUses; u++) {
+        BatchImage *b = &batch->images[in->uses[u].image];
+        if (!readOk) {
+            markFailed(b);
+        } else if (ok[u]) {
+            pthread_mutex_lock(&b->lock);
+            uint32_t start = writerFinish(&b->img, &writers[u]);
+            setDirEntry(&b->img, in->uses[u].slot,
+                        b->fileNames[in->uses[u].slot], start);
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+    free(ok);
+    free(writers);
+}
+
+/* build the inputs nobody has taken yet, until there are none left */
+static void *batchThread(void *arg) {
+    Batch *batch = arg;
+    char *buf = malloc(BATCH_CHUNK);
+    if (buf == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    for (;;) {
+        int i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->nInputs) {
+            break;
+        }
+        buildInput(batch, &batch->inputs[i], buf);
+        batch->inputs[i].built = 1;
+    }
+    free(buf);
+    return NULL;
+}
+
+int buildBatch(const char *specFile, int nThreads) {
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    int nImages = parseSpec(specFile, &batch.images);
+    if (nImages <= 0) {
+        fprintf(stderr, "%s: no images to build\n", specFile);
+        return -1;
+    }
+
+    Use *uses = NULL;
+    if (groupInputs(&batch, nImages, &uses) < 0) {
+        /* nothing is mapped yet; every image counts as failed below */
+        for (int i = 0; i < nImages; i++) {
+            batch.images[i].failed = 1;
+        }
+    }
+
+    for (int i = 0; i < nImages; i++) {
+        BatchImage *b = &batch.images[i];
+        if (b->failed ||
+            createImage(&b->img, b->imageName, b->nBlocks, 1, NULL) < 0) {
+            b->failed = 1;
+            continue;
+        }
+        b->mapped = 1;
+        if (createRoot(&b->img, b->nFiles) < 0) {
+            b->failed = 1;
+        }
+    }
+
+    if (nThreads < 1) {
+        nThreads = 1;
+    }
+    if (nThreads > batch.nInputs) {
+        nThreads = batch.nInputs ? batch.nInputs : 1;
+    }
+    pthread_t *threads = malloc(nThreads * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < nThreads) {
+        int err = pthread_create(&threads[started], NULL, batchThread, &batch);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+        started++;
+    }
+    if (started < nThreads) {
+        /* whatever the workers do not get to is built on this thread */
+        batchThread(&batch);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    /* a worker that could not get its buffer leaves inputs unbuilt */
+    for (int k = 0; k < batch.nInputs; k++) {
+        Input *in = &batch.inputs[k];
+        for (int u = 0; !in->built && u < in->nUses; u++) {
+            batch.images[in->uses[u].image].failed = 1;
+        }
+    }
+
+    int rc = 0;
+    for (int i = 0; i < nImages; i++) {
+        BatchImage *b = &batch.images[i];
+        if (b->mapped) {
+            munmap(b->img.mapStart, b->img.mapLength);
+            close(b->img.fd);
+        }
+        fprintf(stderr, "%s: %s\n", b->imageName, b->failed ? "failed" : "ok");
+        rc |= b->failed ? -1 : 0;
+        freeImage(b);
+    }
+    printf("%d images from %d distinct inputs\n", nImages, batch.nInputs);
+    free(batch.inputs);
+    free(uses);
+    free(batch.images);
+    return rc;
+}
@@ -0,0 +1,409 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "perfctr.h"
+
+/**
+ * bench runs mkfs over a synthetic set of input files and reports how fast
+ * each configuration builds the image:
+ *
+ *      bench [-r reps] [-n files] [-k sizeKB] [-d dir] <mkfs> [config ...]
+ *
+ * A config is a string of mkfs options, e.g. "-j 8 --pin". Without configs
+ * it compares parallel ingest on all CPUs unpinned against pinned ("-j N"
+ * and "-j N --pin"). The inputs are written once into a temporary directory
+ * (under -d, /tmp by default) and are warm in the page cache for every run,
+ * so what is measured is mkfs, not the source disk.
+ *
+ * Every config prints one line of JSON:
+ *
+ *      {"config":"-j 8","reps":5,"bytes":...,"median_ms":...,"min_ms":...,
+ *       "mbps":...,"samples_ms":[...],"phases":[...]}
+ *
+ * "phases" has the medians of what mkfs --phases reports for each phase of
+ * the build (see mkfs.c): its time and the cycles, instructions, LLC and
+ * dTLB misses and page faults it took, plus the IPC. Counters that cannot be
+ * read on this machine are null.
+ */
+
+#define MAX_CONFIGS 32
+#define MAX_PHASES 8
+#define PHASE_KEYS (1 + PERF_NCOUNTERS)   /* ms, then the counters */
+
+/* what the runs of one config reported for one phase */
+typedef struct {
+    char name[16];
+    double *value[PHASE_KEYS];   /* [reps] */
+    int missing[PHASE_KEYS];     /* null in at least one run */
+} Phase;
+
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int byValue(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* the median of the @n sorted values @v */
+static double medianOf(const double *v, int n) {
+    return (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static const char *phaseKey(int k) {
+    return k == 0 ? "ms" : perfNames[k - 1];
+}
+
+/**
+ * @brief the value of "@key":number in the JSON object @line.
+ * @return 1, or 0 if the key is missing or null.
+ */
+static int jsonNumber(const char *line, const char *key, double *v) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(line, pattern);
+    if (p == NULL) {
+        return 0;
+    }
+    char *end;
+    *v = strtod(p + strlen(pattern), &end);
+    return end != p + strlen(pattern);
+}
+
+/**
+ * @brief add what mkfs --phases wrote to @path as run @rep of @reps.
+ * @return the number of phases known so far.
+ */
+static int readPhases(const char *path, Phase *phases, int nPhases, int rep,
+                      int reps) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return nPhases;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        const char *p = strstr(line, "\"phase\":\"");
+        char name[16];
+        if (p == NULL || sscanf(p + 9, "%15[^\"]", name) != 1) {
+            continue;
+        }
+        int k = 0;
+        while (k < nPhases && strcmp(phases[k].name, name) != 0) {
+            k++;
+        }
+        if (k == nPhases) {
+            if (nPhases == MAX_PHASES) {
+                continue;
+            }
+            Phase *ph = &phases[nPhases++];
+            memset(ph, 0, sizeof(*ph));
+            strcpy(ph->name, name);
+            for (int j = 0; j < PHASE_KEYS; j++) {
+                ph->value[j] = calloc(reps, sizeof(double));
+                /* a phase not seen in earlier runs is incomplete */
+                ph->missing[j] = rep > 0 || ph->value[j] == NULL;
+            }
+        }
+        for (int j = 0; j < PHASE_KEYS; j++) {
+            Phase *ph = &phases[k];
+            if (ph->missing[j] || !jsonNumber(line, phaseKey(j),
+                                              &ph->value[j][rep])) {
+                ph->missing[j] = 1;
+            }
+        }
+    }
+    fclose(f);
+    return nPhases;
+}
+
+/* ,"phases":[...] with the medians of every phase over @reps runs */
+static void printPhases(Phase *phases, int nPhases, int reps) {
+    printf(",\"phases\":[");
+    for (int k = 0; k < nPhases; k++) {
+        Phase *ph = &phases[k];
+        double median[PHASE_KEYS];
+        printf("%s{\"phase\":\"%s\"", k ? "," : "", ph->name);
+        for (int j = 0; j < PHASE_KEYS; j++) {
+            if (ph->missing[j]) {
+                printf(",\"%s\":null", phaseKey(j));
+                continue;
+            }
+            qsort(ph->value[j], reps, sizeof(double), byValue);
+            median[j] = medianOf(ph->value[j], reps);
+            printf(j == 0 ? ",\"%s\":%.3f" : ",\"%s\":%.0f", phaseKey(j),
+                   median[j]);
+        }
+        int c = 1 + PERF_CYCLES, in = 1 + PERF_INSTRUCTIONS;
+        if (!ph->missing[c] && !ph->missing[in] && median[c] > 0) {
+            printf(",\"ipc\":%.2f}", median[in] / median[c]);
+        } else {
+            printf(",\"ipc\":null}");
+        }
+    }
+    printf("]");
+}
+
+static void freePhases(Phase *phases, int nPhases) {
+    for (int k = 0; k < nPhases; k++) {
+        for (int j = 0; j < PHASE_KEYS; j++) {
+            free(phases[k].value[j]);
+        }
+    }
+}
+
+/* write @size bytes of a cheap pseudo random pattern, so nothing compresses
+   or dedups by accident */
+static int makeInput(const char *path, size_t size, uint32_t seed) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    uint32_t buf[16384];
+    uint32_t x = seed * 2654435761u + 1;
+    while (size) {
+        for (size_t i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            buf[i] = x;
+        }
+        size_t n = size < sizeof(buf) ? size : sizeof(buf);
+        if (write(fd, buf, n) != (ssize_t)n) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        size -= n;
+    }
+    close(fd);
+    return 0;
+}
+
+/* remove @dir and everything mkfs left in it: the image, its stripes, its
+   bulk tier, its reverse map, ... */
+static void removeDir(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while (d && (e = readdir(d))) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+        char path[4400];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (unlink(path) < 0) {
+            perror(path);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    if (rmdir(dir) < 0) {
+        perror(dir);
+    }
+}
+
+/**
+ * @brief run mkfs once: mkfs <config words> [--phases @phases] <image>
+ *        <nBlocks> <inputs...>
+ * @return the wall clock time in ms, or a negative value if mkfs failed.
+ */
+static double runOnce(const char *mkfs, const char *config, const char *phases,
+                      const char *image, const char *nBlocks, char **inputs,
+                      int nInputs) {
+    /* mkfs, the words, --phases <file>, image, nBlocks, inputs, NULL */
+    int nWords = 0;
+    for (const char *p = config; *p; p++) {
+        nWords += *p != ' ' && (p == config || p[-1] == ' ');
+    }
+    char *words = strdup(config);
+    char **argv = malloc((nWords + nInputs + 6) * sizeof(char *));
+    if (words == NULL || argv == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(words);
+        free(argv);
+        return -1;
+    }
+    int argc = 0;
+    argv[argc++] = (char *)mkfs;
+    char *save;
+    for (char *w = strtok_r(words, " ", &save); w;
+         w = strtok_r(NULL, " ", &save)) {
+        argv[argc++] = w;
+    }
+    if (phases) {
+        argv[argc++] = "--phases";
+        argv[argc++] = (char *)phases;
+    }
+    argv[argc++] = (char *)image;
+    argv[argc++] = (char *)nBlocks;
+    for (int i = 0; i < nInputs; i++) {
+        argv[argc++] = inputs[i];
+    }
+    argv[argc] = NULL;
+
+    double start = nowMs();
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(mkfs, argv);
+        perror(mkfs);
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    double ms = nowMs() - start;
+    free(argv);
+    free(words);
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return ms;
+}
+
+/* print @s as a JSON string */
+static void printJsonString(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            printf("\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            printf("\\u%04x", *s);
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+int main(int argc, char *argv[]) {
+    int reps = 5, nInputs = 16;
+    size_t sizeKB = 8192;
+    const char *dir = "/tmp";
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            reps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            nInputs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            sizeKB = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else {
+            break;
+        }
+    }
+    /* the root directory of an image holds at most 31 files */
+    if (i >= argc || reps < 1 || nInputs < 1 || nInputs > 31) {
+        fprintf(stderr, "usage: %s [-r reps] [-n files (1-31)] [-k sizeKB] "
+                        "[-d dir] <mkfs> [config ...]\n", argv[0]);
+        exit(1);
+    }
+    const char *mkfs = argv[i++];
+
+    const char *configs[MAX_CONFIGS];
+    int nConfigs = 0;
+    char defaults[2][64];
+    if (i == argc) {
+        long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+        snprintf(defaults[0], sizeof(defaults[0]), "-j %ld", nCpus);
+        snprintf(defaults[1], sizeof(defaults[1]), "-j %ld --pin", nCpus);
+        configs[nConfigs++] = defaults[0];
+        configs[nConfigs++] = defaults[1];
+    }
+    for (; i < argc && nConfigs < MAX_CONFIGS; i++) {
+        configs[nConfigs++] = argv[i];
+    }
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s/f439bench.XXXXXX", dir);
+    if (mkdtemp(tmp) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    char **inputs = malloc(nInputs * sizeof(char *));
+    size_t bytes = 0;
+    int rc = 0;
+    for (int k = 0; k < nInputs; k++) {
+        inputs[k] = malloc(strlen(tmp) + 32);
+        sprintf(inputs[k], "%s/in%d", tmp, k);
+        if (makeInput(inputs[k], sizeKB * 1024, k + 1) < 0) {
+            rc = 1;
+            nInputs = k + 1;
+            goto cleanup;
+        }
+        bytes += sizeKB * 1024;
+    }
+
+    /* every file fits with room to spare: data, one extra block per file,
+       the fat (4 bytes per block) and 10% */
+    char nBlocks[32];
+    snprintf(nBlocks, sizeof(nBlocks), "%zu",
+             (size_t)((bytes / 512 + nInputs * 2 + 64) * 1.1 * 516 / 512));
+    char image[4200], phaseFile[4200];
+    snprintf(image, sizeof(image), "%s/out.img", tmp);
+    snprintf(phaseFile, sizeof(phaseFile), "%s/phases.json", tmp);
+
+    double *samples = malloc(reps * sizeof(double));
+    for (int c = 0; c < nConfigs; c++) {
+        /* one untimed run so every config starts with the same warm state */
+        runOnce(mkfs, configs[c], NULL, image, nBlocks, inputs, nInputs);
+        Phase phases[MAX_PHASES];
+        int nPhases = 0;
+        int ok = 1;
+        for (int r = 0; r < reps && ok; r++) {
+            samples[r] = runOnce(mkfs, configs[c], phaseFile, image, nBlocks,
+                                 inputs, nInputs);
+            ok = samples[r] >= 0;
+            if (ok) {
+                nPhases = readPhases(phaseFile, phases, nPhases, r, reps);
+            }
+        }
+        if (!ok) {
+            freePhases(phases, nPhases);
+            fprintf(stderr, "mkfs failed with config \"%s\"\n", configs[c]);
+            rc = 1;
+            continue;
+        }
+        double sorted[reps];
+        memcpy(sorted, samples, reps * sizeof(double));
+        qsort(sorted, reps, sizeof(double), byValue);
+        double median = medianOf(sorted, reps);
+        printf("{\"config\":");
+        printJsonString(configs[c]);
+        printf(",\"reps\":%d,\"bytes\":%zu,\"median_ms\":%.3f,"
+               "\"min_ms\":%.3f,\"mbps\":%.1f,\"samples_ms\":[", reps,
+               bytes, median, sorted[0], bytes / 1e6 / (median / 1e3));
+        for (int r = 0; r < reps; r++) {
+            printf("%s%.3f", r ? "," : "", samples[r]);
+        }
+        printf("]");
+        if (nPhases > 0) {
+            printPhases(phases, nPhases, reps);
+        }
+        freePhases(phases, nPhases);
+        printf("}\n");
+        fflush(stdout);
+    }
+    free(samples);
+
+cleanup:
+    for (int k = 0; k < nInputs; k++) {
+        free(inputs[k]);
+    }
+    free(inputs);
+    removeDir(tmp);
+    return rc;
+}
@@ -0,0 +1,342 @@
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * benchcmp compares saved benchmark results against a baseline and flags
+ * regressions, so an upgrade of mkfs (or of the machine) can be gated on
+ * performance:
+ *
+ *      benchcmp [-t percent] [-a alpha] <baseline> <current>
+ *
+ * Both files hold JSON lines as bench prints them; any tool can take part as
+ * long as each line has a "config" string and the individual repetitions in
+ * "samples_ms" ("bytes" is optional and gives the throughput):
+ *
+ *      {"config":"-j 8","bytes":134217728,"samples_ms":[81.2,80.9,...],...}
+ *
+ * Lines with the same config are pooled, so a baseline can be grown by
+ * appending the output of several runs (bench ... >> baseline.json).
+ *
+ * For every config in both files it prints the median time with a
+ * distribution free confidence interval (from order statistics, 1 - alpha,
+ * 95% by default) and the change of the median. A config is a regression
+ * when its median got slower by more than the threshold (-t, 5% by default)
+ * and the two intervals do not overlap, i.e. the difference is both large
+ * and not noise; it is an improvement the other way round. With few
+ * repetitions the interval cannot reach 1 - alpha; the coverage it does
+ * reach is printed, and 6 or more repetitions per side are needed for 95%.
+ *
+ * The per phase medians of bench ("phases") are compared as well, for
+ * information only: they carry no samples to test.
+ *
+ * Exit status: 0 no regression, 1 regression, 2 error.
+ */
+
+#define MAX_CONFIGS 64
+#define MAX_PHASES 8
+
+typedef struct {
+    char name[16];
+    double ms;           /* mean of the runs' medians */
+    int runs;
+} PhaseMs;
+
+typedef struct {
+    char config[128];
+    double *samples;
+    int n, cap;
+    double bytes;        /* 0 if unknown */
+    PhaseMs phases[MAX_PHASES];
+    int nPhases;
+} Result;
+
+typedef struct {
+    Result results[MAX_CONFIGS];
+    int n;
+} ResultSet;
+
+typedef struct {
+    double median;
+    double lo, hi;
+    double coverage;
+} Estimate;
+
+
+static int byValue(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* the string value of "@key" in @line, into @buf; @return 0 if missing */
+static int jsonString(const char *line, const char *key, char *buf,
+                      size_t size) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+    const char *p = strstr(line, pattern);
+    if (p == NULL) {
+        return 0;
+    }
+    p += strlen(pattern);
+    /* bench escapes '"' and '\\' with a backslash */
+    size_t n = 0;
+    for (; *p != '"'; p++) {
+        if (*p == '\\') {
+            p++;
+        }
+        if (*p == '\0') {
+            return 0;
+        }
+        if (n < size - 1) {
+            buf[n++] = *p;
+        }
+    }
+    buf[n] = 0;
+    return 1;
+}
+
+/* the number after "@key": in @from; @return 0 if missing or null */
+static int jsonNumber(const char *from, const char *key, double *v) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(from, pattern);
+    if (p == NULL) {
+        return 0;
+    }
+    p += strlen(pattern);
+    char *end;
+    *v = strtod(p, &end);
+    return end != p;
+}
+
+static Result *findResult(ResultSet *set, const char *config) {
+    for (int k = 0; k < set->n; k++) {
+        if (strcmp(set->results[k].config, config) == 0) {
+            return &set->results[k];
+        }
+    }
+    if (set->n == MAX_CONFIGS) {
+        return NULL;
+    }
+    Result *r = &set->results[set->n++];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->config, sizeof(r->config), "%s", config);
+    return r;
+}
+
+static int addSample(Result *r, double v) {
+    if (r->n == r->cap) {
+        int cap = r->cap ? r->cap * 2 : 16;
+        double *more = realloc(r->samples, cap * sizeof(double));
+        if (more == NULL) {
+            return -1;
+        }
+        r->samples = more;
+        r->cap = cap;
+    }
+    r->samples[r->n++] = v;
+    return 0;
+}
+
+/* the "phases" of bench: a running mean of the medians is enough here */
+static void addPhases(Result *r, const char *line) {
+    const char *p = strstr(line, "\"phases\":[");
+    while (p && (p = strstr(p, "{\"phase\":\"")) != NULL) {
+        char name[16];
+        double ms;
+        if (jsonString(p, "phase", name, sizeof(name)) &&
+            jsonNumber(p, "ms", &ms)) {
+            int k = 0;
+            while (k < r->nPhases && strcmp(r->phases[k].name, name) != 0) {
+                k++;
+            }
+            if (k == r->nPhases && k < MAX_PHASES) {
+                snprintf(r->phases[k].name, sizeof(r->phases[k].name), "%s",
+                         name);
+                r->nPhases++;
+            }
+            if (k < r->nPhases) {
+                PhaseMs *ph = &r->phases[k];
+                ph->runs++;
+                ph->ms += (ms - ph->ms) / ph->runs;
+            }
+        }
+        p++;
+    }
+}
+
+/* @return 0, or -1 with an error message */
+static int loadResults(const char *path, ResultSet *set) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    set->n = 0;
+    char *line = NULL;
+    size_t size = 0;
+    int lineNo = 0, rc = 0;
+    while (getline(&line, &size, f) > 0) {
+        lineNo++;
+        char config[128];
+        const char *p = strstr(line, "\"samples_ms\":[");
+        if (!jsonString(line, "config", config, sizeof(config)) || p == NULL) {
+            continue;   /* not a result; bench may share a log */
+        }
+        Result *r = findResult(set, config);
+        if (r == NULL) {
+            fprintf(stderr, "%s:%d: more than %d configs\n", path, lineNo,
+                    MAX_CONFIGS);
+            rc = -1;
+            break;
+        }
+        p += strlen("\"samples_ms\":[");
+        for (;;) {
+            char *end;
+            double v = strtod(p, &end);
+            if (end == p) {
+                break;
+            }
+            if (addSample(r, v) < 0) {
+                fprintf(stderr, "out of memory\n");
+                rc = -1;
+                break;
+            }
+            p = end;
+            if (*p == ',') {
+                p++;
+            }
+        }
+        double bytes;
+        if (jsonNumber(line, "bytes", &bytes)) {
+            r->bytes = bytes;
+        }
+        addPhases(r, line);
+    }
+    free(line);
+    fclose(f);
+    return rc;
+}
+
+static void freeResults(ResultSet *set) {
+    for (int k = 0; k < set->n; k++) {
+        free(set->results[k].samples);
+    }
+}
+
+/* P(X <= k) for X ~ Binomial(n, 1/2) */
+static double binomialCdf(int n, int k) {
+    double sum = 0;
+    for (int i = 0; i <= k; i++) {
+        sum += exp(lgamma(n + 1) - lgamma(i + 1) - lgamma(n - i + 1) -
+                   n * log(2));
+    }
+    return sum;
+}
+
+/**
+ * @brief the median of @r and its confidence interval [x(j), x(n+1-j)]:
+ *        the largest j (from 1) with P(X < j) <= alpha / 2, so the interval
+ *        covers the true median with probability 1 - 2 P(X < j). With too
+ *        few samples it is [min, max].
+ */
+static Estimate estimate(Result *r, double alpha) {
+    Estimate e;
+    double *x = r->samples;
+    int n = r->n;
+    qsort(x, n, sizeof(double), byValue);
+    e.median = (n % 2) ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+    int j = 1;
+    while (j + 1 <= (n + 1) / 2 && binomialCdf(n, j) <= alpha / 2) {
+        j++;
+    }
+    e.lo = x[j - 1];
+    e.hi = x[n - j];
+    e.coverage = 1 - 2 * binomialCdf(n, j - 1);
+    return e;
+}
+
+int main(int argc, char *argv[]) {
+    double threshold = 5, alpha = 0.05;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            alpha = atof(argv[++i]);
+        } else {
+            break;
+        }
+    }
+    if (argc - i != 2 || alpha <= 0 || alpha >= 1) {
+        fprintf(stderr, "usage: %s [-t percent] [-a alpha] <baseline> "
+                        "<current>\n", argv[0]);
+        exit(2);
+    }
+
+    static ResultSet base, cur;
+    if (loadResults(argv[i], &base) < 0 || loadResults(argv[i + 1], &cur) < 0) {
+        exit(2);
+    }
+
+    printf("%-20s %28s %28s %8s %8s\n", "config", "baseline ms [CI]",
+           "current ms [CI]", "change", "MB/s");
+    int regressions = 0, compared = 0;
+    for (int k = 0; k < cur.n; k++) {
+        Result *c = &cur.results[k];
+        Result *b = findResult(&base, c->config);
+        if (b == NULL || b->n == 0 || c->n == 0) {
+            printf("%-20s %28s\n", c->config[0] ? c->config : "(default)",
+                   "(no baseline)");
+            continue;
+        }
+        compared++;
+        Estimate eb = estimate(b, alpha), ec = estimate(c, alpha);
+        double change = (ec.median - eb.median) / eb.median * 100;
+        const char *verdict = "";
+        if (change > threshold && ec.lo > eb.hi) {
+            verdict = "  REGRESSION";
+            regressions++;
+        } else if (change < -threshold && ec.hi < eb.lo) {
+            verdict = "  faster";
+        } else if (fabs(change) > threshold) {
+            verdict = "  (noise?)";
+        }
+
+        char sb[64], sc[64], mbps[16] = "";
+        snprintf(sb, sizeof(sb), "%.2f [%.2f, %.2f]", eb.median, eb.lo, eb.hi);
+        snprintf(sc, sizeof(sc), "%.2f [%.2f, %.2f]", ec.median, ec.lo, ec.hi);
+        if (c->bytes > 0) {
+            snprintf(mbps, sizeof(mbps), "%.1f", c->bytes / 1e3 / ec.median);
+        }
+        printf("%-20s %28s %28s %+7.1f%% %8s%s\n",
+               c->config[0] ? c->config : "(default)", sb, sc, change, mbps,
+               verdict);
+        if (ec.coverage < 1 - alpha || eb.coverage < 1 - alpha) {
+            printf("%-20s (intervals cover %.0f%% / %.0f%%: too few "
+                   "repetitions for %.0f%%)\n", "", eb.coverage * 100,
+                   ec.coverage * 100, (1 - alpha) * 100);
+        }
+
+        for (int p = 0; p < c->nPhases; p++) {
+            for (int q = 0; q < b->nPhases; q++) {
+                if (strcmp(b->phases[q].name, c->phases[p].name) == 0 &&
+                    b->phases[q].ms > 0) {
+                    printf("%-20s   %-8s %10.2f -> %10.2f ms %+7.1f%%\n", "",
+                           c->phases[p].name, b->phases[q].ms,
+                           c->phases[p].ms,
+                           (c->phases[p].ms - b->phases[q].ms) /
+                               b->phases[q].ms * 100);
+                }
+            }
+        }
+    }
+    printf("%d configs compared, %d regressions beyond %.1f%%\n", compared,
+           regressions, threshold);
+
+    freeResults(&base);
+    freeResults(&cur);
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,544 @@
+#define _GNU_SOURCE   /* copy_file_range() */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>  /* FICLONE */
+#include "mkfs.h"
+#include "probes.h"
+
+/**
+ * Content defined chunking (mkfs --cdc, mkfs --prev <old image>) stores
+ * every input as a list of variable sized chunks instead of one chain:
+ *
+ *      mkfs --cdc <image> <nBlocks> <files...>
+ *      mkfs --prev <yesterday.img> <today.img> <nBlocks> <files...>
+ *
+ * Chunk boundaries are found with a gear hash (FastCDC): a rolling hash of
+ * the last 64 bytes, shifted one bit and added to per byte, and a boundary
+ * wherever its masked bits are zero. Boundaries depend on the content only,
+ * so an insertion early in a file moves the bytes after it but leaves them
+ * cut into the same chunks. The mask takes more bits before the average
+ * chunk size and fewer after it (normalized chunking), which keeps chunk
+ * sizes close to the average, and the first CDC_MIN bytes of a chunk are
+ * not hashed at all, which is where most of the speed comes from.
+ *
+ * Each chunk is a block aligned chain of its own. A chunk whose contents
+ * are already in the image (same hash, same length, same bytes) is not
+ * stored again, and all chunks are listed in the chunk index, a regular
+ * file named F439_CHUNK_INDEX in the last directory entry.
+ *
+ * With --prev the new image starts as a copy of the previous generation,
+ * cloned (FICLONE) when the file system can share extents, and everything
+ * but its chunks is freed. The chunk index of the previous image tells
+ * which of those chunks can be referenced again; the ones nobody refers to
+ * any more are freed at the end. Chunks that are reused are never written,
+ * so a cloned image shares them on disk with the previous one.
+ */
+
+#define CDC_MIN (2 * 1024)
+#define CDC_AVG (8 * 1024)
+#define CDC_MAX (64 * 1024)
+/* the gear hash must have this many low zero bits (15 and 11 of them)
+   before and after CDC_AVG */
+#define CDC_MASK_S 0x0003590703530000ull
+#define CDC_MASK_L 0x0000d90003530000ull
+
+/* inputs are read in pieces this large; it must be well above CDC_MAX */
+#define CDC_BUFFER (1u << 20)
+
+
+typedef struct {
+    uint64_t hash;
+    uint32_t start;   /* first block of the chunk; 0 for an empty slot */
+    uint32_t length;
+    uint32_t refs;    /* references from files of this build */
+    uint32_t old;     /* the chunk came with the previous image */
+} ChunkEntry;
+
+/* open addressing hash table of all chunks in the image */
+typedef struct {
+    ChunkEntry *slots;
+    uint32_t mask;
+    uint32_t n;
+} ChunkTable;
+
+typedef struct {
+    uint32_t newChunks, reusedChunks, freedChunks;
+    uint64_t newBytes, reusedBytes;
+} CdcStats;
+
+
+static uint64_t gear[256];
+
+/* the gear table must be the same in every generation, so it comes from a
+   fixed seed rather than from anything random */
+static void gearInit(void) {
+    uint64_t x = 0x439cdc;
+    for (int i = 0; i < 256; i++) {
+        /* splitmix64 */
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * @brief where the chunk at the start of @p ends.
+ * @param n bytes available; at least CDC_MAX unless the file ends sooner
+ */
+static size_t cdcCut(const unsigned char *p, size_t n) {
+    if (n <= CDC_MIN) {
+        return n;
+    }
+    if (n > CDC_MAX) {
+        n = CDC_MAX;
+    }
+    size_t normal = n < CDC_AVG ? n : CDC_AVG;
+    uint64_t h = 0;
+    size_t i = CDC_MIN;
+    for (; i < normal; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CDC_MASK_S)) {
+            return i + 1;
+        }
+    }
+    for (; i < n; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CDC_MASK_L)) {
+            return i + 1;
+        }
+    }
+    return n;
+}
+
+static uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 33)) * 0xff51afd7ed558ccdull;
+    z = (z ^ (z >> 33)) * 0xc4ceb9fe1a85ec53ull;
+    return z ^ (z >> 33);
+}
+
+/* identity of a chunk; a match is always confirmed by comparing bytes */
+static uint64_t chunkHash(const unsigned char *p, size_t n) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        h = (h ^ mix64(v)) * 0x9fb21c651e98df25ull;
+        h ^= h >> 29;
+    }
+    for (; i < n; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return mix64(h);
+}
+
+static int tableInit(ChunkTable *t, uint32_t nSlots) {
+    t->slots = calloc(nSlots, sizeof(ChunkEntry));
+    t->mask = nSlots - 1;
+    t->n = 0;
+    return t->slots ? 0 : -1;
+}
+
+static ChunkEntry *tableInsert(ChunkTable *t, uint64_t hash, uint32_t start,
+                               uint32_t length);
+
+/* double the table once it is half full */
+static int tableGrow(ChunkTable *t) {
+    ChunkTable bigger;
+    if (tableInit(&bigger, (t->mask + 1) * 2) < 0) {
+        return -1;
+    }
+    for (uint32_t s = 0; s <= t->mask; s++) {
+        ChunkEntry *e = &t->slots[s];
+        if (e->start) {
+            *tableInsert(&bigger, e->hash, e->start, e->length) = *e;
+        }
+    }
+    free(t->slots);
+    *t = bigger;
+    return 0;
+}
+
+/* @return the new entry, NULL when out of memory */
+static ChunkEntry *tableInsert(ChunkTable *t, uint64_t hash, uint32_t start,
+                               uint32_t length) {
+    if (2 * (t->n + 1) > t->mask + 1 && tableGrow(t) < 0) {
+        return NULL;
+    }
+    uint32_t s = hash & t->mask;
+    while (t->slots[s].start) {
+        s = (s + 1) & t->mask;
+    }
+    ChunkEntry *e = &t->slots[s];
+    e->hash = hash;
+    e->start = start;
+    e->length = length;
+    e->refs = 0;
+    e->old = 0;
+    t->n++;
+    return e;
+}
+
+/* does the chain at @start hold exactly @data? */
+static int sameChunk(const Image *img, uint32_t start, const char *data,
+                     uint32_t length) {
+    uint32_t b = start;
+    for (uint32_t off = 0; off < length; off += F439_BLOCK_SIZE) {
+        if (b == 0 || b >= img->super->nBlocks) {
+            return 0;
+        }
+        uint32_t n = length - off < F439_BLOCK_SIZE ? length - off
+                                                    : F439_BLOCK_SIZE;
+        if (memcmp(imageToPtr(img, b, 0), data + off, n) != 0) {
+            return 0;
+        }
+        b = img->fat[b];
+    }
+    return 1;
+}
+
+static ChunkEntry *tableFind(const ChunkTable *t, const Image *img,
+                             uint64_t hash, const char *data, uint32_t length) {
+    uint32_t s = hash & t->mask;
+    while (t->slots[s].start) {
+        ChunkEntry *e = &t->slots[s];
+        if (e->hash == hash && e->length == length &&
+            sameChunk(img, e->start, data, length)) {
+            return e;
+        }
+        s = (s + 1) & t->mask;
+    }
+    return NULL;
+}
+
+/* write @data into a chain of its own; @return its first block, 0 if the
+   disk is full */
+static uint32_t storeChunk(Image *img, const char *data, uint32_t length) {
+    uint32_t head = 0, prev = 0;
+    for (uint32_t off = 0; off < length; off += F439_BLOCK_SIZE) {
+        uint32_t b = getBlock(img);
+        if (b == 0) {
+            freeChain(img, head);
+            return 0;
+        }
+        if (prev) {
+            img->fat[prev] = b;
+        } else {
+            head = b;
+        }
+        uint32_t n = length - off < F439_BLOCK_SIZE ? length - off
+                                                    : F439_BLOCK_SIZE;
+        char *dest = imageToPtr(img, b, 0);
+        memcpy(dest, data + off, n);
+        memset(dest + n, 0, F439_BLOCK_SIZE - n);
+        prev = b;
+    }
+    return head;
+}
+
+/* the chunk index of the previous image, as chunks nobody refers to yet */
+static int loadPrevious(ChunkTable *t, const char *path, uint32_t nBlocks) {
+    Image prev;
+    if (imageOpen(&prev, path, PROT_READ) < 0) {
+        return -1;
+    }
+    uint32_t head = 0;
+    for (uint32_t i = 0; i < imageDirCount(&prev); i++) {
+        DirEntry *de = imageDirEntry(&prev, i);
+        if (strncmp(de->name, F439_CHUNK_INDEX, F439_NAME_LEN) == 0) {
+            head = de->start;
+        }
+    }
+
+    int rc = 0;
+    if (head && head < nBlocks && imageFileType(&prev, head) == F439_TYPE_FILE) {
+        /* the first block holds 512 - 8 bytes, so records may straddle two
+           blocks; they are copied out piece by piece */
+        uint32_t left = imageFileSize(&prev, head);
+        uint32_t b = head, offset = F439_HEADER_SIZE;
+        while (left >= sizeof(ChunkRecord)) {
+            ChunkRecord r;
+            char *p = (char *)&r;
+            for (uint32_t got = 0; got < sizeof(r) && b != 0; ) {
+                if (offset == F439_BLOCK_SIZE) {
+                    b = prev.fat[b];
+                    offset = 0;
+                    if (b == 0 || b >= nBlocks) {
+                        b = 0;
+                        break;
+                    }
+                }
+                uint32_t n = sizeof(r) - got;
+                if (n > F439_BLOCK_SIZE - offset) {
+                    n = F439_BLOCK_SIZE - offset;
+                }
+                memcpy(p + got, imageToPtr(&prev, b, offset), n);
+                got += n;
+                offset += n;
+            }
+            if (b == 0) {
+                break;
+            }
+            left -= sizeof(r);
+            if (r.start == 0 || r.start >= nBlocks || r.length == 0) {
+                continue;
+            }
+            ChunkEntry *e = tableInsert(t, r.hash, r.start, r.length);
+            if (e == NULL) {
+                rc = -1;
+                break;
+            }
+            e->old = 1;
+        }
+    }
+    imageClose(&prev);
+    return rc;
+}
+
+/* copy @from to @to, sharing extents if the file system supports it */
+static int copyImage(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    if (in < 0) {
+        perror(from);
+        return -1;
+    }
+    int out = open(to, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (out < 0) {
+        perror(to);
+        close(in);
+        return -1;
+    }
+    int rc = 0;
+    if (ioctl(out, FICLONE, in) < 0) {
+        struct stat st;
+        fstat(in, &st);
+        /* a piece at a time, so that the I/O limits can pace it */
+        off_t left = st.st_size, done = 0;
+        while (left > 0) {
+            ssize_t n = copy_file_range(in, NULL, out, NULL,
+                                        left < LIMIT_PIECE ? left : LIMIT_PIECE,
+                                        0);
+            if (n <= 0) {
+                perror("copy_file_range");
+                rc = -1;
+                break;
+            }
+            ioLimitRead(n);
+            ioLimitWrite(n);
+            if (ioLimitsWrite()) {
+                sync_file_range(out, done, n, SYNC_FILE_RANGE_WRITE);
+            }
+            done += n;
+            left -= n;
+        }
+    }
+    close(in);
+    close(out);
+    return rc;
+}
+
+int reuseImage(Image *img, const BuildSpec *spec) {
+    struct stat from, to;
+    if (stat(spec->previous, &from) == 0 && stat(spec->imageName, &to) == 0 &&
+        from.st_dev == to.st_dev && from.st_ino == to.st_ino) {
+        fprintf(stderr, "the new image must not overwrite the previous one\n");
+        return -1;
+    }
+    if (copyImage(spec->previous, spec->imageName) < 0 ||
+        imageOpen(img, spec->imageName, PROT_READ | PROT_WRITE) < 0) {
+        return -1;
+    }
+    if (img->super->nBlocks != spec->nBlocks) {
+        fprintf(stderr, "%s has %u blocks, not %u\n", spec->previous,
+                img->super->nBlocks, spec->nBlocks);
+        imageClose(img);
+        return -1;
+    }
+
+    /* every chain in the directory goes: files, chunk lists and the old
+       chunk index; chunks are only reachable through the chunk index */
+    for (uint32_t i = 0; i < imageDirCount(img); i++) {
+        uint32_t start = imageDirEntry(img, i)->start;
+        if (start >= imageFirstData(img->super->nBlocks) &&
+            start < img->super->nBlocks) {
+            freeChain(img, start);
+        }
+    }
+    freeChain(img, img->super->root);
+    if (createRoot(img, spec->nFiles + 1) < 0) {
+        imageClose(img);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief cut one input into chunks and write its chunk list.
+ * @return the first block of the chunked file, 0 on failure.
+ */
+static uint32_t chunkFile(Image *img, const char *fileName, int decompress,
+                          ChunkTable *t, char *buf, CdcStats *stats) {
+    F439_PROBE1(file_start, fileName);
+    InputReader in;
+    if (inputOpen(&in, fileName, decompress) < 0) {
+        fprintf(stderr, "%s: %s\n", fileName, strerror(errno));
+        return 0;
+    }
+    sourceAdvise(in.fd);
+    FileWriter w;
+    if (writerStart(img, &w) < 0) {
+        inputClose(&in);
+        return 0;
+    }
+
+    uint64_t size = 0;
+    size_t pos = 0, have = 0;
+    off_t dropped = 0;
+    int eof = 0;
+    for (;;) {
+        /* keep at least CDC_MAX bytes ahead so every cut sees a full
+           window, moving the tail to the front when the buffer runs out */
+        if (!eof && have - pos < CDC_MAX) {
+            memmove(buf, buf + pos, have - pos);
+            have -= pos;
+            pos = 0;
+            while (!eof && have < CDC_BUFFER) {
+                ssize_t n = inputRead(&in, buf + have, CDC_BUFFER - have);
+                if (n < 0) {
+                    fprintf(stderr, "%s: %s\n", fileName, strerror(errno));
+                    inputClose(&in);
+                    return 0;
+                }
+                eof = n == 0;
+                have += n;
+                sourceDropBehind(in.fd, &dropped, in.consumed, eof);
+            }
+        }
+        if (pos == have) {
+            break;
+        }
+
+        const char *data = buf + pos;
+        uint32_t length = cdcCut((const unsigned char *)data, have - pos);
+        uint64_t hash = chunkHash((const unsigned char *)data, length);
+        ChunkEntry *e = tableFind(t, img, hash, data, length);
+        if (e) {
+            stats->reusedChunks++;
+            stats->reusedBytes += length;
+        } else {
+            uint32_t start = storeChunk(img, data, length);
+            if (start == 0 || (e = tableInsert(t, hash, start, length)) == NULL) {
+                inputClose(&in);
+                return 0;
+            }
+            stats->newChunks++;
+            stats->newBytes += length;
+        }
+        e->refs++;
+
+        ChunkRef ref = {e->start, length};
+        if (writerAppend(img, &w, (const char *)&ref, sizeof(ref)) < 0) {
+            inputClose(&in);
+            return 0;
+        }
+        size += length;
+        pos += length;
+    }
+    inputClose(&in);
+    if (size > UINT32_MAX) {
+        fprintf(stderr, "%s: too large\n", fileName);
+        return 0;
+    }
+
+    uint32_t start = writerFinish(img, &w);
+    uint32_t *fileMetaData = (uint32_t *)imageToPtr(img, start, 0);
+    fileMetaData[0] = F439_TYPE_CHUNKED;
+    fileMetaData[1] = size;
+    return start;
+}
+
+/* list every chunk still in use; @return the first block, 0 on failure */
+static uint32_t writeChunkIndex(Image *img, const ChunkTable *t) {
+    FileWriter w;
+    if (writerStart(img, &w) < 0) {
+        return 0;
+    }
+    for (uint32_t s = 0; s <= t->mask; s++) {
+        const ChunkEntry *e = &t->slots[s];
+        if (e->start && e->refs) {
+            ChunkRecord r = {e->hash, e->start, e->length};
+            if (writerAppend(img, &w, (const char *)&r, sizeof(r)) < 0) {
+                return 0;
+            }
+        }
+    }
+    return writerFinish(img, &w);
+}
+
+int ingestChunked(Image *img, const BuildSpec *spec, FileDoneFn done,
+                  void *arg) {
+    static int gearReady;
+    if (!gearReady) {
+        gearInit();
+        gearReady = 1;
+    }
+
+    ChunkTable t;
+    char *buf = malloc(CDC_BUFFER);
+    if (buf == NULL || tableInit(&t, 1024) < 0) {
+        fprintf(stderr, "out of memory\n");
+        free(buf);
+        return -1;
+    }
+    int rc = 0;
+    if (spec->previous &&
+        loadPrevious(&t, spec->previous, img->super->nBlocks) < 0) {
+        rc = -1;
+    }
+
+    CdcStats stats;
+    memset(&stats, 0, sizeof(stats));
+    for (int k = 0; k < spec->nFiles && rc == 0; k++) {
+        int i = specInput(spec, k);
+        uint32_t x = chunkFile(img, spec->fileNames[i], spec->decompress, &t,
+                               buf, &stats);
+        if (x == 0 || done(arg, i, x, NULL) < 0) {
+            rc = -1;
+        }
+    }
+
+    if (rc == 0) {
+        /* chunks of the previous image that no file refers to any more */
+        for (uint32_t s = 0; s <= t.mask; s++) {
+            ChunkEntry *e = &t.slots[s];
+            if (e->start && e->old && e->refs == 0) {
+                freeChain(img, e->start);
+                stats.freedChunks++;
+            }
+        }
+        uint32_t x = writeChunkIndex(img, &t);
+        if (x == 0) {
+            rc = -1;
+        } else {
+            setDirEntry(img, spec->nFiles, F439_CHUNK_INDEX, x);
+        }
+    }
+
+    if (rc == 0 && spec->stats) {
+        fprintf(spec->stats, "chunks: %u new (%lu bytes), %u reused "
+                "(%lu bytes), %u dropped from %s\n",
+                stats.newChunks, (unsigned long)stats.newBytes,
+                stats.reusedChunks, (unsigned long)stats.reusedBytes,
+                stats.freedChunks,
+                spec->previous ? spec->previous : "no previous image");
+    }
+    free(t.slots);
+    free(buf);
+    return rc;
+}
@@ -0,0 +1,232 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mkfs.h"
+
+/**
+ * Checkpoints let a long mkfs run that died (killed, out of disk space on
+ * the host, ...) continue where it was instead of starting over:
+ *
+ *      mkfs --checkpoint <file> [--checkpoint-secs <s>] <image> <nBlocks> ...
+ *      mkfs --checkpoint <file> --resume <image> <nBlocks> ...
+ *
+ * Files are placed in directory order, so "where it was" is simply the
+ * number of files done. The rest of the state already lives in the image:
+ * the chains and directory entries of the files done, and the allocator.
+ * The allocator is easy to restore because mkfs only ever pops the head of
+ * a free list that started out as nBlocks-1 -> nBlocks-2 -> ... -> lastAvail:
+ * everything below super->avail is still untouched, and blocks taken by a
+ * file that was cut short can be put back by relinking them.
+ *
+ * A checkpoint is only written after msync(), so the image on disk is never
+ * older than the checkpoint that describes it. It is written to a temporary
+ * file and renamed over the old one, so a crash while checkpointing leaves
+ * the previous checkpoint intact.
+ */
+
+#define CKPT_MAGIC "F439CKPT"
+#define CKPT_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nBlocks;
+    uint32_t nFiles;     /* files in the whole job */
+    uint32_t filesDone;  /* files placed when the checkpoint was taken */
+    uint32_t avail;      /* super->avail at that point */
+    uint32_t root;
+    uint64_t specHash;   /* the file list this build was started with */
+} CheckpointHeader;
+
+/* the input a placed file came from; it must not change before resuming */
+typedef struct {
+    uint32_t start;
+    uint32_t pad;
+    int64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t placed;     /* its size in the image; unpacked with --decompress */
+} CheckpointFile;
+
+
+static uint64_t specHash(const BuildSpec *spec) {
+    uint64_t h = 1469598103934665603ull ^ spec->nBlocks;
+    for (int i = 0; i < spec->nFiles; i++) {
+        for (const char *p = spec->fileNames[i]; *p; p++) {
+            h = (h ^ (unsigned char)*p) * 1099511628211ull;
+        }
+        h = (h ^ 0xff) * 1099511628211ull; /* separator */
+    }
+    return h;
+}
+
+static int stampFile(const char *path, CheckpointFile *cf) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return -1;
+    }
+    cf->size = st.st_size;
+    cf->mtimeSec = st.st_mtim.tv_sec;
+    cf->mtimeNsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+static int writeFully(int fd, const void *buf, size_t length) {
+    const char *p = buf;
+    while (length) {
+        ssize_t n = write(fd, p, length);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int checkpointSave(const char *path, Image *img, const BuildSpec *spec,
+                   int filesDone) {
+    /* the image must reach the disk before the checkpoint that describes it */
+    if (syncImage(img) < 0) {
+        return -1;
+    }
+
+    CheckpointHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CKPT_MAGIC, sizeof(h.magic));
+    h.version = CKPT_VERSION;
+    h.nBlocks = img->super->nBlocks;
+    h.nFiles = spec->nFiles;
+    h.filesDone = filesDone;
+    h.avail = img->super->avail;
+    h.root = img->super->root;
+    h.specHash = specHash(spec);
+
+    CheckpointFile *files = calloc(filesDone ? filesDone : 1,
+                                   sizeof(CheckpointFile));
+    if (files == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (int i = 0; i < filesDone; i++) {
+        files[i].start = imageDirEntry(img, i)->start;
+        files[i].placed = imageFileSize(img, files[i].start);
+        if (stampFile(spec->fileNames[i], &files[i]) < 0) {
+            perror(spec->fileNames[i]);
+            free(files);
+            return -1;
+        }
+    }
+
+    size_t tmpLen = strlen(path) + 5;
+    char *tmp = malloc(tmpLen);
+    if (tmp == NULL) {
+        perror("malloc");
+        free(files);
+        return -1;
+    }
+    snprintf(tmp, tmpLen, "%s.tmp", path);
+    int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    int rc = -1;
+    if (fd < 0) {
+        perror(tmp);
+    } else if (writeFully(fd, &h, sizeof(h)) < 0 ||
+               writeFully(fd, files, filesDone * sizeof(CheckpointFile)) < 0 ||
+               fsync(fd) < 0) {
+        perror("write checkpoint");
+        close(fd);
+    } else {
+        close(fd);
+        rc = rename(tmp, path);
+        if (rc < 0) {
+            perror("rename checkpoint");
+        }
+    }
+    free(tmp);
+    free(files);
+    return rc;
+}
+
+/**
+ * @brief rebuild the part of the free list that the interrupted run may have
+ *        consumed after the checkpoint: nBlocks-1 -> ... -> lastAvail, from
+ *        @avail down.
+ */
+static void resetFreeList(Image *img, uint32_t avail) {
+    img->super->avail = avail;
+    if (avail == 0) {
+        return; /* the disk was already full */
+    }
+    uint32_t lastAvail = imageFirstData(img->super->nBlocks);
+    for (uint32_t i = avail; i > lastAvail; i--) {
+        img->fat[i] = i - 1;
+    }
+    img->fat[lastAvail] = 0;
+}
+
+int checkpointResume(const char *path, Image *img, const BuildSpec *spec) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    CheckpointHeader h;
+    if (read(fd, &h, sizeof(h)) != sizeof(h) ||
+        memcmp(h.magic, CKPT_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != CKPT_VERSION) {
+        fprintf(stderr, "%s: not a checkpoint\n", path);
+        close(fd);
+        return -1;
+    }
+    if (h.nBlocks != spec->nBlocks || h.nFiles != (uint32_t)spec->nFiles ||
+        h.specHash != specHash(spec) || h.filesDone > h.nFiles) {
+        fprintf(stderr, "%s: checkpoint is for a different build\n", path);
+        close(fd);
+        return -1;
+    }
+    if (imageOpen(img, spec->imageName, PROT_READ | PROT_WRITE) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (img->super->nBlocks != h.nBlocks || img->super->root != h.root ||
+        h.avail >= h.nBlocks || imageDirCount(img) != h.nFiles) {
+        fprintf(stderr, "%s: image does not match the checkpoint\n",
+                spec->imageName);
+        goto fail;
+    }
+
+    for (uint32_t i = 0; i < h.filesDone; i++) {
+        CheckpointFile saved, now;
+        if (read(fd, &saved, sizeof(saved)) != sizeof(saved)) {
+            fprintf(stderr, "%s: truncated checkpoint\n", path);
+            goto fail;
+        }
+        if (stampFile(spec->fileNames[i], &now) < 0 || now.size != saved.size ||
+            now.mtimeSec != saved.mtimeSec ||
+            now.mtimeNsec != saved.mtimeNsec) {
+            fprintf(stderr, "%s: changed since the checkpoint\n",
+                    spec->fileNames[i]);
+            goto fail;
+        }
+        uint32_t start = imageDirEntry(img, i)->start;
+        if (start != saved.start || start >= h.nBlocks ||
+            imageFileSize(img, start) != saved.placed) {
+            fprintf(stderr, "%s: directory entry %u does not match the "
+                            "checkpoint\n", spec->imageName, i);
+            goto fail;
+        }
+    }
+    close(fd);
+
+    resetFreeList(img, h.avail);
+    return h.filesDone;
+
+fail:
+    imageClose(img);
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,440 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdlib.h>
+#include "f439.h"
+
+/**
+ * convert rewrites an existing image into a new one, without going back to
+ * the source files:
+ *
+ *      convert [-b blockSize] [-w fatWidth] [-n nBlocks] <image> <output>
+ *      convert [-b blockSize] [-w fatWidth] [-n nBlocks] -i <image>
+ *
+ * The output has the block size and fat entry width given (512 and 32 by
+ * default; other geometries are read through reader.h) and an ascending
+ * extent layout: the files follow the root directory in directory order,
+ * each one a single run of blocks going up, and the free space is one run
+ * at the top of the disk, where mkfs allocates from. Chunked files are
+ * written out whole, as regular files, and the chunk index is dropped. With
+ * -i the image is replaced by the converted one once it is complete.
+ *
+ * The conversion streams: the output is written front to back, block 0,
+ * fat, directory, then the files, through one buffer of CONVERT_IO bytes,
+ * and the fat is generated on the fly since the layout is known from the
+ * file sizes alone. The input is read one run of adjacent blocks at a time,
+ * up to CONVERT_IO bytes per read, so memory stays bounded whatever the
+ * size of the image.
+ */
+
+#define CONVERT_IO (1u << 20)
+
+
+typedef struct {
+    const Image *in;
+    int fd;               /* the output */
+    const char *outName;
+    uint32_t blockSize;
+    uint32_t fatWidth;
+    uint32_t nBlocks;
+    char *out;            /* write buffer */
+    size_t outLength;
+    uint64_t written;     /* bytes of the output written so far */
+    char *run;            /* read buffer for one run of input blocks */
+    uint64_t reads;       /* number of pread()s on the input */
+} Converter;
+
+typedef struct {
+    char name[F439_NAME_LEN];
+    uint32_t inStart;
+    uint32_t type;
+    uint32_t size;
+    uint32_t outStart;
+    uint32_t outBlocks;
+} Entry;
+
+
+static int flush(Converter *c) {
+    size_t done = 0;
+    while (done < c->outLength) {
+        ssize_t n = write(c->fd, c->out + done, c->outLength - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: %s\n", c->outName, strerror(errno));
+            return -1;
+        }
+        done += n;
+    }
+    c->written += c->outLength;
+    c->outLength = 0;
+    return 0;
+}
+
+static int emit(Converter *c, const void *data, size_t length) {
+    while (length > 0) {
+        size_t n = CONVERT_IO - c->outLength;
+        if (n > length) {
+            n = length;
+        }
+        if (data) {
+            memcpy(c->out + c->outLength, data, n);
+            data = (const char *)data + n;
+        } else {
+            memset(c->out + c->outLength, 0, n);
+        }
+        c->outLength += n;
+        length -= n;
+        if (c->outLength == CONVERT_IO && flush(c) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* zeros up to the next output block boundary */
+static int pad(Converter *c) {
+    uint64_t at = c->written + c->outLength;
+    uint64_t rest = (c->blockSize - at % c->blockSize) % c->blockSize;
+    return emit(c, NULL, rest);
+}
+
+static int emitEntry(Converter *c, uint32_t value) {
+    if (c->fatWidth == 16) {
+        uint16_t v = value;
+        return emit(c, &v, sizeof(v));
+    }
+    return emit(c, &value, sizeof(value));
+}
+
+/**
+ * @brief read input blocks [lowest, lowest + count) into the run buffer,
+ *        one pread() for every stretch that is contiguous in one file.
+ */
+static int readBlocks(Converter *c, uint32_t lowest, uint32_t count) {
+    uint32_t k = 0;
+    while (k < count) {
+        off_t off;
+        int fd = imageBlockFd(c->in, lowest + k, &off);
+        uint32_t n = 1;
+        for (; k + n < count; n++) {
+            off_t next;
+            if (imageBlockFd(c->in, lowest + k + n, &next) != fd ||
+                next != off + (off_t)n * F439_BLOCK_SIZE) {
+                break;
+            }
+        }
+        size_t length = (size_t)n * F439_BLOCK_SIZE;
+        ssize_t got = pread(fd, c->run + (size_t)k * F439_BLOCK_SIZE, length,
+                            off);
+        c->reads++;
+        if (got != (ssize_t)length) {
+            fprintf(stderr, "short read of block %u\n", lowest + k);
+            return -1;
+        }
+        k += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief copy @length bytes of the chain at @b, starting @skip bytes into
+ *        its first block, to the output. The chain is taken apart into runs
+ *        of adjacent blocks (descending for mkfs images), and every run is
+ *        read with as few large reads as possible.
+ */
+static int copyChain(Converter *c, uint32_t b, uint32_t skip,
+                     uint64_t length) {
+    const uint32_t maxRun = CONVERT_IO / F439_BLOCK_SIZE;
+    uint32_t nBlocks = c->in->super->nBlocks;
+    while (length > 0) {
+        if (b == 0 || b >= nBlocks) {
+            fprintf(stderr, "chain is shorter than the file\n");
+            return -1;
+        }
+        /* the run starting at @b, in chain order */
+        uint32_t count = 1;
+        int step = 0;
+        uint32_t last = b;
+        uint64_t covered = F439_BLOCK_SIZE - skip;
+        while (count < maxRun && covered < length) {
+            uint32_t next = c->in->fat[last];
+            int d = (next == last + 1) ? 1 : (next + 1 == last) ? -1 : 0;
+            if (d == 0 || (step != 0 && d != step)) {
+                break;
+            }
+            step = d;
+            last = next;
+            count++;
+            covered += F439_BLOCK_SIZE;
+        }
+        uint32_t lowest = step < 0 ? last : b;
+        if (readBlocks(c, lowest, count) < 0) {
+            return -1;
+        }
+        for (uint32_t k = 0; k < count && length > 0; k++) {
+            uint32_t slot = step < 0 ? count - 1 - k : k;
+            uint64_t n = F439_BLOCK_SIZE - skip;
+            if (n > length) {
+                n = length;
+            }
+            if (emit(c, c->run + (size_t)slot * F439_BLOCK_SIZE + skip,
+                     n) < 0) {
+                return -1;
+            }
+            length -= n;
+            skip = 0;
+        }
+        b = c->in->fat[last];
+    }
+    return 0;
+}
+
+static int copyFile(Converter *c, const Entry *e) {
+    uint32_t meta[2] = {F439_TYPE_FILE, e->size};
+    if (emit(c, meta, sizeof(meta)) < 0) {
+        return -1;
+    }
+    if (e->type == F439_TYPE_FILE) {
+        if (copyChain(c, e->inStart, F439_HEADER_SIZE, e->size) < 0) {
+            return -1;
+        }
+    } else {
+        ChunkCursor cur;
+        ChunkRef ref;
+        imageChunkStart(c->in, e->inStart, &cur);
+        while (imageChunkNext(c->in, &cur, &ref) > 0) {
+            if (copyChain(c, ref.start, 0, ref.length) < 0) {
+                return -1;
+            }
+        }
+    }
+    return pad(c);
+}
+
+/* blocks a file of @size bytes takes up with @blockSize byte blocks */
+static uint32_t blocksNeeded(uint64_t size, uint32_t blockSize) {
+    uint64_t first = blockSize - F439_HEADER_SIZE;
+    if (size <= first) {
+        return 1;
+    }
+    return 1 + (size - first + blockSize - 1) / blockSize;
+}
+
+/**
+ * @brief write the converted image of @in to @c->fd.
+ * @return 0 on success, -1 on error.
+ */
+static int convert(Converter *c, const Entry *entries, uint32_t nEntries,
+                   uint32_t root, uint32_t firstFree) {
+    uint32_t bs = c->blockSize;
+    uint32_t nBlocks = c->nBlocks;
+
+    /* block 0: super block, no layout, the geometry if not the default */
+    char *block0 = calloc(1, bs);
+    if (block0 == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    Super *super = (Super *)block0;
+    memcpy(super->magic, "F439", 4);
+    super->nBlocks = nBlocks;
+    super->avail = firstFree < nBlocks ? nBlocks - 1 : 0;
+    super->root = root;
+    if (bs != F439_BLOCK_SIZE || c->fatWidth != 32) {
+        Geometry *g = (Geometry *)(block0 + F439_GEOMETRY_OFFSET);
+        memcpy(g->magic, F439_GEOMETRY_MAGIC, 4);
+        g->blockSize = bs;
+        g->fatWidth = c->fatWidth;
+    }
+    int rc = emit(c, block0, bs);
+    free(block0);
+    if (rc < 0) {
+        return -1;
+    }
+
+    /* the fat: metadata and the directory end their chains right away,
+       every file is one ascending run, the free blocks descend */
+    uint32_t e = 0;
+    for (uint32_t b = 0; b < nBlocks; b++) {
+        uint32_t next = 0;
+        while (e < nEntries && b >= entries[e].outStart + entries[e].outBlocks) {
+            e++;
+        }
+        if (b >= firstFree) {
+            next = b > firstFree ? b - 1 : 0;
+        } else if (e < nEntries && b >= entries[e].outStart &&
+                   b + 1 < entries[e].outStart + entries[e].outBlocks) {
+            next = b + 1;
+        }
+        if (emitEntry(c, next) < 0) {
+            return -1;
+        }
+    }
+    if (pad(c) < 0) {
+        return -1;
+    }
+
+    /* the root directory */
+    uint32_t meta[2] = {F439_TYPE_DIR, nEntries * F439_DIRENT_SIZE};
+    if (emit(c, meta, sizeof(meta)) < 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < nEntries; i++) {
+        DirEntry d;
+        memcpy(d.name, entries[i].name, F439_NAME_LEN);
+        d.start = entries[i].outStart;
+        if (emit(c, &d, sizeof(d)) < 0) {
+            return -1;
+        }
+    }
+    if (pad(c) < 0) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < nEntries; i++) {
+        if (copyFile(c, &entries[i]) < 0) {
+            fprintf(stderr, "%.12s: cannot be copied\n", entries[i].name);
+            return -1;
+        }
+    }
+    if (flush(c) < 0) {
+        return -1;
+    }
+
+    /* the free blocks are all zero; leave them to the file system */
+    if (ftruncate(c->fd, (off_t)nBlocks * bs) < 0) {
+        fprintf(stderr, "%s: %s\n", c->outName, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t blockSize = F439_BLOCK_SIZE, fatWidth = 32, nBlocks = 0;
+    int inPlace = 0;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            blockSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            fatWidth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            nBlocks = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            inPlace = 1;
+        } else {
+            break;
+        }
+    }
+    if (i + (inPlace ? 1 : 2) != argc) {
+        fprintf(stderr, "usage: %s [-b blockSize] [-w fatWidth] [-n nBlocks] "
+                        "<image> <output>\n"
+                        "       %s [-b blockSize] [-w fatWidth] [-n nBlocks] "
+                        "-i <image>\n", argv[0], argv[0]);
+        exit(1);
+    }
+    if ((blockSize != 512 && blockSize != 1024 && blockSize != 2048 &&
+         blockSize != 4096) || (fatWidth != 16 && fatWidth != 32)) {
+        fprintf(stderr, "block size must be 512, 1024, 2048 or 4096, "
+                        "fat width 16 or 32\n");
+        exit(1);
+    }
+
+    const char *inName = argv[i];
+    char tmpName[4096];
+    const char *outName = argv[i + 1];
+    if (inPlace) {
+        snprintf(tmpName, sizeof(tmpName), "%s.convert", inName);
+        outName = tmpName;
+    }
+
+    Image in;
+    if (imageOpen(&in, inName, PROT_READ) < 0) {
+        exit(1);
+    }
+    if (nBlocks == 0) {
+        /* the same number of bytes as the input */
+        nBlocks = ((uint64_t)in.super->nBlocks * F439_BLOCK_SIZE) / blockSize;
+    }
+
+    /* the layout: block 0, fat, root directory, files in directory order */
+    uint64_t fatBlocks = ((uint64_t)nBlocks * (fatWidth / 8) + blockSize - 1) /
+                         blockSize;
+    uint32_t root = 1 + fatBlocks;
+    uint32_t nDir = imageDirCount(&in);
+    Entry *entries = calloc(nDir ? nDir : 1, sizeof(Entry));
+    if (entries == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    uint32_t nEntries = 0;
+    uint64_t next = (uint64_t)root + 1;
+    for (uint32_t k = 0; k < nDir; k++) {
+        const DirEntry *d = imageDirEntry(&in, k);
+        if (d->start == 0 || d->start >= in.super->nBlocks) {
+            fprintf(stderr, "%.12s: bad starting block\n", d->name);
+            exit(1);
+        }
+        uint32_t type = imageFileType(&in, d->start);
+        if (strncmp(d->name, F439_CHUNK_INDEX, F439_NAME_LEN) == 0 ||
+            (type != F439_TYPE_FILE && type != F439_TYPE_CHUNKED)) {
+            continue;   /* no chunks in the output, so no chunk index */
+        }
+        Entry *e = &entries[nEntries++];
+        memcpy(e->name, d->name, F439_NAME_LEN);
+        e->inStart = d->start;
+        e->type = type;
+        e->size = imageFileSize(&in, d->start);
+        e->outStart = next;
+        e->outBlocks = blocksNeeded(e->size, blockSize);
+        next += e->outBlocks;
+    }
+    if (next > nBlocks || (fatWidth == 16 && nBlocks > UINT16_MAX + 1u) ||
+        nEntries * F439_DIRENT_SIZE > blockSize - F439_HEADER_SIZE) {
+        fprintf(stderr, "%u blocks of %u bytes (%u bit fat) cannot hold "
+                        "%lu blocks of metadata and files\n", nBlocks,
+                blockSize, fatWidth, (unsigned long)next);
+        exit(1);
+    }
+
+    Converter c;
+    memset(&c, 0, sizeof(c));
+    c.in = &in;
+    c.outName = outName;
+    c.blockSize = blockSize;
+    c.fatWidth = fatWidth;
+    c.nBlocks = nBlocks;
+    c.out = malloc(CONVERT_IO);
+    c.run = malloc(CONVERT_IO);
+    c.fd = open(outName, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (c.out == NULL || c.run == NULL || c.fd < 0) {
+        fprintf(stderr, "%s: %s\n", outName, strerror(errno));
+        exit(1);
+    }
+
+    int rc = convert(&c, entries, nEntries, root, next);
+    if (rc == 0 && fsync(c.fd) < 0) {
+        fprintf(stderr, "%s: %s\n", outName, strerror(errno));
+        rc = -1;
+    }
+    close(c.fd);
+    if (rc == 0 && inPlace && rename(outName, inName) < 0) {
+        fprintf(stderr, "%s: %s\n", inName, strerror(errno));
+        rc = -1;
+    }
+    if (rc < 0) {
+        unlink(outName);
+    } else {
+        printf("%u files, %u blocks of %u bytes, %u bit fat, %lu reads, "
+               "%lu bytes written\n", nEntries, nBlocks, blockSize, fatWidth,
+               (unsigned long)c.reads, (unsigned long)c.written);
+    }
+
+    free(c.out);
+    free(c.run);
+    free(entries);
+    imageClose(&in);
+    return rc < 0;
+}
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE   /* sync_file_range() */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mkfs.h"
+
+/**
+ * mkfs --drop-behind keeps a large build from pushing the rest of the
+ * machine out of the page cache. Everything a build touches is touched
+ * once, so it gains nothing from staying cached:
+ *
+ * - inputs are opened with POSIX_FADV_SEQUENTIAL (a larger read ahead) and
+ *   what has been read is dropped every DROP_WINDOW bytes;
+ * - the image is written back and dropped a window behind the allocator.
+ *   getBlock() hands out blocks from the top of the disk down, so when it
+ *   enters a new window, the window above it is full: its writeback is
+ *   started. The one above that has had a whole window's time to be written
+ *   out; it is waited for, unmapped and dropped.
+ *
+ * Blocks in backing files (stripes, the bulk tier) are handled the same
+ * way, wherever a window of blocks lies.
+ *
+ * Dropping is only ever a hint. A page that is written again later (the
+ * size in the first block of a long file, a block of another region) is
+ * read back in, and a page that is still dirty is not dropped at all, so a
+ * wrong guess costs a read, never data.
+ *
+ * O_DIRECT would bound the footprint as well, but needs aligned buffers
+ * and offsets all through the ingest paths and loses the read ahead.
+ */
+
+int mkfsDropBehind = 0;
+
+
+void sourceAdvise(int fd) {
+    if (mkfsDropBehind) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+}
+
+void sourceDropBehind(int fd, off_t *dropped, off_t done, int eof) {
+    if (!mkfsDropBehind || (!eof && done - *dropped < DROP_WINDOW)) {
+        return;
+    }
+    /* len 0 means to the end of the file */
+    posix_fadvise(fd, *dropped, eof ? 0 : done - *dropped,
+                  POSIX_FADV_DONTNEED);
+    *dropped = done;
+}
+
+void forBlockRuns(Image *img, uint64_t from, uint64_t to, BlockRunFn fn) {
+    if (to > img->super->nBlocks) {
+        to = img->super->nBlocks;
+    }
+    int runFd = -1;
+    off_t runStart = 0, runEnd = 0;
+    char *runMap = NULL;
+    for (uint64_t b = from; b <= to; b++) {
+        off_t off = 0;
+        int fd = b < to ? imageBlockFd(img, b, &off) : -1;
+        if (fd == runFd && off == runEnd) {
+            runEnd += F439_BLOCK_SIZE;
+            continue;
+        }
+        if (runFd >= 0) {
+            fn(runFd, runStart, runEnd - runStart, runMap);
+        }
+        if (fd >= 0) {
+            runMap = imageToPtr(img, b, 0);
+        }
+        runFd = fd;
+        runStart = off;
+        runEnd = off + F439_BLOCK_SIZE;
+    }
+}
+
+void dropBehindStart(Image *img) {
+    if (!mkfsDropBehind) {
+        return;
+    }
+    /* a dropped block that is written again should only bring its own
+       page back, not a whole read around */
+    madvise(img->mapStart, img->mapLength, MADV_RANDOM);
+    for (uint32_t k = 0; k < img->nBacking; k++) {
+        madvise(img->backing[k].map, img->backing[k].length, MADV_RANDOM);
+    }
+}
+
+static void startWriteback(int fd, off_t off, size_t length, char *map) {
+    (void)map;
+    sync_file_range(fd, off, length, SYNC_FILE_RANGE_WRITE);
+}
+
+static void dropRun(int fd, off_t off, size_t length, char *map) {
+    sync_file_range(fd, off, length,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                    SYNC_FILE_RANGE_WAIT_AFTER);
+    /* the whole pages inside; windows in the bulk tier start wherever the
+       fast tier ends, and madvise() takes page aligned addresses only */
+    const off_t page = sysconf(_SC_PAGESIZE);
+    off_t skip = (page - off % page) % page;
+    if ((off_t)length <= skip) {
+        return;
+    }
+    length = (length - skip) / page * page;
+    /* mapped pages are not dropped; on a shared mapping this only removes
+       them from our page tables */
+    madvise(map + skip, length, MADV_DONTNEED);
+    posix_fadvise(fd, off + skip, length, POSIX_FADV_DONTNEED);
+}
+
+void dropImageWindows(Image *img, uint32_t idx) {
+    const uint64_t w = DROP_WINDOW / F439_BLOCK_SIZE;
+    uint64_t full = (uint64_t)idx + w, old = (uint64_t)idx + 2 * w;
+    forBlockRuns(img, full, full + w, startWriteback);
+    forBlockRuns(img, old, old + w, dropRun);
+}
@@ -0,0 +1,94 @@
+#include <math.h>
+#include <string.h>
+#include "entropy.h"
+
+/**
+ * Histograms are a poor fit for SIMD: every byte increments a counter that
+ * depends on its value, and two equal bytes in a row make the second
+ * increment wait for the first. histAdd() therefore keeps four interleaved
+ * tables, loads eight bytes at a time and spreads them over the tables, so
+ * consecutive increments are independent and the CPU can overlap them. The
+ * tables are summed once at the end.
+ */
+
+/* above this, the data looks random and compression would be wasted */
+#define STORE_ABOVE 7.5
+/* below these, spend more effort because it pays off */
+#define DEFAULT_BELOW 6.0
+#define BEST_BELOW 3.0
+
+
+void histClear(ByteHistogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+static void histAdd(ByteHistogram *h, const unsigned char *p, size_t length) {
+    uint32_t t[4][256];
+    memset(t, 0, sizeof(t));
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        t[0][v & 0xff]++;
+        t[1][(v >> 8) & 0xff]++;
+        t[2][(v >> 16) & 0xff]++;
+        t[3][(v >> 24) & 0xff]++;
+        t[0][(v >> 32) & 0xff]++;
+        t[1][(v >> 40) & 0xff]++;
+        t[2][(v >> 48) & 0xff]++;
+        t[3][v >> 56]++;
+    }
+    for (; i < length; i++) {
+        t[0][p[i]]++;
+    }
+    for (int b = 0; b < 256; b++) {
+        h->count[b] += t[0][b] + t[1][b] + t[2][b] + t[3][b];
+    }
+    h->total += length;
+}
+
+void histSample(ByteHistogram *h, const char *data, size_t length) {
+    const unsigned char *p = (const unsigned char *)data;
+    if (length <= ENTROPY_SAMPLES * ENTROPY_WINDOW) {
+        histAdd(h, p, length);
+        return;
+    }
+    size_t stride = (length - ENTROPY_WINDOW) / (ENTROPY_SAMPLES - 1);
+    for (int s = 0; s < ENTROPY_SAMPLES; s++) {
+        histAdd(h, p + s * stride, ENTROPY_WINDOW);
+    }
+}
+
+void histMerge(ByteHistogram *h, const ByteHistogram *from) {
+    for (int b = 0; b < 256; b++) {
+        h->count[b] += from->count[b];
+    }
+    h->total += from->total;
+}
+
+double histEntropy(const ByteHistogram *h) {
+    if (h->total == 0) {
+        return 0;
+    }
+    double bits = 0;
+    for (int b = 0; b < 256; b++) {
+        if (h->count[b]) {
+            double p = (double)h->count[b] / h->total;
+            bits -= p * log2(p);
+        }
+    }
+    return bits;
+}
+
+CompressPlan entropyPlan(double bitsPerByte) {
+    CompressPlan plan = {1, 1};
+    if (bitsPerByte > STORE_ABOVE) {
+        plan.compress = 0;
+        plan.level = 0;
+    } else if (bitsPerByte < BEST_BELOW) {
+        plan.level = 9;
+    } else if (bitsPerByte < DEFAULT_BELOW) {
+        plan.level = 6;
+    }
+    return plan;
+}
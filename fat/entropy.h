@@ -0,0 +1,42 @@
+#ifndef ENTROPY_H
+#define ENTROPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A cheap estimate of how compressible data is: the Shannon entropy of a
+ * byte histogram built from a few small windows sampled across the data.
+ * Already compressed inputs (media, archives) come out close to 8 bits per
+ * byte and are not worth spending compression CPU on.
+ */
+
+/* windows sampled per histSample() call, and their size */
+#define ENTROPY_SAMPLES 4
+#define ENTROPY_WINDOW 512
+
+typedef struct {
+    uint32_t count[256];
+    uint64_t total;
+} ByteHistogram;
+
+/* what to do with data of a given entropy */
+typedef struct {
+    int compress;  /* 0: store as is */
+    int level;     /* 1 (fast) .. 9 (best), when compressing */
+} CompressPlan;
+
+void histClear(ByteHistogram *h);
+
+/* add ENTROPY_SAMPLES windows spread evenly over @data (all of it if short) */
+void histSample(ByteHistogram *h, const char *data, size_t length);
+
+/* add the counts of @from into @h */
+void histMerge(ByteHistogram *h, const ByteHistogram *from);
+
+/* entropy in bits per byte, 0 (constant) .. 8 (random); 0 when empty */
+double histEntropy(const ByteHistogram *h);
+
+CompressPlan entropyPlan(double bitsPerByte);
+
+#endif
@@ -0,0 +1,485 @@
+#ifndef F439_H
+#define F439_H
+
+/**
+ * f439.h describes the on-disk format produced by mkfs.c, so that tools which
+ * read images (readfs, ...) agree with mkfs on where things live. See the
+ * layout illustration at the top of mkfs.c for the full picture; in short:
+ *
+ * |super block|       fat      |regular disk blocks|
+ * |  block 0  | several blocks |  the rest blocks  |
+ *
+ * Each file is a chain of blocks linked through fat[]; fat[last] == 0. The
+ * first block of a file starts with 8 bytes of metadata [type, size].
+ *
+ * A chunked file (F439_TYPE_CHUNKED, written by mkfs --cdc, see cdc.c) has
+ * the same header, but its chain holds a list of ChunkRef instead of the
+ * data. Each chunk is a chain of its own, without a header, that several
+ * files (and images built from one another) may share. The file size in
+ * the header is the sum of the chunk lengths.
+ *
+ * Block 0 may also describe a layout (Layout) right after the super block.
+ * A striped or tiered image keeps only its first blocks in the image file
+ * and the remaining ones in backing files, see imageToPtr().
+ */
+
+#include <stdint.h>
+#include <stdio.h>     /* fprintf(), perror(), snprintf() */
+#include <stdlib.h>    /* calloc(), free() */
+#include <string.h>    /* memcmp(), memcpy(), strncmp() */
+#include <fcntl.h>     /* open() */
+#include <unistd.h>    /* close() */
+#include <sys/mman.h>  /* mmap() */
+#include <sys/stat.h>  /* fstat() */
+
+#define F439_BLOCK_SIZE 512
+#define F439_HEADER_SIZE 8   /* [type, size] at the start of a file/dir */
+#define F439_DIRENT_SIZE 16  /* [fileName, starting disk block index] */
+#define F439_NAME_LEN 12
+
+#define F439_TYPE_FILE 1
+#define F439_TYPE_DIR 2
+#define F439_TYPE_CHUNKED 3
+
+/* the chunk index of an image with chunked files, a regular file */
+#define F439_CHUNK_INDEX ".chunks"
+
+/* super block that stores the information of this FS image */
+typedef struct {
+    char magic[4];
+    /* below are all of type uint32_t, so they are all numbers */
+    uint32_t nBlocks; /* the total number of blocks (n) */
+    uint32_t avail;   /* head of the free list; 0 when the disk is full */
+    uint32_t root;    /* index of the root directory */
+} Super;
+
+/* one entry of the root directory; names are not NUL terminated if they are
+   exactly 12 bytes long */
+typedef struct {
+    char name[F439_NAME_LEN];
+    uint32_t start;   /* index of the first block of the file */
+} DirEntry;
+
+/* one entry of a chunked file; 8 divides both 512 - 8 and 512, so entries
+   never straddle two blocks */
+typedef struct {
+    uint32_t start;   /* first block of the chunk */
+    uint32_t length;  /* bytes in the chunk */
+} ChunkRef;
+
+/* one entry of the chunk index */
+typedef struct {
+    uint64_t hash;    /* of the chunk contents, see cdc.c */
+    uint32_t start;
+    uint32_t length;
+} ChunkRecord;
+
+#define F439_LAYOUT_MAGIC "LYT1"
+#define F439_LAYOUT_STRIPED 1
+#define F439_LAYOUT_TIERED 2
+
+/**
+ * Where the blocks of an image live, stored in block 0 right after the
+ * super block. Images without one (the magic does not match) are a single
+ * file holding all blocks.
+ *
+ * Striped: blocks [0, headBlocks) - the super block and the fat - are in
+ * the image file. The rest is cut into units of stripeBlocks blocks that go
+ * round robin to the backing files "<image>.s0" .. "<image>.s<nStripes-1>",
+ * as in RAID-0. The backing files may be symbolic links to other disks.
+ *
+ * Tiered: blocks [0, headBlocks) - the super block, the fat, the root
+ * directory and the hot files - are in the image file, meant for fast
+ * storage, and the rest is in "<image>.bulk". To the block translation this
+ * is a striped image with a single stripe.
+ */
+typedef struct {
+    char magic[4];
+    uint32_t kind;          /* F439_LAYOUT_STRIPED or F439_LAYOUT_TIERED */
+    uint32_t headBlocks;    /* blocks kept in the image file itself */
+    uint32_t stripeBlocks;  /* blocks per stripe unit */
+    uint32_t nStripes;      /* number of backing files */
+} Layout;
+
+#define F439_GEOMETRY_MAGIC "GEO1"
+
+/**
+ * Block size and width of the fat entries, stored in block 0 after the
+ * layout. Images without one use 512 byte blocks and 32 bit entries, which
+ * is all that mkfs writes and all that imageOpen() reads; other geometries
+ * (from convert) are read through reader.h, and checked by fsck.
+ */
+typedef struct {
+    char magic[4];
+    uint32_t blockSize;   /* 512 .. 4096, a power of two */
+    uint32_t fatWidth;    /* bits per fat entry: 16 or 32 */
+} Geometry;
+
+#define F439_GEOMETRY_OFFSET (sizeof(Super) + sizeof(Layout))
+
+/* the geometry of an image, from the start of its block 0 */
+static inline void imageGeometry(const void *block0, uint32_t *blockSize,
+                                 uint32_t *fatWidth) {
+    const Geometry *g = (const Geometry *)((const char *)block0 +
+                                           F439_GEOMETRY_OFFSET);
+    *blockSize = F439_BLOCK_SIZE;
+    *fatWidth = 32;
+    if (memcmp(g->magic, F439_GEOMETRY_MAGIC, 4) == 0) {
+        *blockSize = g->blockSize;
+        *fatWidth = g->fatWidth;
+    }
+}
+
+/* a backing file of an image, mapped like the image itself */
+typedef struct {
+    int fd;
+    char *map;
+    size_t length;
+} Backing;
+
+/**
+ * An image mapped into memory. This is the same view mkfs builds:
+ * mapStart == super == blocks, and fat starts at the second disk block.
+ * Blocks at or above headBlocks are in one of the backing files instead.
+ */
+typedef struct {
+    int fd;
+    void *mapStart;   /* the starting of the mmap'ed area (disk image) */
+    size_t mapLength; /* the size of the disk image */
+    Super *super;
+    uint32_t *fat;
+    char *blocks;
+    uint32_t headBlocks;   /* blocks in the mapping above: all of them,
+                              unless the image has a layout */
+    uint32_t stripeBlocks;
+    uint32_t nBacking;
+    Backing *backing;
+} Image;
+
+
+/* the layout descriptor in block 0, NULL if the image has none */
+static inline Layout *imageLayout(const Image *img) {
+    Layout *l = (Layout *)((char *)img->mapStart + sizeof(Super));
+    return memcmp(l->magic, F439_LAYOUT_MAGIC, 4) == 0 ? l : NULL;
+}
+
+/* "<image>.s<k>" or "<image>.bulk", the name of backing file @k */
+static inline void imageBackingName(const char *name, const Layout *l,
+                                    uint32_t k, char *buf, size_t size) {
+    if (l->kind == F439_LAYOUT_TIERED) {
+        snprintf(buf, size, "%s.bulk", name);
+    } else {
+        snprintf(buf, size, "%s.s%u", name, k);
+    }
+}
+
+/**
+ * @brief where block @idx (>= headBlocks) of a striped image lives.
+ * @param local set to the block index within the backing file
+ * @return the backing file
+ */
+static inline uint32_t imageStripe(const Image *img, uint32_t idx,
+                                   uint32_t *local) {
+    uint32_t d = idx - img->headBlocks;
+    uint32_t unit = d / img->stripeBlocks;
+    *local = (unit / img->nBacking) * img->stripeBlocks + d % img->stripeBlocks;
+    return unit % img->nBacking;
+}
+
+/* blocks a backing file of a striped image must hold */
+static inline uint32_t imageStripeBlocks(uint32_t nBlocks, const Layout *l) {
+    uint32_t units = (nBlocks - l->headBlocks + l->stripeBlocks - 1) /
+                     l->stripeBlocks;
+    return (units + l->nStripes - 1) / l->nStripes * l->stripeBlocks;
+}
+
+/**
+ * @brief given an index of the disk block and the offset within the block,
+ *        returns that address (same as toPtr() in mkfs.c). A block never
+ *        spans two backing files, so the bytes up to the end of the block
+ *        are all at the result.
+ */
+static inline char *imageToPtr(const Image *img, uint32_t idx, uint32_t offset) {
+    if (idx < img->headBlocks) {
+        return img->blocks + (size_t)idx * F439_BLOCK_SIZE + offset;
+    }
+    uint32_t local;
+    const Backing *b = &img->backing[imageStripe(img, idx, &local)];
+    return b->map + (size_t)local * F439_BLOCK_SIZE + offset;
+}
+
+/* the file and the offset in it for pread()'ing block @idx */
+static inline int imageBlockFd(const Image *img, uint32_t idx, off_t *offset) {
+    if (idx < img->headBlocks) {
+        *offset = (off_t)idx * F439_BLOCK_SIZE;
+        return img->fd;
+    }
+    uint32_t local;
+    const Backing *b = &img->backing[imageStripe(img, idx, &local)];
+    *offset = (off_t)local * F439_BLOCK_SIZE;
+    return b->fd;
+}
+
+/* number of blocks the fat itself takes up (mirrors mkfs.c) */
+static inline uint32_t imageFatBlocks(uint32_t nBlocks) {
+    return (nBlocks * sizeof(uint32_t) + F439_BLOCK_SIZE - 1) / F439_BLOCK_SIZE;
+}
+
+/* the first block that may hold file data; everything below is metadata */
+static inline uint32_t imageFirstData(uint32_t nBlocks) {
+    return 1 + imageFatBlocks(nBlocks);
+}
+
+/* number of entries in the root directory */
+static inline uint32_t imageDirCount(const Image *img) {
+    uint32_t *rootMetaData = (uint32_t *)imageToPtr(img, img->super->root, 0);
+    return rootMetaData[1] / F439_DIRENT_SIZE;
+}
+
+static inline DirEntry *imageDirEntry(const Image *img, uint32_t i) {
+    return (DirEntry *)imageToPtr(img, img->super->root,
+                                  F439_HEADER_SIZE + i * F439_DIRENT_SIZE);
+}
+
+/* file size in bytes, from the metadata of its first block */
+static inline uint32_t imageFileSize(const Image *img, uint32_t start) {
+    return ((uint32_t *)imageToPtr(img, start, 0))[1];
+}
+
+static inline uint32_t imageFileType(const Image *img, uint32_t start) {
+    return ((uint32_t *)imageToPtr(img, start, 0))[0];
+}
+
+/* where we are in the list of chunks of a chunked file */
+typedef struct {
+    uint32_t block;   /* of the chain of the file */
+    uint32_t offset;  /* of the next ChunkRef in @block */
+    uint32_t left;    /* file bytes not covered by the chunks seen so far */
+} ChunkCursor;
+
+static inline void imageChunkStart(const Image *img, uint32_t start,
+                                   ChunkCursor *c) {
+    c->block = start;
+    c->offset = F439_HEADER_SIZE;
+    c->left = imageFileSize(img, start);
+}
+
+/**
+ * @brief the next chunk of a chunked file.
+ * @return 1 with @ref filled in, 0 after the last chunk, -1 if the chunk
+ *         list does not add up to the file size or points off the disk.
+ */
+static inline int imageChunkNext(const Image *img, ChunkCursor *c,
+                                 ChunkRef *ref) {
+    uint32_t nBlocks = img->super->nBlocks;
+    if (c->left == 0) {
+        return 0;
+    }
+    if (c->offset == F439_BLOCK_SIZE) {
+        c->block = img->fat[c->block];
+        c->offset = 0;
+        if (c->block == 0 || c->block >= nBlocks) {
+            return -1;
+        }
+    }
+    memcpy(ref, imageToPtr(img, c->block, c->offset), sizeof(*ref));
+    c->offset += sizeof(*ref);
+    if (ref->length == 0 || ref->length > c->left || ref->start == 0 ||
+        ref->start >= nBlocks) {
+        return -1;
+    }
+    c->left -= ref->length;
+    return 1;
+}
+
+/**
+ * @brief translate a byte offset within a file into the position of the chain
+ *        block that holds it and the offset inside that block. The first
+ *        block only carries (512 - 8) bytes because of the metadata header.
+ */
+static inline void imageLocate(uint32_t fileOffset, uint32_t *chainPos,
+                               uint32_t *blockOffset) {
+    uint32_t firstData = F439_BLOCK_SIZE - F439_HEADER_SIZE;
+    if (fileOffset < firstData) {
+        *chainPos = 0;
+        *blockOffset = F439_HEADER_SIZE + fileOffset;
+    } else {
+        *chainPos = 1 + (fileOffset - firstData) / F439_BLOCK_SIZE;
+        *blockOffset = (fileOffset - firstData) % F439_BLOCK_SIZE;
+    }
+}
+
+static inline void imageUnmapBacking(Image *img) {
+    for (uint32_t k = 0; k < img->nBacking; k++) {
+        munmap(img->backing[k].map, img->backing[k].length);
+        close(img->backing[k].fd);
+    }
+    free(img->backing);
+    img->backing = NULL;
+    img->nBacking = 0;
+}
+
+/**
+ * @brief map the backing files of an image named @name, as described
+ *        by its layout; nothing to do for an image in one file.
+ * @return 0 on success, -1 on failure (with a message printed).
+ */
+static inline int imageMapBacking(Image *img, const char *name, int prot) {
+    const Layout *l = imageLayout(img);
+    uint32_t nBlocks = img->super->nBlocks;
+    img->headBlocks = nBlocks;
+    img->nBacking = 0;
+    img->backing = NULL;
+    if (l == NULL) {
+        return 0;
+    }
+    int striped = l->kind == F439_LAYOUT_STRIPED &&
+                  l->headBlocks == imageFirstData(nBlocks);
+    int tiered = l->kind == F439_LAYOUT_TIERED && l->nStripes == 1 &&
+                 l->headBlocks > imageFirstData(nBlocks) &&
+                 l->headBlocks <= nBlocks;
+    if (!(striped || tiered) || l->nStripes == 0 || l->stripeBlocks == 0) {
+        fprintf(stderr, "%s: unknown layout\n", name);
+        return -1;
+    }
+    size_t length = (size_t)imageStripeBlocks(nBlocks, l) * F439_BLOCK_SIZE;
+    if (length == 0) {
+        return 0;       /* a bulk tier with no blocks */
+    }
+    img->backing = (Backing *)calloc(l->nStripes, sizeof(Backing));
+    if (img->backing == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (uint32_t k = 0; k < l->nStripes; k++) {
+        char path[4096];
+        imageBackingName(name, l, k, path, sizeof(path));
+        Backing *b = &img->backing[k];
+        struct stat st;
+        b->fd = open(path, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY);
+        if (b->fd < 0 || fstat(b->fd, &st) < 0 || (size_t)st.st_size < length) {
+            if (b->fd < 0) {
+                perror(path);
+            } else {
+                fprintf(stderr, "%s: too short for the image\n", path);
+                close(b->fd);
+            }
+            imageUnmapBacking(img);
+            return -1;
+        }
+        b->length = length;
+        b->map = (char *)mmap(0, length, prot, MAP_SHARED, b->fd, 0);
+        if (b->map == MAP_FAILED) {
+            perror("mmap");
+            close(b->fd);
+            imageUnmapBacking(img);
+            return -1;
+        }
+        img->nBacking = k + 1;
+    }
+    img->headBlocks = l->headBlocks;
+    img->stripeBlocks = l->stripeBlocks;
+    return 0;
+}
+
+/**
+ * @brief sanity check the mapped image so that tools do not walk off the end
+ *        of the mapping on a truncated or foreign file.
+ * @return 0 if it looks like an F439 image, -1 otherwise.
+ */
+static inline int imageCheck(const Image *img) {
+    if (img->mapLength < F439_BLOCK_SIZE ||
+        memcmp(img->super->magic, "F439", 4) != 0) {
+        fprintf(stderr, "not an F439 image\n");
+        return -1;
+    }
+    uint32_t nBlocks = img->super->nBlocks;
+    if ((size_t)img->headBlocks * F439_BLOCK_SIZE > img->mapLength ||
+        img->super->root >= nBlocks || img->super->avail >= nBlocks ||
+        imageFirstData(nBlocks) > nBlocks) {
+        fprintf(stderr, "corrupted super block\n");
+        return -1;
+    }
+    uint32_t *rootMetaData = (uint32_t *)imageToPtr(img, img->super->root, 0);
+    if (rootMetaData[0] != F439_TYPE_DIR ||
+        rootMetaData[1] > F439_BLOCK_SIZE - F439_HEADER_SIZE) {
+        fprintf(stderr, "corrupted root directory\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief map an existing image, and its backing files if it has a layout.
+ * @param prot PROT_READ, or PROT_READ | PROT_WRITE to modify it in place
+ * @return 0 on success, -1 on failure (with a message printed).
+ */
+static inline int imageOpen(Image *img, const char *name, int prot) {
+    img->fd = open(name, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY);
+    if (img->fd < 0) {
+        perror(name);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(img->fd, &st) < 0) {
+        perror("fstat");
+        close(img->fd);
+        return -1;
+    }
+    img->mapLength = st.st_size;
+    if (img->mapLength < F439_BLOCK_SIZE) {
+        fprintf(stderr, "%s: not an F439 image\n", name);
+        close(img->fd);
+        return -1;
+    }
+
+    img->mapStart = mmap(0, img->mapLength, prot, MAP_SHARED, img->fd, 0);
+    if (img->mapStart == MAP_FAILED) {
+        perror("mmap");
+        close(img->fd);
+        return -1;
+    }
+    img->super = (Super *)img->mapStart;
+    img->blocks = (char *)img->mapStart;
+    img->fat = (uint32_t *)(img->blocks + F439_BLOCK_SIZE);
+
+    /* the super block and the layout are in the image file itself; the
+       backing files are needed before the root directory can be checked */
+    uint32_t blockSize = F439_BLOCK_SIZE, fatWidth = 32;
+    if (memcmp(img->super->magic, "F439", 4) != 0) {
+        fprintf(stderr, "%s: not an F439 image\n", name);
+    } else {
+        imageGeometry(img->mapStart, &blockSize, &fatWidth);
+        if (blockSize != F439_BLOCK_SIZE || fatWidth != 32) {
+            fprintf(stderr, "%s: %u byte blocks with %u bit fat entries need "
+                            "reader.h\n", name, blockSize, fatWidth);
+        }
+    }
+    if (memcmp(img->super->magic, "F439", 4) != 0 ||
+        blockSize != F439_BLOCK_SIZE || fatWidth != 32) {
+        munmap(img->mapStart, img->mapLength);
+        close(img->fd);
+        return -1;
+    }
+    if (imageMapBacking(img, name, prot) < 0) {
+        munmap(img->mapStart, img->mapLength);
+        close(img->fd);
+        return -1;
+    }
+    if (imageCheck(img) < 0) {
+        imageUnmapBacking(img);
+        munmap(img->mapStart, img->mapLength);
+        close(img->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void imageClose(Image *img) {
+    imageUnmapBacking(img);
+    munmap(img->mapStart, img->mapLength);
+    close(img->fd);
+}
+
+#endif
@@ -0,0 +1,656 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include "f439.h"
+#include "reader.h"
+
+/**
+ * fsck checks that every block of an image is either in exactly one chain
+ * of the root directory or on the free list, and with -r repairs it:
+ *
+ *      fsck [-j threads] [-r] <image>
+ *
+ * 1. mark: the chains of all files (and the chunks of chunked files) are
+ *    walked in parallel, one file at a time, setting bits in a shared
+ *    bitmap of reachable blocks. A chunk that several files share is walked
+ *    once, by whichever file gets to it first. A chain that leaves the disk
+ *    or runs into a block that is already marked is broken there, and that
+ *    includes a chunk running into another chain; with -r a file chain is
+ *    cut off at its last good block, or dropped from the directory if even
+ *    its first block is bad (off the disk, or in another file's chain).
+ * 2. the old free list is walked, one block after the other, into a second
+ *    bitmap. Everything neither reachable nor on it is an orphan.
+ * 3. orphans: every thread takes a segment of the fat and, 64 blocks at a
+ *    time, notes which orphans another orphan points to. Orphans nobody
+ *    points to start an orphan chain. A chain whose first block looks like
+ *    the start of a file (a regular file header whose size fits the chain)
+ *    is reported as a lost file, and with -r reattached to the root
+ *    directory as lostNNNN; everything else is reported as leaked.
+ * 4. with -r the free list is rebuilt from the bitmap: every thread links
+ *    the unreachable blocks of its segment, top down, 64 at a time, and the
+ *    segments are then chained together, top of the disk first, which is
+ *    the order mkfs always uses.
+ *
+ * Every pass is linear in the number of blocks; only the free list walk in
+ * (2) is serial, because the free list is one chain.
+ *
+ * Broken chunk lists are reported but not repaired, and with one the free
+ * list is not rebuilt either: the chunks after the break were never walked,
+ * so their blocks would look free while the chunk list still refers to them.
+ *
+ * Images of any geometry that reader.h reads (as written by convert) are
+ * checked and repaired the same way; convert writes no chunked files, so in
+ * those a chunked file counts as a broken chunk list.
+ *
+ * Exit status: 0 if the image is consistent, 1 if it was not (and was
+ * repaired with -r, as far as it says), 2 if it cannot be checked at all.
+ */
+
+typedef struct {
+    uint32_t blocks;
+    uint32_t last;        /* the last good block of the chain */
+    int broken;           /* the chain was cut at @last */
+    int chunksBroken;     /* a chunk list that does not add up */
+} FileCheck;
+
+typedef struct {
+    Image *img;
+    uint32_t blockSize;
+    uint32_t fatWidth;    /* 16 or 32 */
+    void *fat;            /* at block 1, of either width */
+    uint32_t nBlocks;
+    uint32_t first;       /* the first data block */
+    uint32_t nWords;      /* 64 bit words in each bitmap */
+    _Atomic uint64_t *reach;
+    uint64_t *onList;
+    _Atomic uint64_t *hasPred;
+    _Atomic uint64_t *chunkStarts;  /* chunks taken by a walk */
+    FileCheck *files;
+    uint32_t nFiles;
+    atomic_uint next;     /* the next file to walk */
+    atomic_ulong crossLinks;
+} Checker;
+
+/* what one thread found in, or did to, its segment */
+typedef struct {
+    Checker *c;
+    uint32_t loWord, hiWord;
+    uint64_t orphans;
+    uint32_t *heads;      /* orphans with no orphan pointing to them */
+    uint32_t nHeads;
+    uint32_t headsCap;
+    uint32_t top;         /* highest free block after the rebuild, or 0 */
+    uint32_t bottom;      /* lowest free block after the rebuild */
+    uint64_t nFree;
+} Segment;
+
+
+/* fat entry @b, of either width */
+static uint32_t fatGet(const Checker *c, uint32_t b) {
+    return c->fatWidth == 16 ? ((const uint16_t *)c->fat)[b]
+                             : ((const uint32_t *)c->fat)[b];
+}
+
+static void fatSet(Checker *c, uint32_t b, uint32_t next) {
+    if (c->fatWidth == 16) {
+        ((uint16_t *)c->fat)[b] = next;
+    } else {
+        ((uint32_t *)c->fat)[b] = next;
+    }
+}
+
+/* byte @offset of block @b; other geometries have no layout */
+static char *blockPtr(const Checker *c, uint32_t b, uint32_t offset) {
+    if (c->blockSize == F439_BLOCK_SIZE) {
+        return imageToPtr(c->img, b, offset);
+    }
+    return c->img->blocks + (size_t)b * c->blockSize + offset;
+}
+
+static uint32_t *rootMeta(const Checker *c) {
+    return (uint32_t *)blockPtr(c, c->img->super->root, 0);
+}
+
+static DirEntry *dirEntry(const Checker *c, uint32_t i) {
+    return (DirEntry *)blockPtr(c, c->img->super->root,
+                                F439_HEADER_SIZE + i * F439_DIRENT_SIZE);
+}
+
+static int testBit(const uint64_t *map, uint32_t b) {
+    return (map[b / 64] >> (b % 64)) & 1;
+}
+
+/* set bit @b; returns whether it was set already */
+static int markBit(_Atomic uint64_t *map, uint32_t b) {
+    uint64_t bit = 1ull << (b % 64);
+    return (atomic_fetch_or_explicit(&map[b / 64], bit,
+                                     memory_order_relaxed) & bit) != 0;
+}
+
+/* the blocks of word @w that are neither reachable nor on the old list */
+static uint64_t orphanWord(const Checker *c, uint32_t w) {
+    uint64_t word = ~atomic_load_explicit(&c->reach[w], memory_order_relaxed) &
+                    ~c->onList[w];
+    /* only blocks [first, nBlocks) exist as data blocks */
+    uint64_t base = (uint64_t)w * 64;
+    if (base + 64 > c->nBlocks) {
+        word &= c->nBlocks - base >= 64 ? ~0ull
+                                        : (1ull << (c->nBlocks - base)) - 1;
+    }
+    if (base < c->first) {
+        word &= c->first - base >= 64 ? 0 : ~0ull << (c->first - base);
+    }
+    return word;
+}
+
+/**
+ * @brief mark the chain at @b; stops at the first block off the disk or
+ *        already marked.
+ * @return 1 if the chain ends properly, 0 if it is broken after @f->last.
+ */
+static int markChain(Checker *c, uint32_t b, FileCheck *f) {
+    f->last = 0;
+    while (b != 0) {
+        if (b < c->first || b >= c->nBlocks) {
+            return 0;
+        }
+        if (markBit(c->reach, b)) {
+            atomic_fetch_add(&c->crossLinks, 1);
+            return 0;
+        }
+        f->blocks++;
+        f->last = b;
+        b = fatGet(c, b);
+    }
+    return 1;
+}
+
+static void *markThread(void *arg) {
+    Checker *c = arg;
+    for (;;) {
+        uint32_t i = atomic_fetch_add(&c->next, 1);
+        if (i >= c->nFiles) {
+            return NULL;
+        }
+        FileCheck *f = &c->files[i];
+        uint32_t start = dirEntry(c, i)->start;
+        if (!markChain(c, start, f)) {
+            f->broken = 1;
+            continue;
+        }
+        if (*(uint32_t *)blockPtr(c, start, 0) != F439_TYPE_CHUNKED) {
+            continue;
+        }
+        if (c->blockSize != F439_BLOCK_SIZE || c->fatWidth != 32) {
+            f->chunksBroken = 1;
+            continue;
+        }
+        ChunkCursor cur;
+        ChunkRef ref;
+        int rc;
+        imageChunkStart(c->img, start, &cur);
+        while ((rc = imageChunkNext(c->img, &cur, &ref)) > 0) {
+            /* chunks are shared by design; only the first file to get
+               to one walks it */
+            if (ref.start >= c->first && ref.start < c->nBlocks &&
+                markBit(c->chunkStarts, ref.start)) {
+                continue;
+            }
+            FileCheck chunk = {0, 0, 0, 0};
+            if (!markChain(c, ref.start, &chunk)) {
+                f->chunksBroken = 1;
+            }
+        }
+        if (rc < 0) {
+            f->chunksBroken = 1;
+        }
+    }
+}
+
+/* pass 3: which orphans are pointed to by another orphan */
+static void *predThread(void *arg) {
+    Segment *g = arg;
+    Checker *c = g->c;
+    for (uint32_t w = g->loWord; w < g->hiWord; w++) {
+        uint64_t word = orphanWord(c, w);
+        while (word) {
+            uint32_t b = w * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+            g->orphans++;
+            uint32_t next = fatGet(c, b);
+            if (next >= c->first && next < c->nBlocks &&
+                !testBit((const uint64_t *)c->reach, next) &&
+                !testBit(c->onList, next)) {
+                markBit(c->hasPred, next);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *headThread(void *arg) {
+    Segment *g = arg;
+    Checker *c = g->c;
+    for (uint32_t w = g->loWord; w < g->hiWord; w++) {
+        uint64_t word = orphanWord(c, w) &
+                        ~atomic_load_explicit(&c->hasPred[w],
+                                              memory_order_relaxed);
+        while (word) {
+            uint32_t b = w * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+            if (g->nHeads == g->headsCap) {
+                g->headsCap = g->headsCap ? g->headsCap * 2 : 64;
+                g->heads = realloc(g->heads, g->headsCap * sizeof(uint32_t));
+                if (g->heads == NULL) {
+                    perror("realloc");
+                    exit(2);
+                }
+            }
+            g->heads[g->nHeads++] = b;
+        }
+    }
+    return NULL;
+}
+
+/* pass 4: link the unreachable blocks of the segment, top down */
+static void *rebuildThread(void *arg) {
+    Segment *g = arg;
+    Checker *c = g->c;
+    uint32_t prev = 0;
+    for (uint32_t w = g->hiWord; w-- > g->loWord; ) {
+        uint64_t word = ~atomic_load_explicit(&c->reach[w],
+                                              memory_order_relaxed);
+        uint64_t base = (uint64_t)w * 64;
+        if (base + 64 > c->nBlocks) {
+            word &= (1ull << (c->nBlocks - base)) - 1;
+        }
+        while (word) {
+            uint32_t b = w * 64 + 63 - __builtin_clzll(word);
+            word &= ~(1ull << (b % 64));
+            if (prev) {
+                fatSet(c, prev, b);
+            } else {
+                g->top = b;
+            }
+            prev = b;
+            g->nFree++;
+        }
+    }
+    if (prev) {
+        fatSet(c, prev, 0);
+        g->bottom = prev;
+    }
+    return NULL;
+}
+
+static void runSegments(Segment *segments, int n, void *(*fn)(void *)) {
+    pthread_t *threads = malloc(n * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < n) {
+        int err = pthread_create(&threads[started], NULL, fn,
+                                 &segments[started]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+        started++;
+    }
+    /* the segments without a thread are done on this one */
+    for (int t = started; t < n; t++) {
+        fn(&segments[t]);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+/**
+ * @brief walk an orphan chain from @head through orphans only.
+ * @return its length; @last is its last block.
+ */
+static uint32_t orphanChain(Checker *c, uint32_t head, uint32_t *last) {
+    uint32_t n = 0;
+    uint32_t b = head;
+    *last = head;
+    while (b >= c->first && b < c->nBlocks && n < c->nBlocks &&
+           !testBit((const uint64_t *)c->reach, b) && !testBit(c->onList, b)) {
+        *last = b;
+        n++;
+        b = fatGet(c, b);
+    }
+    return n;
+}
+
+/* does an orphan chain of @n blocks starting at @head hold a whole file */
+static int looksLikeFile(const Checker *c, uint32_t head, uint32_t n) {
+    const uint32_t *meta = (const uint32_t *)blockPtr(c, head, 0);
+    if (meta[0] != F439_TYPE_FILE) {
+        return 0;
+    }
+    uint64_t firstData = c->blockSize - F439_HEADER_SIZE;
+    uint64_t need = meta[1] < firstData
+                    ? 1 : 1 + (meta[1] - firstData + c->blockSize - 1) /
+                          c->blockSize;
+    return need <= n;
+}
+
+/* add a directory entry lostNNNN for the chain at @head; 0 if full */
+static int reattach(Checker *c, uint32_t head, uint32_t *counter) {
+    uint32_t *rootMetaData = rootMeta(c);
+    uint32_t n = rootMetaData[1] / F439_DIRENT_SIZE;
+    if (F439_HEADER_SIZE + (n + 1) * F439_DIRENT_SIZE > c->blockSize) {
+        return 0;
+    }
+    DirEntry *e = dirEntry(c, n);
+    memset(e, 0, sizeof(*e));
+    for (;;) {
+        char name[F439_NAME_LEN + 1];
+        snprintf(name, sizeof(name), "lost%04u", ++*counter);
+        int taken = 0;
+        for (uint32_t i = 0; i < n && !taken; i++) {
+            taken = strncmp(dirEntry(c, i)->name, name,
+                            F439_NAME_LEN) == 0;
+        }
+        if (!taken) {
+            memcpy(e->name, name, strlen(name));
+            break;
+        }
+    }
+    e->start = head;
+    rootMetaData[1] += F439_DIRENT_SIZE;
+    return 1;
+}
+
+/**
+ * @brief map image @name, of any geometry that reader.h reads; only the
+ *        default one may have a layout.
+ * @return 0 on success, -1 on failure (with a message printed).
+ */
+static int openImage(Image *img, const char *name, int prot,
+                     uint32_t *blockSize, uint32_t *fatWidth) {
+    char block0[F439_GEOMETRY_OFFSET + sizeof(Geometry)] = {0};
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        perror(name);
+        return -1;
+    }
+    ssize_t n = read(fd, block0, sizeof(block0));
+    close(fd);
+    imageGeometry(block0, blockSize, fatWidth);
+    if (n < (ssize_t)sizeof(block0) ||
+        (*blockSize == F439_BLOCK_SIZE && *fatWidth == 32)) {
+        return imageOpen(img, name, prot);
+    }
+
+    memset(img, 0, sizeof(*img));
+    img->fd = open(name, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (img->fd < 0 || fstat(img->fd, &st) < 0) {
+        perror(name);
+        if (img->fd >= 0) {
+            close(img->fd);
+        }
+        return -1;
+    }
+    img->mapLength = st.st_size;
+    img->mapStart = mmap(0, img->mapLength, prot, MAP_SHARED, img->fd, 0);
+    if (img->mapStart == MAP_FAILED) {
+        perror("mmap");
+        close(img->fd);
+        return -1;
+    }
+    F439Reader r;
+    if (f439ReaderOpen(&r, img->mapStart, img->mapLength) < 0) {
+        fprintf(stderr, "%s: not an F439 image of a known geometry\n", name);
+        munmap(img->mapStart, img->mapLength);
+        close(img->fd);
+        return -1;
+    }
+    img->super = (Super *)img->mapStart;
+    img->blocks = (char *)img->mapStart;
+    img->headBlocks = img->super->nBlocks;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int nThreads = 4;
+    int repair = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            repair = 1;
+        } else {
+            break;
+        }
+    }
+    if (i + 1 != argc || nThreads < 1) {
+        fprintf(stderr, "usage: %s [-j threads] [-r] <image>\n", argv[0]);
+        exit(2);
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    Image img;
+    Checker c;
+    memset(&c, 0, sizeof(c));
+    if (openImage(&img, argv[i], repair ? PROT_READ | PROT_WRITE : PROT_READ,
+                  &c.blockSize, &c.fatWidth) < 0) {
+        exit(2);
+    }
+    c.img = &img;
+    c.fat = img.blocks + c.blockSize;
+    c.nBlocks = img.super->nBlocks;
+    c.first = 1 + ((uint64_t)c.nBlocks * (c.fatWidth / 8) + c.blockSize - 1) /
+                  c.blockSize;
+    c.nWords = (c.nBlocks + 63) / 64;
+    c.nFiles = rootMeta(&c)[1] / F439_DIRENT_SIZE;
+    c.reach = calloc(c.nWords, sizeof(uint64_t));
+    c.onList = calloc(c.nWords, sizeof(uint64_t));
+    c.hasPred = calloc(c.nWords, sizeof(uint64_t));
+    c.chunkStarts = calloc(c.nWords, sizeof(uint64_t));
+    c.files = calloc(c.nFiles ? c.nFiles : 1, sizeof(FileCheck));
+    if (c.reach == NULL || c.onList == NULL || c.hasPred == NULL ||
+        c.chunkStarts == NULL || c.files == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+    /* the metadata and the root directory are always in use */
+    for (uint32_t b = 0; b < c.first; b++) {
+        markBit(c.reach, b);
+    }
+    markBit(c.reach, img.super->root);
+
+    int problems = 0;
+    int unrepaired = 0;   /* what -r leaves as it is */
+
+    /* 1. mark */
+    Segment *segments = calloc(nThreads, sizeof(Segment));
+    pthread_t *threads = malloc(nThreads * sizeof(pthread_t));
+    if (segments == NULL || threads == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+    int started = 0;
+    while (started < nThreads) {
+        int err = pthread_create(&threads[started], NULL, markThread, &c);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+        started++;
+    }
+    if (started < nThreads) {
+        /* whatever the threads do not get to is walked on this one */
+        markThread(&c);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    for (uint32_t f = 0; f < c.nFiles; f++) {
+        const DirEntry *e = dirEntry(&c, f);
+        if (c.files[f].broken) {
+            printf("%.12s: chain broken after %u blocks\n", e->name,
+                   c.files[f].blocks);
+            if (repair && c.files[f].last) {
+                /* keep what is left, and the size to what it holds */
+                fatSet(&c, c.files[f].last, 0);
+                uint32_t *meta = (uint32_t *)blockPtr(&c, e->start, 0);
+                uint64_t holds = (uint64_t)c.files[f].blocks *
+                                 c.blockSize - F439_HEADER_SIZE;
+                if (meta[0] == F439_TYPE_FILE && meta[1] > holds) {
+                    printf("%.12s: truncated to %lu bytes\n", e->name,
+                           (unsigned long)holds);
+                    meta[1] = holds;
+                }
+            }
+            problems = 1;
+        }
+        if (c.files[f].chunksBroken) {
+            printf("%.12s: chunk list is broken\n", e->name);
+            problems = 1;
+            unrepaired = 1;
+        }
+    }
+    if (repair) {
+        /* a chain broken at its head has nothing to keep: drop the entry,
+           so its blocks are found as orphans (and reattached) or freed */
+        uint32_t kept = 0;
+        for (uint32_t f = 0; f < c.nFiles; f++) {
+            DirEntry *e = dirEntry(&c, f);
+            if (c.files[f].broken && c.files[f].last == 0) {
+                printf("%.12s: dropped from the directory\n", e->name);
+                continue;
+            }
+            if (kept != f) {
+                *dirEntry(&c, kept) = *e;
+            }
+            kept++;
+        }
+        rootMeta(&c)[1] -= (c.nFiles - kept) * F439_DIRENT_SIZE;
+        c.nFiles = kept;
+    }
+    if (atomic_load(&c.crossLinks)) {
+        printf("%lu cross-linked chains\n",
+               (unsigned long)atomic_load(&c.crossLinks));
+        problems = 1;
+    }
+
+    /* 2. the old free list */
+    uint64_t onList = 0;
+    for (uint32_t b = img.super->avail; b != 0; b = fatGet(&c, b)) {
+        if (b < c.first || b >= c.nBlocks || testBit(c.onList, b) ||
+            testBit((const uint64_t *)c.reach, b)) {
+            printf("free list broken after %lu blocks at block %u\n",
+                   (unsigned long)onList, b);
+            problems = 1;
+            break;
+        }
+        c.onList[b / 64] |= 1ull << (b % 64);
+        onList++;
+    }
+
+    /* 3. orphans */
+    uint32_t per = (c.nWords + nThreads - 1) / nThreads;
+    for (int t = 0; t < nThreads; t++) {
+        segments[t].c = &c;
+        segments[t].loWord = t * per < c.nWords ? t * per : c.nWords;
+        segments[t].hiWord = (t + 1) * per < c.nWords ? (t + 1) * per
+                                                      : c.nWords;
+    }
+    runSegments(segments, nThreads, predThread);
+    runSegments(segments, nThreads, headThread);
+    uint64_t orphans = 0, lostBlocks = 0, lostFiles = 0, reattached = 0;
+    uint32_t counter = 0;
+    for (int t = 0; t < nThreads; t++) {
+        orphans += segments[t].orphans;
+        for (uint32_t k = 0; k < segments[t].nHeads; k++) {
+            uint32_t head = segments[t].heads[k], last;
+            uint32_t n = orphanChain(&c, head, &last);
+            if (!looksLikeFile(&c, head, n)) {
+                continue;
+            }
+            lostFiles++;
+            lostBlocks += n;
+            printf("orphan chain at block %u: %u blocks, a file of %u bytes\n",
+                   head, n, ((uint32_t *)blockPtr(&c, head, 0))[1]);
+            if (repair && reattach(&c, head, &counter)) {
+                fatSet(&c, last, 0);
+                for (uint32_t b = head, m = 0; m < n; m++, b = fatGet(&c, b)) {
+                    markBit(c.reach, b);
+                }
+                reattached++;
+            }
+        }
+    }
+    if (orphans) {
+        printf("%lu orphan blocks: %lu in %lu lost files, %lu leaked\n",
+               (unsigned long)orphans, (unsigned long)lostBlocks,
+               (unsigned long)lostFiles,
+               (unsigned long)(orphans - lostBlocks));
+        problems = 1;
+    }
+
+    /* 4. rebuild the free list, unless blocks that are still in use were
+       never marked */
+    uint64_t nFree = onList;
+    if (repair && problems && unrepaired) {
+        printf("free list not rebuilt: a chunk list is broken\n");
+    } else if (repair && problems) {
+        runSegments(segments, nThreads, rebuildThread);
+        uint32_t bottom = 0;   /* of the segments linked so far */
+        img.super->avail = 0;
+        nFree = 0;
+        for (int t = nThreads - 1; t >= 0; t--) {
+            if (segments[t].nFree) {
+                if (bottom) {
+                    fatSet(&c, bottom, segments[t].top);
+                } else {
+                    img.super->avail = segments[t].top;
+                }
+                bottom = segments[t].bottom;
+                nFree += segments[t].nFree;
+            }
+        }
+    }
+    if (repair && problems) {
+        int failed = msync(img.mapStart, img.mapLength, MS_SYNC) < 0;
+        for (uint32_t k = 0; k < img.nBacking; k++) {
+            failed |= msync(img.backing[k].map, img.backing[k].length,
+                            MS_SYNC) < 0;
+        }
+        if (failed) {
+            perror("msync");
+            exit(2);
+        }
+        if (!unrepaired) {
+            printf("free list rebuilt: %lu blocks (was %lu); %lu lost files "
+                   "reattached\n", (unsigned long)nFree,
+                   (unsigned long)onList, (unsigned long)reattached);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%s: %u files, %u blocks, %lu free, %s (%.3f s)\n", argv[i],
+           c.nFiles + (uint32_t)reattached, c.nBlocks, (unsigned long)nFree,
+           !problems ? "clean"
+                     : repair && !unrepaired ? "repaired" : "NOT CLEAN",
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+    for (int t = 0; t < nThreads; t++) {
+        free(segments[t].heads);
+    }
+    free(segments);
+    free(c.files);
+    free((void *)c.reach);
+    free(c.onList);
+    free((void *)c.hasPred);
+    free((void *)c.chunkStarts);
+    imageClose(&img);
+    return problems;
+}
@@ -0,0 +1,177 @@
+#include <string.h>
+#include "index.h"
+
+/**
+ * The chains written by mkfs come off a free list that hands out blocks from
+ * the top of the disk downwards, so a freshly built file is one long
+ * descending run. That is why extents carry a direction instead of assuming
+ * that adjacent blocks ascend.
+ */
+
+
+/* FNV-1a over at most F439_NAME_LEN characters of @name */
+static uint32_t nameHash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < F439_NAME_LEN && name[i]; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief walk the chain starting at @head and hand every extent to @emit
+ *        (when non-NULL). A chain longer than the disk must contain a cycle.
+ * @return the number of extents, or -1 on a corrupted chain.
+ */
+static long walkChain(const Image *img, uint32_t head, Extent *emit,
+                      uint32_t *chainLength) {
+    uint32_t nBlocks = img->super->nBlocks;
+    uint32_t firstData = imageFirstData(nBlocks);
+    long nExtents = 0;
+    uint32_t pos = 0;
+    Extent cur = {0, 0, 1, 0};
+
+    for (uint32_t b = head; b != 0; b = img->fat[b]) {
+        if (b < firstData || b >= nBlocks || pos >= nBlocks) {
+            return -1;
+        }
+        if (cur.count == 1 && (b == cur.start + 1 || b + 1 == cur.start)) {
+            /* the second block decides the direction of the run */
+            cur.step = (b > cur.start) ? 1 : -1;
+            cur.count++;
+        } else if (cur.count > 1 &&
+                   b == cur.start + cur.step * (int32_t)cur.count) {
+            cur.count++;
+        } else {
+            if (cur.count) {
+                if (emit) {
+                    emit[nExtents] = cur;
+                }
+                nExtents++;
+            }
+            cur.start = b;
+            cur.count = 1;
+            cur.step = 1;
+            cur.logical = pos;
+        }
+        pos++;
+    }
+    if (cur.count) {
+        if (emit) {
+            emit[nExtents] = cur;
+        }
+        nExtents++;
+    }
+    *chainLength = pos;
+    return nExtents;
+}
+
+static uint32_t slotCount(uint32_t nFiles) {
+    uint32_t n = 1;
+    while (n < 2 * nFiles) {
+        n <<= 1;
+    }
+    return n;
+}
+
+size_t indexSize(const Image *img) {
+    uint32_t nFiles = imageDirCount(img);
+    size_t nExtents = 0;
+    for (uint32_t i = 0; i < nFiles; i++) {
+        uint32_t len;
+        long n = walkChain(img, imageDirEntry(img, i)->start, NULL, &len);
+        if (n < 0) {
+            return 0;
+        }
+        nExtents += n;
+    }
+    return sizeof(Index) + nFiles * sizeof(IndexFile) +
+           nExtents * sizeof(Extent) + slotCount(nFiles) * sizeof(int32_t);
+}
+
+int indexBuild(const Image *img, Index *idx, size_t size) {
+    uint32_t nFiles = imageDirCount(img);
+    idx->magic = INDEX_MAGIC;
+    idx->nFiles = nFiles;
+    idx->nExtents = 0;
+    idx->nSlots = slotCount(nFiles);
+    idx->size = size;
+
+    /* the extent array starts right after the file array; fill it first and
+       only then fix nExtents, which moves where the slots begin */
+    IndexFile *files = indexFiles(idx);
+    Extent *extents = indexExtents(idx);
+    size_t room = (size - sizeof(Index) - nFiles * sizeof(IndexFile) -
+                   idx->nSlots * sizeof(int32_t)) / sizeof(Extent);
+    uint32_t nExtents = 0;
+
+    for (uint32_t i = 0; i < nFiles; i++) {
+        DirEntry *de = imageDirEntry(img, i);
+        IndexFile *f = &files[i];
+        memset(f->name, 0, sizeof(f->name));
+        memcpy(f->name, de->name, F439_NAME_LEN);
+        f->head = de->start;
+
+        uint32_t len;
+        long n = walkChain(img, de->start, NULL, &len);
+        if (n < 0 || nExtents + (size_t)n > room) {
+            return -1;
+        }
+        walkChain(img, de->start, extents + nExtents, &len);
+        f->size = imageFileSize(img, de->start);
+        f->firstExtent = nExtents;
+        f->nExtents = n;
+        f->nBlocks = len;
+        nExtents += n;
+    }
+    idx->nExtents = nExtents;
+
+    int32_t *slots = indexSlots(idx);
+    for (uint32_t s = 0; s < idx->nSlots; s++) {
+        slots[s] = -1;
+    }
+    for (uint32_t i = 0; i < nFiles; i++) {
+        uint32_t s = nameHash(files[i].name) & (idx->nSlots - 1);
+        while (slots[s] != -1) {
+            s = (s + 1) & (idx->nSlots - 1);
+        }
+        slots[s] = i;
+    }
+    return 0;
+}
+
+const IndexFile *indexLookup(const Index *idx, const char *name) {
+    if (idx->nFiles == 0) {
+        return NULL;
+    }
+    int32_t *slots = indexSlots(idx);
+    IndexFile *files = indexFiles(idx);
+    uint32_t s = nameHash(name) & (idx->nSlots - 1);
+    while (slots[s] != -1) {
+        IndexFile *f = &files[slots[s]];
+        if (strncmp(f->name, name, F439_NAME_LEN) == 0) {
+            return f;
+        }
+        s = (s + 1) & (idx->nSlots - 1);
+    }
+    return NULL;
+}
+
+uint32_t indexBlock(const Index *idx, const IndexFile *f, uint32_t chainPos) {
+    if (chainPos >= f->nBlocks) {
+        return 0;
+    }
+    Extent *e = indexExtents(idx) + f->firstExtent;
+    uint32_t lo = 0, hi = f->nExtents;
+    /* find the last extent whose logical start is <= chainPos */
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (e[mid].logical <= chainPos) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return e[lo].start + e[lo].step * (int32_t)(chainPos - e[lo].logical);
+}
@@ -0,0 +1,83 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "f439.h"
+
+/**
+ * The index is the decoded form of an image's metadata: the root directory
+ * with a hash table for name lookup, and for every file its chain of blocks
+ * compressed into extents (runs of physically adjacent blocks).
+ *
+ * It is one flat blob without pointers (everything is an offset from the
+ * Index header), so it can be built once and then placed anywhere - in
+ * malloc()'ed memory or in a shared memory segment mapped at different
+ * addresses in different processes. Once built it is never modified, which
+ * is what makes lookups lock-free.
+ *
+ * | Index | IndexFile files[nFiles] | Extent extents[nExtents] | slots[] |
+ */
+
+typedef struct {
+    uint32_t start;   /* first physical block of the run */
+    uint32_t count;   /* number of blocks in the run */
+    int32_t step;     /* +1 if the run ascends, -1 if it descends */
+    uint32_t logical; /* chain position of the first block of the run */
+} Extent;
+
+typedef struct {
+    char name[F439_NAME_LEN + 1]; /* NUL terminated copy of the dir entry */
+    uint32_t head;        /* first block of the chain */
+    uint32_t size;        /* file size in bytes */
+    uint32_t firstExtent; /* index into the extent array */
+    uint32_t nExtents;
+    uint32_t nBlocks;     /* length of the chain */
+} IndexFile;
+
+typedef struct {
+    uint32_t magic;    /* INDEX_MAGIC */
+    uint32_t nFiles;
+    uint32_t nExtents;
+    uint32_t nSlots;   /* size of the name hash table, a power of two */
+    uint64_t size;     /* total size of the blob in bytes */
+} Index;
+
+#define INDEX_MAGIC 0x31584449 /* "IDX1" */
+
+static inline IndexFile *indexFiles(const Index *idx) {
+    return (IndexFile *)(idx + 1);
+}
+
+static inline Extent *indexExtents(const Index *idx) {
+    return (Extent *)(indexFiles(idx) + idx->nFiles);
+}
+
+static inline int32_t *indexSlots(const Index *idx) {
+    return (int32_t *)(indexExtents(idx) + idx->nExtents);
+}
+
+/**
+ * @brief walk every chain of the image to find out how large its index is.
+ * @return the number of bytes indexBuild() needs, 0 on a corrupted image.
+ */
+size_t indexSize(const Image *img);
+
+/**
+ * @brief decode the directory and all chains of @img into @idx, which must
+ *        be indexSize(img) bytes large.
+ * @return 0 on success, -1 if the image changed or is corrupted.
+ */
+int indexBuild(const Image *img, Index *idx, size_t size);
+
+/* find a file by name; NULL if there is no such file */
+const IndexFile *indexLookup(const Index *idx, const char *name);
+
+/**
+ * @brief physical block at position @chainPos of the chain of @f, found by a
+ *        binary search over its extents.
+ * @return the block index, 0 if @chainPos is beyond the end of the chain.
+ */
+uint32_t indexBlock(const Index *idx, const IndexFile *f, uint32_t chainPos);
+
+#endif
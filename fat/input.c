@@ -0,0 +1,273 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "mkfs.h"
+
+/**
+ * Inputs that are stored compressed (mkfs --decompress) are unpacked while
+ * they are read, straight into the ingest buffers, instead of into a
+ * temporary file first. The format is told by the magic at the start of the
+ * data, not by the name; anything else is read as it is.
+ *
+ *      gzip   zlib, always; concatenated members (pigz -i, bgzip) too
+ *      xz     liblzma, with -DHAVE_LZMA; files written with xz -T have
+ *             independent blocks that are unpacked on several threads
+ *      zstd   libzstd, with -DHAVE_ZSTD; concatenated frames too
+ *
+ * In the ingest pipeline the reader thread does the unpacking, so it runs
+ * in parallel with the checksums and the placing of the data. Only whole
+ * blocks of xz can be unpacked independently: a gzip stream is one long
+ * dependency chain, and libzstd has no multithreaded decoder.
+ */
+
+#define INPUT_BUFFER (256 * 1024)
+
+static const unsigned char gzipMagic[] = {0x1f, 0x8b};
+static const unsigned char xzMagic[] = {0xfd, '7', 'z', 'X', 'Z', 0};
+static const unsigned char zstdMagic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+
+size_t inputBaseLength(const char *name) {
+    static const char *suffixes[] = {".gz", ".xz", ".zst"};
+    size_t n = strlen(name);
+    for (size_t k = 0; k < sizeof(suffixes) / sizeof(suffixes[0]); k++) {
+        size_t m = strlen(suffixes[k]);
+        if (n > m && strcmp(name + n - m, suffixes[k]) == 0) {
+            return n - m;
+        }
+    }
+    return n;
+}
+
+/* top up the read ahead buffer; @return -1 on a read error */
+static int refill(InputReader *in) {
+    if (in->pos > 0) {
+        memmove(in->buf, in->buf + in->pos, in->have - in->pos);
+        in->have -= in->pos;
+        in->pos = 0;
+    }
+    while (!in->eof && in->have < INPUT_BUFFER) {
+        ssize_t n = read(in->fd, in->buf + in->have, INPUT_BUFFER - in->have);
+        if (n < 0) {
+            return -1;
+        }
+        in->eof = n == 0;
+        in->have += n;
+        in->consumed += n;
+        ioLimitRead(n);
+    }
+    return 0;
+}
+
+static int isFormat(const InputReader *in, const unsigned char *magic, size_t n) {
+    return in->have >= n && memcmp(in->buf, magic, n) == 0;
+}
+
+static int startDecoder(InputReader *in) {
+    if (isFormat(in, gzipMagic, sizeof(gzipMagic))) {
+        z_stream *z = calloc(1, sizeof(z_stream));
+        /* 32: a gzip header, not a zlib one */
+        if (z == NULL || inflateInit2(z, 15 + 32) != Z_OK) {
+            free(z);
+            return -1;
+        }
+        in->format = INPUT_GZIP;
+        in->stream = z;
+    } else if (isFormat(in, xzMagic, sizeof(xzMagic))) {
+#ifdef HAVE_LZMA
+        lzma_stream *x = malloc(sizeof(lzma_stream));
+        if (x == NULL) {
+            return -1;
+        }
+        *x = (lzma_stream)LZMA_STREAM_INIT;
+#if LZMA_VERSION >= 50040002
+        lzma_mt mt;
+        memset(&mt, 0, sizeof(mt));
+        mt.flags = LZMA_CONCATENATED;
+        mt.threads = sysconf(_SC_NPROCESSORS_ONLN);
+        mt.memlimit_threading = (uint64_t)1 << 30;
+        mt.memlimit_stop = UINT64_MAX;
+        lzma_ret rc = lzma_stream_decoder_mt(x, &mt);
+#else
+        lzma_ret rc = lzma_stream_decoder(x, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+        if (rc != LZMA_OK) {
+            free(x);
+            return -1;
+        }
+        in->format = INPUT_XZ;
+        in->stream = x;
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    } else if (isFormat(in, zstdMagic, sizeof(zstdMagic))) {
+#ifdef HAVE_ZSTD
+        ZSTD_DStream *d = ZSTD_createDStream();
+        if (d == NULL) {
+            return -1;
+        }
+        in->format = INPUT_ZSTD;
+        in->stream = d;
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    }
+    return 0;
+}
+
+int inputOpen(InputReader *in, const char *path, int decompress) {
+    memset(in, 0, sizeof(*in));
+    in->format = INPUT_PLAIN;
+    in->fd = open(path, O_RDONLY);
+    if (in->fd < 0) {
+        return -1;
+    }
+    if (!decompress) {
+        return 0;
+    }
+    in->buf = malloc(INPUT_BUFFER);
+    if (in->buf == NULL) {
+        errno = ENOMEM;
+    } else if (refill(in) == 0 && startDecoder(in) == 0) {
+        return 0;
+    }
+    int saved = errno;
+    inputClose(in);
+    errno = saved;
+    return -1;
+}
+
+/**
+ * @brief unpack into @out until it is full or the data ends.
+ * @return the bytes unpacked, or -1 (errno EBADMSG for corrupt or truncated
+ *         data).
+ */
+static ssize_t unpack(InputReader *in, unsigned char *out, size_t length) {
+    size_t produced = 0;
+    while (produced < length && !in->done) {
+        if (in->pos == in->have && refill(in) < 0) {
+            return -1;
+        }
+        size_t avail = in->have - in->pos;
+        int ended = 0, bad = 0;
+        size_t used = 0, made = 0;
+        if (in->format == INPUT_GZIP) {
+            z_stream *z = in->stream;
+            z->next_in = in->buf + in->pos;
+            z->avail_in = avail;
+            z->next_out = out + produced;
+            z->avail_out = length - produced;
+            int rc = inflate(z, Z_NO_FLUSH);
+            used = avail - z->avail_in;
+            made = length - produced - z->avail_out;
+            ended = rc == Z_STREAM_END;
+            /* Z_BUF_ERROR: no progress possible, see below */
+            bad = rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR;
+#ifdef HAVE_LZMA
+        } else if (in->format == INPUT_XZ) {
+            lzma_stream *x = in->stream;
+            x->next_in = in->buf + in->pos;
+            x->avail_in = avail;
+            x->next_out = out + produced;
+            x->avail_out = length - produced;
+            lzma_ret rc = lzma_code(x, in->eof && avail == 0 ? LZMA_FINISH
+                                                             : LZMA_RUN);
+            used = avail - x->avail_in;
+            made = length - produced - x->avail_out;
+            ended = rc == LZMA_STREAM_END;
+            bad = rc != LZMA_OK && rc != LZMA_STREAM_END;
+#endif
+#ifdef HAVE_ZSTD
+        } else if (in->format == INPUT_ZSTD) {
+            ZSTD_inBuffer ib = {in->buf + in->pos, avail, 0};
+            ZSTD_outBuffer ob = {out + produced, length - produced, 0};
+            size_t rc = ZSTD_decompressStream(in->stream, &ob, &ib);
+            used = ib.pos;
+            made = ob.pos;
+            bad = ZSTD_isError(rc);
+            /* 0: a frame is complete */
+            ended = rc == 0;
+#endif
+        }
+        in->pos += used;
+        produced += made;
+        if (bad) {
+            errno = EBADMSG;
+            return -1;
+        }
+        if (ended && in->format != INPUT_XZ) {
+            /* another member or frame may follow; the data has ended only
+               when a refill finds none */
+            if (in->pos == in->have && refill(in) < 0) {
+                return -1;
+            }
+            if (in->pos < in->have) {
+                if (in->format == INPUT_GZIP) {
+                    inflateReset(in->stream);
+                }
+                ended = 0;
+            }
+        }
+        if (ended) {
+            in->done = 1;
+        } else if (used == 0 && made == 0 && in->eof && in->pos == in->have) {
+            /* no more input, and the decoder wants more: truncated */
+            errno = EBADMSG;
+            return -1;
+        }
+    }
+    return produced;
+}
+
+ssize_t inputRead(InputReader *in, void *buf, size_t length) {
+    if (in->format != INPUT_PLAIN) {
+        return unpack(in, buf, length);
+    }
+    if (in->pos < in->have) {
+        /* what was read to look for a magic */
+        size_t n = in->have - in->pos < length ? in->have - in->pos : length;
+        memcpy(buf, in->buf + in->pos, n);
+        in->pos += n;
+        return n;
+    }
+    ssize_t n = read(in->fd, buf, length);
+    if (n > 0) {
+        in->consumed += n;
+        ioLimitRead(n);
+    }
+    return n;
+}
+
+void inputClose(InputReader *in) {
+    if (in->format == INPUT_GZIP) {
+        inflateEnd(in->stream);
+#ifdef HAVE_LZMA
+    } else if (in->format == INPUT_XZ) {
+        lzma_end(in->stream);
+#endif
+#ifdef HAVE_ZSTD
+    } else if (in->format == INPUT_ZSTD) {
+        ZSTD_freeDStream(in->stream);
+        in->stream = NULL;
+#endif
+    }
+    free(in->stream);
+    free(in->buf);
+    if (in->fd >= 0) {
+        close(in->fd);
+    }
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+}
@@ -8,9 +8,19 @@
 #define _POSIX_C_SOURCE 200809L
 #include <stdint.h>
 #include <stdio.h>    /* size_t */
+#include <stdlib.h>   /* exit(), malloc() */
+#include <errno.h>
 #include <fcntl.h>    /* open(), read(), write() and their friends */
+#include <unistd.h>   /* ftruncate(), close() */
+#include <libgen.h>   /* basename() */
 #include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
 #include <string.h>   /* strdup(), strncpy() */
+#include <time.h>     /* clock_gettime() */
+#include "mkfs.h"
+#include "perfctr.h"
+#include "probes.h"
+#include "rmap.h"
 
 /**
  * mkfs creates a FS image, with block size being 512 bytes. The size of the 
@@ -62,51 +72,61 @@
  */
 
 
-/* super block that stores the information of this FS image */
-typedef struct {
-    char magic[4];
-    /* below are all of type uint32_t, so they are all numbers */
-    uint32_t nBlocks; /* the total number of blocks (n) */
-    uint32_t avail;   /* the number of available blocks (n-1) */
-    uint32_t root;    /* index of the root directory */
-} Super;
 
 
 /**
+ * The super block layout (Super) lives in f439.h, shared with the tools that
+ * read images. An Image ties the pieces of one mapped image together:
  * mapStart == super == blocks
  * mapStart: void * (for mmap())
  * super:    Super * - for super block 
  * blocks:   char * - 1 byte granularity
  * fat:      uint32_t * - starts from the second disk block, 4 byte granularity
  * 
+ * They used to be globals; they are passed around now because a build server
+ * (server.c) builds many images in one process.
  */
-Super *super;  /* the super block that manages all the disk blocks; resides in the 1st disk block */
-uint32_t *fat; /* file allocation table, an array of uint32_t */
-char *blocks;  /* the disk blocks with 1 byte granularity */
-void *mapStart; /* the starting of the mmap'ed area of the file system (disk image) */
-size_t mapLength; /* the size of the disk image */
+
+FILE *mkfsErr; /* where error messages go, see mkfs.h */
+
+static FILE *errOut(void) {
+    return mkfsErr ? mkfsErr : stderr;
+}
+
+/* perror() that honours mkfsErr */
+static void fail(const char *what) {
+    fprintf(errOut(), "%s: %s\n", what, strerror(errno));
+}
 
 
 /**
  * @brief get the @index of the first available block;
  *        update @super->avail field;
  *        mark fat[@index] as 0, indicating that block is used.
- * @return the @index of the first available block.
+ * @return the @index of the first available block, 0 if the disk is full
+ *         (block 0 is the super block, so it is never handed out).
  */
-uint32_t getBlock() {
+uint32_t getBlock(Image *img) {
     /* get the index of the available disk block */
-    uint32_t idx = super->avail;
+    uint32_t idx = img->super->avail;
 
     /* index starts from max avail, then decrease */
     if (idx == 0) {
-        fprintf(stderr, "disk is full\n");
-        exit(-1);
+        fprintf(errOut(), "disk is full\n");
+        return 0;
     }
 
     /* we update the @super->avail value, get one block from fat, and mark that 
        entry in fat as 0 */
-    super->avail = fat[idx];
-    fat[idx] = 0;
+    img->super->avail = img->fat[idx];
+    img->fat[idx] = 0;
+    F439_PROBE2(block_alloc, idx, img->super->avail);
+    if (mkfsDropBehind && idx % (DROP_WINDOW / F439_BLOCK_SIZE) == 0) {
+        dropImageWindows(img, idx);
+    }
+    if (ioLimitsWrite()) {
+        ioLimitBlock(img, idx);
+    }
     return idx;
 }
 
@@ -118,9 +138,183 @@ uint32_t getBlock() {
  * @param offset the offset within the disk block
  * @return the address within the disk block
  */
-char *toPtr(uint32_t idx, uint32_t offset) {
-    /* blocks is of type char * */
-    return blocks + idx * 512 + offset;
+char *toPtr(Image *img, uint32_t idx, uint32_t offset) {
+    /* blocks is of type char *; a striped image has most blocks elsewhere,
+       see imageToPtr() */
+    return imageToPtr(img, idx, offset);
+}
+
+
+/**
+ * @brief start a new file: take its first block and write the first half of
+ *        its metadata.
+ * @return 0 on success, -1 if the disk is full.
+ */
+int writerStart(Image *img, FileWriter *w) {
+    /* get the index within the disk blocks that has a free block */
+    w->start = getBlock(img);
+    if (w->start == 0) {
+        return -1;
+    }
+
+    /* the offset passed into toPtr() is 0, so fileMetaData points to the start
+       of the free disk block */
+    uint32_t *fileMetaData = (uint32_t *)toPtr(img, w->start, 0);
+
+    /* disk block size is 512 bytes, the first 4 bytes stores 1 (metadata) */
+    fileMetaData[0] = 1;
+
+    w->current = w->start;
+
+    /* this might be confusing - why minus 8 bytes? Because fileMetaData takes
+       up 8 bytes and we have only written 4 bytes - 4 bytes not yet written.
+       fileMetaData[0] = 1, fileMetaData[1] = file size */
+    w->leftInBlock = 512 - 8;
+    w->blockOffset = 8;
+    w->totalSize = 0;
+    return 0;
+}
+
+/**
+ * @brief free space in the current block, chaining a new block first if the
+ *        current one is full.
+ * @param len set to the number of bytes that may be written at the result
+ * @return where the next bytes of the file go, NULL if the disk is full.
+ */
+char *writerSpace(Image *img, FileWriter *w, uint32_t *len) {
+    /* if the block is full, then we need to get another disk block to store
+       the rest of the file */
+    if (w->leftInBlock == 0) {
+        uint32_t b = getBlock(img); /* get the index of the free disk block */
+        if (b == 0) {
+            return NULL;
+        }
+        // fat[current] is 0, we update it to point to the new block
+        img->fat[w->current] = b;
+        w->current = b;
+        w->blockOffset = 0;
+        w->leftInBlock = 512;
+    }
+    *len = w->leftInBlock;
+    return toPtr(img, w->current, w->blockOffset);
+}
+
+/* account for @n bytes written at writerSpace() */
+void writerAdvance(FileWriter *w, uint32_t n) {
+    w->blockOffset += n;
+    w->leftInBlock -= n;
+    w->totalSize += n;
+}
+
+/* copy @length bytes from memory to the end of the file */
+int writerAppend(Image *img, FileWriter *w, const char *data,
+                        size_t length) {
+    while (length) {
+        uint32_t room;
+        char *dest = writerSpace(img, w, &room);
+        if (dest == NULL) {
+            return -1;
+        }
+        uint32_t n = length < room ? length : room;
+        memcpy(dest, data, n);
+        writerAdvance(w, n);
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/* write the file size into the metadata; @return the first block */
+uint32_t writerFinish(Image *img, FileWriter *w) {
+    uint32_t *fileMetaData = (uint32_t *)toPtr(img, w->start, 0);
+    fileMetaData[1] = w->totalSize;
+    return w->start;
+}
+
+
+static int sameFile(const CachedFile *c, const struct stat *st) {
+    return c->dev == st->st_dev && c->ino == st->st_ino &&
+           c->size == st->st_size && c->mtime.tv_sec == st->st_mtim.tv_sec &&
+           c->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void cacheDrop(FileCache *cache, CachedFile **link) {
+    CachedFile *c = *link;
+    *link = c->next;
+    cache->bytes -= c->size;
+    free(c->path);
+    free(c->data);
+    free(c);
+}
+
+void cacheClear(FileCache *cache) {
+    while (cache->head) {
+        cacheDrop(cache, &cache->head);
+    }
+}
+
+/**
+ * @brief find @path in the cache. A stale entry (the file changed since it
+ *        was cached) is dropped. A hit moves to the front of the list.
+ */
+static CachedFile *cacheLookup(FileCache *cache, const char *path,
+                               const struct stat *st) {
+    for (CachedFile **link = &cache->head; *link; link = &(*link)->next) {
+        CachedFile *c = *link;
+        if (strcmp(c->path, path) != 0) {
+            continue;
+        }
+        if (!sameFile(c, st)) {
+            cacheDrop(cache, link);
+            return NULL;
+        }
+        *link = c->next;
+        c->next = cache->head;
+        cache->head = c;
+        return c;
+    }
+    return NULL;
+}
+
+/* take ownership of @data, evicting the least recently used entries */
+static void cacheInsert(FileCache *cache, const char *path,
+                        const struct stat *st, char *data) {
+    while (cache->head && cache->bytes + st->st_size > cache->limit) {
+        CachedFile **link = &cache->head;
+        while ((*link)->next) {
+            link = &(*link)->next;
+        }
+        cacheDrop(cache, link);
+    }
+    CachedFile *c = malloc(sizeof(CachedFile));
+    if (c == NULL || (c->path = strdup(path)) == NULL) {
+        free(c);
+        free(data);
+        return;
+    }
+    c->dev = st->st_dev;
+    c->ino = st->st_ino;
+    c->size = st->st_size;
+    c->mtime = st->st_mtim;
+    c->data = data;
+    c->next = cache->head;
+    cache->head = c;
+    cache->bytes += c->size;
+}
+
+/* read exactly @length bytes, unless the file ends early */
+static ssize_t readFully(int fd, char *buf, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = read(fd, buf + done, length - done);
+        if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
 }
 
 /**
@@ -136,81 +330,131 @@ char *toPtr(uint32_t idx, uint32_t offset) {
  * fat initially was: [0,0,0,2,3,4]
  * If fat = [0,0,0,2,3,0], then there will be  
  * 
+ * When a FileCache is given, small enough files are kept in memory and an
+ * unchanged file is copied from there instead of being read again.
+ * 
  * @param fileName the name of the file passed in with main().
- * @return the index of the disk block that stores the beginning of the file.
+ * @return the index of the disk block that stores the beginning of the file,
+ *         0 on failure.
  */
-uint32_t oneFile(const char *fileName) {
+uint32_t oneFile(Image *img, const char *fileName, FileCache *cache) {
+    F439_PROBE1(file_start, fileName);
     int fd = open(fileName, O_RDONLY);
     if (fd < 0) {
-        perror("open");
-        exit(-1);
+        fail(fileName);
+        return 0;
     }
+    sourceAdvise(fd);
 
-    /* get the index within the disk blocks that has a free block */
-    uint32_t startBlockIndex = getBlock();
-
-    /* the offset passed into toPtr() is 0, so fileMetaData points to the start
-       of the free disk block */
-    uint32_t *fileMetaData = (uint32_t)toPtr(startBlockIndex, 0);
-
-    /* disk block size is 512 bytes, the first 4 bytes stores 1 (metadata) */
-    fileMetaData[0] = 1;
-
-    uint32_t currentBlockIndex = startBlockIndex;
+    FileWriter w;
+    if (writerStart(img, &w) < 0) {
+        close(fd);
+        return 0;
+    }
 
-    /* this might be confusing - why minus 8 bytes? Because fileMetaData takes
-       up 8 bytes and we have only written 4 bytes - 4 bytes not yet written.
-       fileMetaData[0] = 1, fileMetaData[1] = file size */
-    uint32_t leftInBlock = 512 - 8;
-    uint32_t blockOffset = 8; /* the current offset within the block */
-    uint32_t totalSize = 0; /* the size of the whole file */
+    struct stat st;
+    if (cache && cache->limit && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        CachedFile *c = cacheLookup(cache, fileName, &st);
+        if (c) {
+            cache->hits++;
+            close(fd);
+            if (writerAppend(img, &w, c->data, c->size) < 0) {
+                return 0;
+            }
+            return writerFinish(img, &w);
+        }
+        cache->misses++;
+        if ((size_t)st.st_size <= cache->limit) {
+            char *data = malloc(st.st_size ? st.st_size : 1);
+            ssize_t n = data ? readFully(fd, data, st.st_size) : -1;
+            close(fd);
+            if (n != st.st_size) {
+                /* the file changed under us; do not cache a torn copy */
+                fprintf(errOut(), "%s: read failed\n",
+                        fileName);
+                free(data);
+                return 0;
+            }
+            if (writerAppend(img, &w, data, n) < 0) {
+                free(data);
+                return 0;
+            }
+            cacheInsert(cache, fileName, &st, data);
+            return writerFinish(img, &w);
+        }
+    }
 
+    off_t done = 0, dropped = 0, charged = 0;
     while (1) {
-        /* if the block is full, then we need to get another disk block to store
-           the rest of the file */
-        if (leftInBlock == 0) {
-            uint32_t b = getBlock(); /* get the index of the free disk block */
-            // fat[currentBlockIndex] is 0, we update it to be currentBlockIndex
-            fat[currentBlockIndex] = b;
-            currentBlockIndex = b;
-            blockOffset = 0;
-            leftInBlock = 512;
+        uint32_t leftInBlock;
+        char *dest = writerSpace(img, &w, &leftInBlock);
+        if (dest == NULL) {
+            close(fd);
+            return 0;
         }
 
         /* read the file of length=leftInBlock to our FS disk block(s) */
-        ssize_t n = read(fd, toPtr(currentBlockIndex, blockOffset), leftInBlock);
+        ssize_t n = read(fd, dest, leftInBlock);
         if (n < 0) { 
             /* read failure */
-            perror("read");
-            exit(-1);
+            fail("read");
+            close(fd);
+            return 0;
         } else if (n == 0) { 
             /* no more to read, file has reached EOF */
-            fileMetaData[1] = totalSize;
             break;
         } else {
             /* update the tracking values */
-            blockOffset += n;
-            leftInBlock -= n;
-            totalSize += n;
+            writerAdvance(&w, n);
+            done += n;
+            sourceDropBehind(fd, &dropped, done, 0);
+            /* the reads are as small as a block; charge whole operations */
+            if (done - charged >= IO_OP_SIZE) {
+                ioLimitRead(done - charged);
+                charged = done;
+            }
         }
     }
 
+    ioLimitRead(done - charged);
+    sourceDropBehind(fd, &dropped, done, 1);
     close(fd);
-    return startBlockIndex;
+    return writerFinish(img, &w);
 }
 
 
-
-int main(int argc, const char *argv[]) {
-    if (argc < 4) {
-        fprintf(stderr, "usage: %s <image name> <nBlocks> <file0> <file1> ...\n", argv[0]);
-        exit(1);
+uint64_t blocksFor(off_t size) {
+    if (size < 512 - 8) {
+        return 1;
     }
+    return 2 + (size - (512 - 8)) / 512;
+}
 
-    const char *imageName = argv[1];   /* name of the image */
-    int nBlocks = atoi(argv[2]);       /* number of blocks for FS */
-    const char **fileNames = &argv[3]; /* treat file names as an array */
-    int nFiles = argc - 3;             /* number of the files in this image */
+
+/**
+ * @brief create (or overwrite) the image file, map it and write the super
+ *        block and, if @linkFree, the initial free list in the fat. With a
+ *        @layout, the image is striped over backing files (stripe.c).
+ * @return 0 on success, -1 on failure.
+ */
+int createImage(Image *img, const char *imageName, uint32_t nBlocks,
+                int linkFree, const Layout *layout) {
+    /* fatBlocks is the number of the disk blocks that fat itself takes up. */
+    uint32_t fatBlocks = imageFatBlocks(nBlocks);
+
+    /* the super block, the fat and the root directory must fit, and
+       nBlocks * 4 must not overflow */
+    if (nBlocks > (UINT32_MAX / 4) || nBlocks < fatBlocks + 3) {
+        fprintf(errOut(), "bad number of blocks: %u\n",
+                nBlocks);
+        return -1;
+    }
+    if (layout && (layout->headBlocks < 1 + fatBlocks ||
+                   layout->headBlocks > nBlocks)) {
+        fprintf(errOut(), "bad layout: %u blocks in the image file\n",
+                layout->headBlocks);
+        return -1;
+    }
 
     /* open the image, if not exist, then create one */
     /* 0777: user, group, others all have read(4), write(2) and execute(1) permission
@@ -218,40 +462,45 @@ int main(int argc, const char *argv[]) {
               S_IRGRP | S_IWGRP | // group has read(00040) and write(00020) permission 
               S_IROTH | S_IWOTH   // others have read(00004) and write(00002) permission
     */
-    int fd = open(imageName, O_CREAT | O_RDWR, 0666);
-    if (fd == -1) {
-        perror("create"); /* perror prints a system error msg */
-        exit(1);
+    img->fd = open(imageName, O_CREAT | O_RDWR, 0666);
+    if (img->fd == -1) {
+        fail("create"); /* perror prints a system error msg */
+        return -1;
     }
 
-    mapLength = nBlocks * 512;
+    /* with a layout, the image file only holds the first blocks */
+    img->headBlocks = layout ? layout->headBlocks : nBlocks;
+    img->nBacking = 0;
+    img->backing = NULL;
+    img->mapLength = (size_t)img->headBlocks * 512;
 
     /* truncate the image to length of (nBlocks * 512) */
-    int rc = ftruncate(fd, mapLength);
+    int rc = ftruncate(img->fd, img->mapLength);
     if (rc == -1) {
-        perror("truncate");
-        exit(1);
+        fail("truncate");
+        close(img->fd);
+        return -1;
     }
 
     /* map current process to memory, with length being (nBlocks * 512) */
-    mapStart = mmap(0, mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (mapStart == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
+    img->mapStart = mmap(0, img->mapLength, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         img->fd, 0);
+    if (img->mapStart == MAP_FAILED) {
+        fail("mmap");
+        close(img->fd);
+        return -1;
     }
 
     /* assign the super block to the start of the mmap'ed area (1st disk block) */
-    super = (Super *)mapStart;
+    img->super = (Super *)img->mapStart;
     /* assign the blocks to the start of the mmap'ed area as well */
-    blocks = (char *)mapStart;
+    img->blocks = (char *)img->mapStart;
 
     /* file allocation table starts from the second disk block (block size 512) */
-    fat = (uint32_t *)(blocks + 512);
-
-    /* fatBlocks is the number of the disk blocks that fat itself takes up. */
-    uint32_t fatBlocks = (nBlocks * sizeof(uint32_t) + 511) / 512;
+    img->fat = (uint32_t *)(img->blocks + 512);
 
     /* fill in the super block - 1st disk block */
+    Super *super = img->super;
     super->magic[0] = 'F';
     super->magic[1] = '4';
     super->magic[2] = '3';
@@ -259,6 +508,20 @@ int main(int argc, const char *argv[]) {
     super->nBlocks = nBlocks;
     super->avail = nBlocks - 1; /* super block takes up the 1st block */
 
+    /* the rest of block 0 describes the layout, if any, and the geometry,
+       which is always the default one */
+    Layout *l = (Layout *)(img->blocks + sizeof(Super));
+    memset(l, 0, sizeof(Layout) + sizeof(Geometry));
+    if (layout) {
+        *l = *layout;
+        memcpy(l->magic, F439_LAYOUT_MAGIC, 4);
+        if (createBacking(img, imageName) < 0) {
+            munmap(img->mapStart, img->mapLength);
+            close(img->fd);
+            return -1;
+        }
+    }
+
     /* Below is the initialization of fat. Consider a simple example:
        Say fat takes up 2 whole disk blocks, i.e. @fatBlocks is 2.
        Since a disk block size is 512, each fat entry is 32-bit, 4 bytes, we
@@ -276,34 +539,614 @@ int main(int argc, const char *argv[]) {
     */
     uint32_t lastAvail = 1 + fatBlocks;
 
-    for (uint32_t i = super->avail; i > lastAvail; i--) {
-        fat[i] = i - 1;
+    if (linkFree) {
+        linkFreeBlocks(img, lastAvail, super->avail);
+    } else {
+        super->avail = 0; /* the caller builds the free list(s) itself */
+    }
+    return 0;
+}
+
+void linkFreeBlocks(Image *img, uint32_t lo, uint32_t hi) {
+    for (uint32_t i = hi; i > lo; i--) {
+        img->fat[i] = i - 1;
+    }
+    /* the last free block ends the free list, even if the image file
+       already existed and had something else there */
+    img->fat[lo] = 0;
+}
+
+void freeChain(Image *img, uint32_t head) {
+    while (head != 0) {
+        uint32_t next = img->fat[head];
+        img->fat[head] = img->super->avail;
+        img->super->avail = head;
+        head = next;
+    }
+}
+
+int createRoot(Image *img, int nFiles) {
+    /* the root directory is a single block */
+    if ((size_t)nFiles * 16 > 512 - 8) {
+        fprintf(errOut(),
+                "too many files: the root directory holds at most %d\n",
+                (512 - 8) / 16);
+        return -1;
     }
 
     /* request one block for root directory (superblock->root) */
-    super->root = getBlock();
-    uint32_t *rootMetaData = (uint32_t *)toPtr(super->root, 0);
+    img->super->root = getBlock(img);
+    if (img->super->root == 0) {
+        return -1;
+    }
+    uint32_t *rootMetaData = (uint32_t *)toPtr(img, img->super->root, 0);
     rootMetaData[0] = 2; /* root has inode number 2 */
     rootMetaData[1] = nFiles * 16; /* rootMetaData[] takes up 8 bytes;
                                       file name total size is rootMetaData[1] */
+    return 0;
+}
+
+void setDirEntry(Image *img, int i, const char *fileName, uint32_t start) {
     /* @rootData points to offset 8 within the 1st disk block.
        it serves as an array of fileName entries (16 bytes each) */
-    char *rootData = toPtr(super->root, 8);
+    char *rootData = toPtr(img, img->super->root, 8);
+
+    char *nm = strdup(fileName); /* duplicate a string, with malloc() */
+    char *base = basename(nm); /* get the name with leading directory components removed */
+    char *dest = strncpy(rootData + i * 16, base, 12);
+    free(nm); /* strdup() internally calls malloc(), so need to free() */
 
-    /* iterate over files */
-    for (int i = 0; i < nFiles; i++) {
-        uint32_t x = oneFile(fileNames[i]);
-        char *nm = strdup(fileNames[i]); /* duplicate a string, with malloc() */
-        char *base = basename(nm); /* get the name with leading directory components removed */
-        char *dest = strncpy(rootData + i * 16, base, 12);
-        free(nm); /* strdup() internally calls malloc(), so need to free() */
-        
-        /* after we have copied file name, needs to write the starting disk
-           block index. Note that each fileName entry is 16 bytes*/
-        *((uint32_t *)(dest + 12)) = x; 
+    /* after we have copied file name, needs to write the starting disk
+       block index. Note that each fileName entry is 16 bytes*/
+    *((uint32_t *)(dest + 12)) = start;
+    F439_PROBE3(dir_write, i, dest, start);
+}
+
+static double elapsedMs(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 +
+           (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+/* what the placement of one file has to update, shared by both ingest paths */
+typedef struct {
+    Image *img;
+    const BuildSpec *spec;
+    struct timespec lastCheckpoint;
+    uint64_t bytes;          /* placed so far */
+    uint64_t compressBytes;  /* in files worth compressing */
+    int compressFiles;
+} BuildState;
+
+/**
+ * @brief file @i has been placed starting at block @start: enter it into the
+ *        directory, report it and take a checkpoint if one is due.
+ * @return 0, or -1 if the build must stop.
+ */
+static int fileDone(void *arg, int i, uint32_t start, const FileInfo *info) {
+    BuildState *st = arg;
+    const BuildSpec *spec = st->spec;
+    if (spec->decompress) {
+        /* an unpacked input is listed without its .gz, .xz or .zst */
+        char *name = strndup(spec->fileNames[i],
+                             inputBaseLength(spec->fileNames[i]));
+        if (name == NULL) {
+            fprintf(errOut(), "out of memory\n");
+            return -1;
+        }
+        setDirEntry(st->img, i, name, start);
+        free(name);
+    } else {
+        setDirEntry(st->img, i, spec->fileNames[i], start);
+    }
+
+    if (spec->progress) {
+        fprintf(spec->progress, "progress %d %d %s\n", i + 1, spec->nFiles,
+                spec->fileNames[i]);
+        fflush(spec->progress);
+    }
+    if (spec->checksums && info) {
+        fprintf(spec->checksums, "%08x %s\n", info->crc, spec->fileNames[i]);
+    }
+
+    uint32_t size = imageFileSize(st->img, start);
+    F439_PROBE3(file_done, spec->fileNames[i], start, size);
+    st->bytes += size;
+    if (info && info->level) {
+        st->compressBytes += size;
+        st->compressFiles++;
+    }
+    if (spec->stats && info) {
+        fprintf(spec->stats, "%-12s %10u bytes  entropy %.2f bits/byte  %s",
+                spec->fileNames[i], size, info->entropy,
+                info->level ? "compress" : "store");
+        if (info->level) {
+            fprintf(spec->stats, " level %d", info->level);
+        }
+        fprintf(spec->stats, " (%u/%u extents compressible)\n",
+                info->compressChunks, info->chunks);
+    }
+
+    if (spec->checkpoint && i + 1 < spec->nFiles &&
+        elapsedMs(&st->lastCheckpoint) >= spec->checkpointSecs * 1e3) {
+        if (checkpointSave(spec->checkpoint, st->img, spec, i + 1) < 0) {
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &st->lastCheckpoint);
+    }
+    return 0;
+}
+
+/**
+ * The time and the event counts of each phase of a build, one JSON line per
+ * phase:
+ *
+ *      {"phase":"init","ms":1.234,"cycles":...,"instructions":...,
+ *       "llc_misses":...,"dtlb_misses":...,"page_faults":...}
+ *
+ * The phases are init (the fat, the free list and the root directory, or
+ * loading a checkpoint or a previous image), ingest (placing the files),
+ * then sync, rmap and close when they apply.
+ */
+typedef struct {
+    FILE *out;           /* NULL: nothing is measured */
+    PerfCounters pc;
+    PerfSample last;
+    struct timespec since;
+} PhaseLog;
+
+static void phaseOpen(PhaseLog *log, FILE *out) {
+    log->out = out;
+    if (out) {
+        perfOpen(&log->pc);
+        perfRead(&log->pc, &log->last);
+        clock_gettime(CLOCK_MONOTONIC, &log->since);
+    }
+}
+
+/* report the phase that ends now; the next one starts */
+static void phaseEnd(PhaseLog *log, const char *name) {
+    if (log->out == NULL) {
+        return;
+    }
+    PerfSample now;
+    perfRead(&log->pc, &now);
+    fprintf(log->out, "{\"phase\":\"%s\",\"ms\":%.3f", name,
+            elapsedMs(&log->since));
+    perfJson(log->out, &log->last, &now);
+    fprintf(log->out, "}\n");
+    fflush(log->out);
+    log->last = now;
+    clock_gettime(CLOCK_MONOTONIC, &log->since);
+}
+
+static int build(const BuildSpec *spec, PhaseLog *log) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mkfsDropBehind = spec->dropBehind;
+
+    Image img;
+    int firstFile = 0;
+    if (spec->resume) {
+        firstFile = checkpointResume(spec->checkpoint, &img, spec);
+        if (firstFile < 0) {
+            return -1;
+        }
+    } else if (spec->previous) {
+        if (reuseImage(&img, spec) < 0) {
+            return -1;
+        }
+    } else {
+        /* parallel ingest links the free lists of its regions itself, on the
+           threads that use them; only the root block is handed out here.
+           A tiered image starts out with the fast tier only, so the root
+           directory lands at its top. */
+        int parallel = spec->threads > 1;
+        int tiered = spec->nHot > 0 || spec->hotKB > 0;
+        Layout layout = {"", F439_LAYOUT_STRIPED,
+                         imageFirstData(spec->nBlocks), spec->stripeBlocks,
+                         spec->stripes};
+        if (tiered && planTiers(spec, &layout) < 0) {
+            return -1;
+        }
+        /* hot files that fill the whole image leave no bulk tier */
+        int split = spec->stripes ||
+                    (tiered && layout.headBlocks < spec->nBlocks);
+        if (createImage(&img, spec->imageName, spec->nBlocks,
+                        !parallel && !tiered, split ? &layout : NULL) < 0) {
+            return -1;
+        }
+        if (parallel) {
+            uint32_t lastAvail = imageFirstData(spec->nBlocks);
+            linkFreeBlocks(&img, lastAvail, lastAvail);
+            img.super->avail = lastAvail;
+        } else if (tiered) {
+            linkFreeBlocks(&img, imageFirstData(spec->nBlocks),
+                           layout.headBlocks - 1);
+            img.super->avail = layout.headBlocks - 1;
+        }
+        /* a chunked image also lists its chunk index in the directory */
+        if (createRoot(&img, spec->nFiles + (spec->chunked ? 1 : 0)) < 0) {
+            imageClose(&img);
+            return -1;
+        }
+    }
+    dropBehindStart(&img);
+    BuildState st = {&img, spec, start, 0, 0, 0};
+    phaseEnd(log, "init");
+
+    int rc = 0;
+    if (spec->chunked) {
+        rc = ingestChunked(&img, spec, fileDone, &st);
+    } else if (spec->nHot > 0 || spec->hotKB > 0) {
+        rc = ingestTiered(&img, spec, fileDone, &st);
+    } else if (spec->threads > 1) {
+        rc = ingestParallel(&img, spec, fileDone, &st);
+    } else if (spec->cache && !spec->decompress && !spec->checksums &&
+               !spec->stats) {
+        /* the build server reads plain inputs itself so it can cache them;
+           the pipeline does what the other options ask for */
+        for (int k = firstFile; k < spec->nFiles; k++) {
+            int i = specInput(spec, k);
+            uint32_t x = oneFile(&img, spec->fileNames[i], spec->cache);
+            if (x == 0 || fileDone(&st, i, x, NULL) < 0) {
+                rc = -1;
+                break;
+            }
+        }
+    } else {
+        rc = ingestPipeline(&img, spec, firstFile, fileDone, &st);
+    }
+    phaseEnd(log, "ingest");
+
+    /* a striped or tiered image is written out to all its disks at once */
+    if (rc == 0 && img.nBacking) {
+        if (syncImage(&img) < 0) {
+            rc = -1;
+        }
+        phaseEnd(log, "sync");
+    }
+    if (rc == 0 && spec->rmap) {
+        Rmap m;
+        char path[4096];
+        rmapPath(spec->imageName, path, sizeof(path));
+        if (rmapBuild(&img, &m, spec->threads > 1 ? spec->threads : 1) < 0) {
+            fprintf(errOut(), "out of memory\n");
+            rc = -1;
+        } else {
+            rc = rmapSave(&m, path, errOut());
+            rmapFree(&m);
+        }
+        phaseEnd(log, "rmap");
+    }
+    imageClose(&img);
+    phaseEnd(log, "close");
+
+    /* a finished build has nothing to resume */
+    if (rc == 0 && spec->checkpoint) {
+        unlink(spec->checkpoint);
+    }
+
+    if (rc == 0 && spec->stats) {
+        fprintf(spec->stats, "%d files, %lu bytes, %.1f ms; %d files "
+                "(%lu bytes) worth compressing, %lu bytes to store as is\n",
+                spec->nFiles - firstFile, (unsigned long)st.bytes,
+                elapsedMs(&start), st.compressFiles,
+                (unsigned long)st.compressBytes,
+                (unsigned long)(st.bytes - st.compressBytes));
+    }
+
+    if (rc == 0 && spec->progress) {
+        fprintf(spec->progress, "done %d files %.1f ms", spec->nFiles,
+                elapsedMs(&start));
+        if (spec->cache) {
+            fprintf(spec->progress, " cache %lu hits %lu misses %zu bytes",
+                    (unsigned long)spec->cache->hits,
+                    (unsigned long)spec->cache->misses, spec->cache->bytes);
+        }
+        fprintf(spec->progress, "\n");
+        fflush(spec->progress);
+    }
+    return rc;
+}
+
+int buildImage(const BuildSpec *spec) {
+    PhaseLog log;
+    phaseOpen(&log, spec->phases);
+    int rc = build(spec, &log);
+    if (log.out) {
+        perfClose(&log.pc);
     }
+    return rc;
+}
+
+
+void optionsInit(BuildSpec *spec, BuildOptions *opts) {
+    memset(spec, 0, sizeof(*spec));
+    memset(opts, 0, sizeof(*opts));
+    spec->hotFiles = opts->hot;
+    spec->checkpointSecs = 30;
+    spec->pipelineBuffers = 16;
+    spec->stripeBlocks = 128;
+    opts->sourceHow = SOURCE_ORDER_ARGV;
+}
+
+int limitOptionParse(int argc, const char *argv[], int *i,
+                     BuildOptions *opts) {
+    const char *o = argv[*i];
+    if (*i + 1 >= argc) {
+        return -1;
+    }
+    if (strcmp(o, "--read-mbps") == 0) {
+        opts->readMBps = atof(argv[++*i]);
+    } else if (strcmp(o, "--read-iops") == 0) {
+        opts->readIops = atof(argv[++*i]);
+    } else if (strcmp(o, "--write-mbps") == 0) {
+        opts->writeMBps = atof(argv[++*i]);
+    } else if (strcmp(o, "--write-iops") == 0) {
+        opts->writeIops = atof(argv[++*i]);
+    } else if (strcmp(o, "--ioprio") == 0) {
+        opts->ioprio = argv[++*i];
+    } else if (strcmp(o, "--nice") == 0) {
+        opts->niceness = atoi(argv[++*i]);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int optionParse(int argc, const char *argv[], int *i, BuildSpec *spec,
+                BuildOptions *opts) {
+    const char *o = argv[*i];
+    int more = *i + 1 < argc;   /* is there an argument */
+    if (limitOptionParse(argc, argv, i, opts) == 0) {
+        return 0;
+    }
+    if (strcmp(o, "--checkpoint") == 0 && more) {
+        spec->checkpoint = argv[++*i];
+    } else if (strcmp(o, "--checkpoint-secs") == 0 && more) {
+        spec->checkpointSecs = atoi(argv[++*i]);
+    } else if (strcmp(o, "--resume") == 0) {
+        spec->resume = 1;
+    } else if (strcmp(o, "--buffers") == 0 && more) {
+        spec->pipelineBuffers = atoi(argv[++*i]);
+    } else if (strcmp(o, "--buffer-kb") == 0 && more) {
+        spec->pipelineBufferSize = (size_t)atoi(argv[++*i]) * 1024;
+    } else if (strcmp(o, "--checksums") == 0) {
+        spec->checksums = stdout;
+    } else if (strcmp(o, "--stats") == 0) {
+        spec->stats = stderr;
+    } else if (strcmp(o, "-j") == 0 && more) {
+        spec->threads = atoi(argv[++*i]);
+    } else if (strcmp(o, "--pin") == 0) {
+        spec->pin = 1;
+    } else if (strcmp(o, "--cdc") == 0) {
+        spec->chunked = 1;
+    } else if (strcmp(o, "--prev") == 0 && more) {
+        spec->chunked = 1;
+        spec->previous = argv[++*i];
+    } else if (strcmp(o, "--stripes") == 0 && more) {
+        spec->stripes = atoi(argv[++*i]);
+    } else if (strcmp(o, "--stripe-kb") == 0 && more) {
+        spec->stripeBlocks = atoi(argv[++*i]) * 2;
+    } else if (strcmp(o, "--hot") == 0 && more) {
+        if (spec->nHot == MAX_HOT) {
+            return -1;
+        }
+        opts->hot[spec->nHot++] = argv[++*i];
+    } else if (strcmp(o, "--hot-kb") == 0 && more) {
+        spec->hotKB = atoi(argv[++*i]);
+    } else if (strcmp(o, "--fast-blocks") == 0 && more) {
+        spec->fastBlocks = atoi(argv[++*i]);
+    } else if (strcmp(o, "--rmap") == 0) {
+        spec->rmap = 1;
+    } else if (strcmp(o, "--source-order") == 0 && more) {
+        ++*i;
+        if (strcmp(argv[*i], "inode") == 0) {
+            opts->sourceHow = SOURCE_ORDER_INODE;
+        } else if (strcmp(argv[*i], "fiemap") == 0) {
+            opts->sourceHow = SOURCE_ORDER_FIEMAP;
+        } else {
+            return -1;
+        }
+    } else if (strcmp(o, "--decompress") == 0) {
+        spec->decompress = 1;
+    } else if (strcmp(o, "--drop-behind") == 0) {
+        spec->dropBehind = 1;
+    } else if (strcmp(o, "--phases") == 0 && more) {
+        opts->phases = argv[++*i];
+    } else {
+        return -1;
+    }
+    return 0;
+}
 
-    munmap(mapStart, mapLength);
+int optionsApply(BuildSpec *spec, const BuildOptions *opts) {
+    FILE *err = errOut();
+    if (spec->resume && spec->checkpoint == NULL) {
+        fprintf(err, "--resume needs --checkpoint\n");
+        return -1;
+    }
+    if (spec->threads > 1 && (spec->checkpoint || spec->checksums)) {
+        fprintf(err, "-j cannot be combined with checkpoints or checksums\n");
+        return -1;
+    }
+    if ((spec->nHot || spec->hotKB) &&
+        (spec->threads > 1 || spec->chunked || spec->stripes ||
+         spec->checkpoint || spec->checksums)) {
+        fprintf(err, "--hot cannot be combined with -j, --cdc, --stripes, "
+                     "checkpoints or checksums\n");
+        return -1;
+    }
+    /* both plan the space of every file from its size on disk */
+    if (spec->decompress && (spec->threads > 1 || spec->nHot || spec->hotKB)) {
+        fprintf(err, "--decompress cannot be combined with -j or --hot\n");
+        return -1;
+    }
+    if (spec->previous && spec->stripes) {
+        fprintf(err, "--prev cannot be combined with --stripes\n");
+        return -1;
+    }
+    if (spec->chunked &&
+        (spec->threads > 1 || spec->checkpoint || spec->checksums)) {
+        fprintf(err, "--cdc cannot be combined with -j, checkpoints or "
+                     "checksums\n");
+        return -1;
+    }
 
+    /* a checkpoint counts the files done in directory order */
+    if (opts->sourceHow != SOURCE_ORDER_ARGV) {
+        if (spec->checkpoint) {
+            fprintf(err, "--source-order cannot be combined with "
+                         "checkpoints\n");
+            return -1;
+        }
+        int *order = malloc((spec->nFiles ? spec->nFiles : 1) * sizeof(int));
+        if (order == NULL || sourceOrder(spec, opts->sourceHow, order) < 0) {
+            fprintf(err, "out of memory\n");
+            free(order);
+            return -1;
+        }
+        spec->order = order;
+    }
+    if (opts->phases) {
+        spec->phases = fopen(opts->phases, "w");
+        if (spec->phases == NULL) {
+            fail(opts->phases);
+            optionsRelease(spec);
+            return -1;
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+void optionsRelease(BuildSpec *spec) {
+    free((void *)spec->order);
+    spec->order = NULL;
+    if (spec->phases) {
+        fclose(spec->phases);
+        spec->phases = NULL;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options] <image name> <nBlocks> <file0> <file1> ...\n"
+                    "       %s [limits] --serve <socket> [cacheMB]\n"
+                    "       %s --client <socket> [options] <image name> <nBlocks> <file0> ...\n"
+                    "       %s [limits] --batch <spec file> [threads]\n",
+            prog, prog, prog, prog);
+    fprintf(stderr, "options:\n"
+                    "  --checkpoint <file>    save progress to <file> periodically\n"
+                    "  --checkpoint-secs <s>  seconds between checkpoints (30)\n"
+                    "  --resume               continue from the checkpoint\n"
+                    "  --buffers <n>          ingest pipeline buffers (16)\n"
+                    "  --buffer-kb <kb>       size of each buffer (64)\n"
+                    "  --checksums            print the crc32 of every file\n"
+                    "  --stats                print build statistics to stderr\n"
+                    "  -j <threads>           place files on this many threads\n"
+                    "  --pin                  pin -j threads to CPUs, NUMA node aware\n"
+                    "  --cdc                  store files as deduplicated chunks\n"
+                    "  --prev <image>         --cdc, starting from and sharing the\n"
+                    "                         chunks of a previous image\n"
+                    "  --stripes <n>          stripe the blocks over <image>.s0 ...\n"
+                    "  --stripe-kb <kb>       size of a stripe unit (64)\n"
+                    "  --hot <file>           keep <file> in the image file, with\n"
+                    "                         the metadata; the rest goes to\n"
+                    "                         <image>.bulk (may be repeated)\n"
+                    "  --hot-kb <kb>          keep all files up to <kb> there too\n"
+                    "  --fast-blocks <n>      size the image file for <n> blocks of\n"
+                    "                         hot files and directory\n"
+                    "  --rmap                 save the reverse block map as\n"
+                    "                         <image>.rmap\n"
+                    "  --phases <file>        write the time and hardware counters\n"
+                    "                         of every build phase to <file>\n"
+                    "  --source-order <o>     read the inputs sorted by inode or by\n"
+                    "                         fiemap (physical address); the\n"
+                    "                         directory keeps the given order\n"
+                    "  --drop-behind          keep inputs and image out of the\n"
+                    "                         page cache once they are done with\n"
+                    "  --decompress           unpack gzip, xz and zstd inputs\n"
+                    "  --read-mbps <n>        limit reading the inputs to <n> MB/s\n"
+                    "  --read-iops <n>        ... and to <n> reads of 128 KiB/s\n"
+                    "  --write-mbps <n>       limit writing the image to <n> MB/s\n"
+                    "  --write-iops <n>       ... and to <n> writes of 128 KiB/s\n"
+                    "  --ioprio <c[:n]>       I/O priority: idle, be[:0-7], rt[:0-7]\n"
+                    "  --nice <n>             CPU priority, as nice(1)\n"
+                    "the last six are the limits; a build server takes the "
+                    "other options from its\nclients\n");
+    exit(1);
+}
+
+/* set the I/O limits and priority of @opts for the whole process */
+static void limitsApply(const BuildOptions *opts) {
+    /* before any thread is started, so that they all inherit them */
+    ioLimitsSet(opts->readMBps, opts->readIops, opts->writeMBps,
+                opts->writeIops);
+    if (ioPrioritySet(opts->ioprio, opts->niceness) < 0) {
+        exit(1);
+    }
+}
+
+int main(int argc, const char *argv[]) {
+    BuildSpec spec;
+    BuildOptions opts;
+    optionsInit(&spec, &opts);
+
+    /* the limits and priority may also come before --serve and --batch,
+       and then apply to every build of the server or the batch */
+    int m = 1;
+    while (m < argc && limitOptionParse(argc, argv, &m, &opts) == 0) {
+        m++;
+    }
+    if (argc - m >= 2 && strcmp(argv[m], "--serve") == 0) {
+        size_t cacheMB = argc - m > 2 ? atoi(argv[m + 2]) : 256;
+        limitsApply(&opts);
+        return serveBuilds(argv[m + 1], cacheMB << 20) < 0 ? 1 : 0;
+    }
+    if (argc - m >= 2 && strcmp(argv[m], "--batch") == 0) {
+        int nThreads = argc - m > 2 ? atoi(argv[m + 2])
+                                    : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        limitsApply(&opts);
+        return buildBatch(argv[m + 1], nThreads) < 0 ? 1 : 0;
+    }
+    if (argc >= 3 && strcmp(argv[1], "--client") == 0) {
+        /* the options are checked here and passed on as they are */
+        int i = 3;
+        for (; i < argc && argv[i][0] == '-'; i++) {
+            if (optionParse(argc, argv, &i, &spec, &opts) < 0) {
+                usage(argv[0]);
+            }
+        }
+        if (argc - i < 3) {
+            usage(argv[0]);
+        }
+        return submitBuild(argv[2], &argv[3], i - 3, argv[i],
+                           atoi(argv[i + 1]), &argv[i + 2],
+                           argc - i - 2) < 0 ? 1 : 0;
+    }
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (optionParse(argc, argv, &i, &spec, &opts) < 0) {
+            usage(argv[0]);
+        }
+    }
+    if (argc - i < 3) {
+        usage(argv[0]);
+    }
+
+    spec.imageName = argv[i];           /* name of the image */
+    spec.nBlocks = atoi(argv[i + 1]);   /* number of blocks for FS */
+    spec.fileNames = &argv[i + 2];      /* treat file names as an array */
+    spec.nFiles = argc - i - 2;         /* number of the files in this image */
+    if (optionsApply(&spec, &opts) < 0) {
+        exit(1);
+    }
+    limitsApply(&opts);
+
+    if (buildImage(&spec) < 0) {
+        exit(-1);
+    }
+    return 0;
+}
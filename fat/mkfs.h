@@ -0,0 +1,348 @@
+#ifndef MKFS_H
+#define MKFS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "f439.h"
+
+/**
+ * mkfs.h is the interface between the image building code in mkfs.c and the
+ * different ways of driving it (the command line, the build server in
+ * server.c, ...).
+ */
+
+
+/**
+ * Contents of input files kept in memory between builds, so that a long
+ * running mkfs does not read an unchanged file again. An entry is valid as
+ * long as the file still has the same device, inode, size and mtime.
+ * Entries are kept most recently used first and the oldest ones are dropped
+ * once @limit bytes are exceeded.
+ */
+typedef struct CachedFile {
+    struct CachedFile *next;
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *data;
+} CachedFile;
+
+typedef struct {
+    CachedFile *head;
+    size_t bytes;   /* total size of the cached data */
+    size_t limit;   /* 0 disables the cache */
+    uint64_t hits;
+    uint64_t misses;
+} FileCache;
+
+/* everything that describes one image to build */
+typedef struct {
+    const char *imageName;
+    uint32_t nBlocks;
+    const char **fileNames;
+    int nFiles;
+    FileCache *cache;  /* inputs kept between plain builds; or NULL */
+    FILE *progress;    /* one line per file is written here; NULL for none */
+    const char *checkpoint; /* checkpoint file (checkpoint.c); NULL for none */
+    int checkpointSecs;     /* seconds between checkpoints */
+    int resume;             /* continue from the checkpoint */
+    int pipelineBuffers;       /* chunks in the ingest pipeline (pipeline.c) */
+    size_t pipelineBufferSize; /* bytes per chunk */
+    FILE *checksums;        /* crc32 of every file is written here; or NULL */
+    FILE *stats;            /* build statistics are written here; or NULL */
+    int threads;            /* > 1 for parallel ingest (parallel.c) */
+    int pin;                /* pin those threads, NUMA node aware */
+    int chunked;            /* content defined chunks with dedup (cdc.c) */
+    const char *previous;   /* image to start from and share chunks with */
+    uint32_t stripes;       /* backing files to stripe over; 0 for none */
+    uint32_t stripeBlocks;  /* blocks per stripe unit */
+    const char **hotFiles;  /* inputs for the fast tier (tier.c) */
+    int nHot;
+    uint32_t hotKB;         /* inputs up to this size are hot as well */
+    uint32_t fastBlocks;    /* blocks for hot files and directory; 0: fit */
+    int rmap;               /* save the reverse map as <image>.rmap */
+    FILE *phases;           /* per phase times and counters, as JSON; or
+                               NULL (perfctr.h) */
+    const int *order;       /* the inputs in the order to read them; NULL:
+                               as given (srcorder.c) */
+    int dropBehind;         /* keep inputs and image out of the page cache
+                               (dropbehind.c) */
+    int decompress;         /* unpack compressed inputs (input.c) */
+} BuildSpec;
+
+/* the index of the input read @k-th, which is also its directory slot */
+static inline int specInput(const BuildSpec *spec, int k) {
+    return spec->order ? spec->order[k] : k;
+}
+
+/**
+ * A FileWriter appends the bytes of one file to its chain of blocks, taking
+ * new blocks from getBlock() as the current one fills up. The data can come
+ * straight from read() into the image (writerSpace() + writerAdvance()) or
+ * from memory (writerAppend()). See mkfs.c.
+ */
+typedef struct {
+    uint32_t start;       /* the first block, which holds the metadata */
+    uint32_t current;     /* the block being filled */
+    uint32_t blockOffset; /* the current offset within the block */
+    uint32_t leftInBlock; /* bytes still free in the current block */
+    uint32_t totalSize;   /* the size of the whole file */
+} FileWriter;
+
+int writerStart(Image *img, FileWriter *w);
+char *writerSpace(Image *img, FileWriter *w, uint32_t *len);
+void writerAdvance(FileWriter *w, uint32_t n);
+int writerAppend(Image *img, FileWriter *w, const char *data, size_t length);
+uint32_t writerFinish(Image *img, FileWriter *w);
+
+/* the building blocks of buildImage(); getBlock() returns 0 when the disk is
+   full, the others return -1 on failure */
+uint32_t getBlock(Image *img);
+int createImage(Image *img, const char *imageName, uint32_t nBlocks,
+                int linkFree, const Layout *layout);
+/* link blocks @hi -> @hi-1 -> ... -> @lo into a free list ending at @lo */
+void linkFreeBlocks(Image *img, uint32_t lo, uint32_t hi);
+/* put every block of the chain at @head back on the free list */
+void freeChain(Image *img, uint32_t head);
+int createRoot(Image *img, int nFiles);
+void setDirEntry(Image *img, int i, const char *fileName, uint32_t start);
+/* place one input file; @return its first block, 0 on failure */
+uint32_t oneFile(Image *img, const char *fileName, FileCache *cache);
+/**
+ * @brief blocks oneFile() takes for a file of @size bytes: the first block
+ *        holds 512 - 8 bytes, the rest 512 each, and a file that exactly
+ *        fills its last block gets one more (oneFile() asks for space before
+ *        it sees EOF).
+ */
+uint64_t blocksFor(off_t size);
+
+/**
+ * @brief build the image described by @spec. Errors are reported on stderr
+ *        (or wherever mkfsErr points) and never terminate the process, so a
+ *        server can keep going after a bad job.
+ * @return 0 on success, -1 on failure.
+ */
+int buildImage(const BuildSpec *spec);
+
+/* --hot may be given this many times */
+#define MAX_HOT 64
+
+/**
+ * The options of a build, as mkfs takes them on its command line and a build
+ * server in "option" lines (server.c): what they do not set in the
+ * BuildSpec directly.
+ */
+typedef struct {
+    const char *hot[MAX_HOT];   /* BuildSpec.hotFiles */
+    int sourceHow;              /* SOURCE_ORDER_ */
+    const char *phases;         /* opened as BuildSpec.phases */
+    double readMBps, readIops, writeMBps, writeIops;   /* ratelimit.c */
+    const char *ioprio;
+    int niceness;
+} BuildOptions;
+
+/* the defaults, into @spec and @opts */
+void optionsInit(BuildSpec *spec, BuildOptions *opts);
+/**
+ * @brief parse the option at @argv[*i], and its argument, into @spec and
+ *        @opts; *@i is left at the last word used.
+ * @return 0, or -1 if it is not an option or its argument is missing.
+ */
+int optionParse(int argc, const char *argv[], int *i, BuildSpec *spec,
+                BuildOptions *opts);
+/* the same, for the I/O limit and priority options only, which apply to the
+   whole process */
+int limitOptionParse(int argc, const char *argv[], int *i,
+                     BuildOptions *opts);
+/**
+ * @brief check that the options of @spec go together, once it names its
+ *        image and inputs, and prepare what they ask for: sort the inputs,
+ *        open the phases file. Errors go where mkfsErr points.
+ * @return 0, or -1.
+ */
+int optionsApply(BuildSpec *spec, const BuildOptions *opts);
+/* release what optionsApply() took */
+void optionsRelease(BuildSpec *spec);
+
+/* drop every entry of @cache */
+void cacheClear(FileCache *cache);
+
+/* where error messages go; stderr unless a server redirects them */
+extern FILE *mkfsErr;
+
+/* what an ingest path learned about a file while placing it */
+typedef struct {
+    uint32_t crc;            /* crc32 of the contents */
+    double entropy;          /* sampled bits per byte (entropy.h) */
+    int level;               /* compression level it calls for, 0 = store */
+    uint32_t chunks;         /* chunks (extents) the file was read in */
+    uint32_t compressChunks; /* chunks worth compressing on their own */
+} FileInfo;
+
+/* called by an ingest path once file @i is placed at @start; @info is NULL
+   if the path does not look at the data */
+typedef int (*FileDoneFn)(void *arg, int i, uint32_t start,
+                          const FileInfo *info);
+
+/**
+ * @brief place files @firstFile.. of @spec through the staged pipeline in
+ *        pipeline.c, calling @done in the order they are read.
+ * @return 0 on success, -1 on failure.
+ */
+int ingestPipeline(Image *img, const BuildSpec *spec, int firstFile,
+                   FileDoneFn done, void *arg);
+
+/**
+ * @brief place all files of @spec on spec->threads threads, each filling its
+ *        own region of the image (parallel.c). @done is called under a lock,
+ *        in no particular order. The image must have been created without
+ *        a free list, apart from the root directory block.
+ */
+int ingestParallel(Image *img, const BuildSpec *spec, FileDoneFn done,
+                   void *arg);
+
+/* striped images (stripe.c) */
+/* create and map the backing files the layout in block 0 asks for */
+int createBacking(Image *img, const char *imageName);
+/* msync() the image file and every backing file, each on its own thread */
+int syncImage(Image *img);
+
+/* hot/cold tiered images (tier.c) */
+/* fill in a tiered @layout for @spec, with a fast tier the hot files fit */
+int planTiers(const BuildSpec *spec, Layout *layout);
+/**
+ * @brief place the hot files of @spec in the fast tier, whose free list is
+ *        in the super block, and the others in the bulk tier.
+ * @return 0 on success, -1 on failure.
+ */
+int ingestTiered(Image *img, const BuildSpec *spec, FileDoneFn done,
+                 void *arg);
+
+/* content defined chunking (cdc.c) */
+/**
+ * @brief make @imageName a copy of the image @previous (sharing its extents
+ *        where the file system can), map it and free everything but the
+ *        chunks, which ingestChunked() may reuse. The root directory is
+ *        created anew.
+ * @return 0 on success, -1 on failure.
+ */
+int reuseImage(Image *img, const BuildSpec *spec);
+/**
+ * @brief place all files of @spec as chunked files, reusing identical
+ *        chunks of the same build and of spec->previous, and write the
+ *        chunk index into the last directory entry.
+ * @return 0 on success, -1 on failure.
+ */
+int ingestChunked(Image *img, const BuildSpec *spec, FileDoneFn done,
+                  void *arg);
+
+/* the order inputs are read in (srcorder.c) */
+enum {
+    SOURCE_ORDER_ARGV,      /* as given */
+    SOURCE_ORDER_INODE,     /* by device and inode number */
+    SOURCE_ORDER_FIEMAP,    /* by device and physical address */
+};
+/**
+ * @brief fill @order with the indices of the inputs of @spec, sorted @how.
+ * @return 0, or -1 if out of memory.
+ */
+int sourceOrder(const BuildSpec *spec, int how, int *order);
+
+/* page cache footprint (dropbehind.c) */
+#define DROP_WINDOW (8 << 20)
+/* set from BuildSpec.dropBehind for the build that is running */
+extern int mkfsDropBehind;
+/* an input was opened */
+void sourceAdvise(int fd);
+/* @done bytes of input @fd have been read, the first *@dropped of them are
+   out of the cache already; drop the rest once it is a window, or at @eof */
+void sourceDropBehind(int fd, off_t *dropped, off_t done, int eof);
+/* the build of @img starts: its mappings are read only where touched */
+void dropBehindStart(Image *img);
+/* getBlock() has reached block @idx, a multiple of the window */
+void dropImageWindows(Image *img, uint32_t idx);
+/**
+ * @brief call @fn for every run of blocks [@from, @to) that lie next to each
+ *        other in one file (the image file, a stripe, the bulk tier), with
+ *        its file, offset, length and where it is mapped.
+ */
+typedef void (*BlockRunFn)(int fd, off_t off, size_t length, char *map);
+void forBlockRuns(Image *img, uint64_t from, uint64_t to, BlockRunFn fn);
+
+/* inputs, compressed or not (input.c) */
+enum {
+    INPUT_PLAIN,
+    INPUT_GZIP,
+    INPUT_XZ,
+    INPUT_ZSTD,
+};
+
+typedef struct {
+    int fd;
+    int format;           /* INPUT_ */
+    off_t consumed;       /* bytes read from @fd so far */
+    unsigned char *buf;   /* compressed data read ahead */
+    size_t pos, have;
+    int eof;              /* @fd is at its end */
+    int done;             /* and everything has been unpacked */
+    void *stream;         /* the decoder of @format */
+} InputReader;
+
+/**
+ * @brief open @path for reading, and when @decompress is set and the data
+ *        starts with the magic of gzip, xz or zstd, unpack it on the fly.
+ * @return 0, or -1 with errno set.
+ */
+int inputOpen(InputReader *in, const char *path, int decompress);
+/* like read(); corrupt compressed data fails with EBADMSG */
+ssize_t inputRead(InputReader *in, void *buf, size_t length);
+void inputClose(InputReader *in);
+/* the length of @name without a compression suffix input.c knows */
+size_t inputBaseLength(const char *name);
+
+/* I/O limits and priority (ratelimit.c) */
+#define IO_OP_SIZE (128 * 1024)   /* bytes per operation, for the iops */
+#define LIMIT_PIECE (1 << 20)     /* writes are paced and flushed by this */
+/* per second; 0 leaves a limit off. Call before any I/O. */
+void ioLimitsSet(double readMBps, double readIops, double writeMBps,
+                 double writeIops);
+/* is there a write limit */
+int ioLimitsWrite(void);
+/* @bytes were read, or are about to be written; sleeps if over the limit */
+void ioLimitRead(size_t bytes);
+void ioLimitWrite(size_t bytes);
+/* getBlock() handed out block @idx, under a write limit */
+void ioLimitBlock(Image *img, uint32_t idx);
+/**
+ * @brief set the I/O priority (@how: idle, be[:0-7], rt[:0-7]; NULL keeps
+ *        it) and the nice value of the process, for the threads it starts.
+ * @return 0, or -1 with an error message.
+ */
+int ioPrioritySet(const char *how, int nice);
+
+/* checkpoints (checkpoint.c) */
+int checkpointSave(const char *path, Image *img, const BuildSpec *spec,
+                   int filesDone);
+/**
+ * @brief validate the checkpoint against @spec, the image and the inputs,
+ *        map the image into @img and roll the allocator back to the
+ *        checkpoint.
+ * @return the number of files already done, -1 if it cannot be resumed.
+ */
+int checkpointResume(const char *path, Image *img, const BuildSpec *spec);
+
+/* batch mode (batch.c) */
+int buildBatch(const char *specFile, int nThreads);
+
+/* build server (server.c) */
+int serveBuilds(const char *socketPath, size_t cacheLimit);
+/* @options are the option words of the build, as on the command line */
+int submitBuild(const char *socketPath, const char **options, int nOptions,
+                const char *imageName, uint32_t nBlocks,
+                const char **fileNames, int nFiles);
+
+#endif
@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include "rmap.h"
+
+/**
+ * owner tells who uses blocks of an image, from its reverse map (rmap.h):
+ *
+ *      owner [-j threads] [-w] <image> [block ...]
+ *
+ * For every block given it prints the owning file (or chunk) and where in
+ * it the block is; without blocks, how many blocks every owner has. The map
+ * is loaded from <image>.rmap when that still matches the image, and built
+ * otherwise; -w saves a freshly built one.
+ */
+
+static void ownerName(const Image *img, const Rmap *m, uint32_t o, char *buf,
+                      size_t size) {
+    if (o == RMAP_NONE) {
+        snprintf(buf, size, "(none)");
+    } else if (o == RMAP_FREE) {
+        snprintf(buf, size, "(free)");
+    } else if (o == RMAP_META) {
+        snprintf(buf, size, "(metadata)");
+    } else if (o < m->nFiles) {
+        snprintf(buf, size, "%.12s", imageDirEntry(img, o)->name);
+    } else {
+        snprintf(buf, size, "chunk@%u", m->heads[o]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int nThreads = 4;
+    int save = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            save = 1;
+        } else {
+            break;
+        }
+    }
+    if (i >= argc) {
+        fprintf(stderr, "usage: %s [-j threads] [-w] <image> [block ...]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    const char *imageName = argv[i++];
+    Image img;
+    if (imageOpen(&img, imageName, PROT_READ) < 0) {
+        exit(1);
+    }
+    char path[4096];
+    rmapPath(imageName, path, sizeof(path));
+    Rmap m;
+    if (rmapLoad(&img, &m, path) < 0) {
+        if (rmapBuild(&img, &m, nThreads) < 0) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        if (save && rmapSave(&m, path, stderr) < 0) {
+            exit(1);
+        }
+    }
+
+    char name[32];
+    if (i == argc) {
+        /* blocks per file, then the totals of everything else */
+        uint64_t *count = calloc(m.nOwners + 3, sizeof(uint64_t));
+        for (uint32_t b = 0; b < m.nBlocks; b++) {
+            uint32_t o = m.owner[b];
+            count[o < m.nOwners ? o : m.nOwners + (RMAP_NONE - o)]++;
+        }
+        uint64_t chunkBlocks = 0;
+        for (uint32_t o = 0; o < m.nOwners; o++) {
+            if (o < m.nFiles) {
+                ownerName(&img, &m, o, name, sizeof(name));
+                printf("%-12s %10lu blocks\n", name, (unsigned long)count[o]);
+            } else {
+                chunkBlocks += count[o];
+            }
+        }
+        if (m.nOwners > m.nFiles) {
+            printf("%u chunks   %10lu blocks\n", m.nOwners - m.nFiles,
+                   (unsigned long)chunkBlocks);
+        }
+        printf("(metadata)   %10lu blocks\n(free)       %10lu blocks\n"
+               "(none)       %10lu blocks\n",
+               (unsigned long)count[m.nOwners + (RMAP_NONE - RMAP_META)],
+               (unsigned long)count[m.nOwners + (RMAP_NONE - RMAP_FREE)],
+               (unsigned long)count[m.nOwners]);
+        free(count);
+    }
+    int rc = 0;
+    for (; i < argc; i++) {
+        uint32_t b = strtoul(argv[i], NULL, 0);
+        if (b >= m.nBlocks) {
+            fprintf(stderr, "%s: no such block\n", argv[i]);
+            rc = 1;
+            continue;
+        }
+        ownerName(&img, &m, m.owner[b], name, sizeof(name));
+        if (m.owner[b] < m.nOwners) {
+            printf("%u: %s block %u, offset %lu\n", b, name, m.pos[b],
+                   (unsigned long)rmapOffset(&m, b));
+        } else {
+            printf("%u: %s\n", b, name);
+        }
+    }
+
+    rmapFree(&m);
+    imageClose(&img);
+    return rc;
+}
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE   /* pthread_setaffinity_np(), CPU_SET() */
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mkfs.h"
+
+/**
+ * Parallel ingest (mkfs -j <threads> [--pin]) places files on several
+ * threads at once without them sharing anything but the root directory.
+ *
+ * The data blocks are cut into one region per thread, sized after the files
+ * the thread was given (largest files first, to the least loaded thread) plus
+ * an equal share of the spare blocks. A region is a contiguous range of
+ * blocks and therefore also a contiguous segment of the fat, and its
+ * boundaries are rounded to whole fat pages where possible. Each thread
+ * keeps a private copy of the super block whose free list covers its region
+ * only, so getBlock() and the FileWriter work unchanged and without locks.
+ * When all threads are done, the region free lists are chained together
+ * from the top of the disk down, which is the order mkfs always uses.
+ *
+ * On a NUMA machine, memory is placed on the node of the CPU that first
+ * touches it, and that includes the page cache behind a MAP_SHARED image.
+ * With --pin every thread is bound to a CPU, spreading threads over the
+ * nodes round robin, and the thread itself writes its fat segment and its
+ * region. Those pages then stay local to the node that uses them instead of
+ * bouncing between sockets. Files are read straight into the image (see
+ * oneFile()), so there are no other buffers to place.
+ */
+
+/* one fat page holds the entries of this many blocks */
+#define FAT_PAGE_BLOCKS (4096 / sizeof(uint32_t))
+
+
+typedef struct {
+    int nCpus;
+    int *cpus;
+} Node;
+
+typedef struct {
+    Image img;        /* same mapping, but super points to @super */
+    Super super;      /* private allocator state for the region */
+    uint32_t lo, hi;  /* the region: blocks [lo, hi) */
+    int *files;       /* files given to this thread, in directory order */
+    int nFiles;
+    uint64_t need;    /* blocks needed by those files */
+    int cpu;          /* -1 when not pinned */
+    int failed;
+    const BuildSpec *spec;
+    FileDoneFn done;
+    void *arg;
+    pthread_mutex_t *doneLock;
+} Worker;
+
+
+/* parse a sysfs cpu list such as "0-3,8-11"; -1 when out of memory */
+static int parseCpuList(const char *s, int **cpus) {
+    int n = 0, cap = 0;
+    while (*s && *s != '\n') {
+        char *end;
+        int a = strtol(s, &end, 10), b = a;
+        if (end == s) {
+            break;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            b = strtol(s, &end, 10);
+        }
+        for (int c = a; c <= b; c++) {
+            if (n == cap) {
+                int more = cap ? cap * 2 : 16;
+                int *p = realloc(*cpus, more * sizeof(int));
+                if (p == NULL) {
+                    return -1;
+                }
+                *cpus = p;
+                cap = more;
+            }
+            (*cpus)[n++] = c;
+        }
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return n;
+}
+
+/**
+ * @brief find the NUMA nodes and their CPUs in sysfs, restricted to the CPUs
+ *        we may run on. Without NUMA information everything is one node.
+ * @return the number of nodes with at least one usable CPU, -1 when out of
+ *         memory.
+ */
+static int readTopology(Node **nodes) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    int nNodes = 0;
+    *nodes = NULL;
+    DIR *d = opendir("/sys/devices/system/node");
+    struct dirent *e;
+    while (d && (e = readdir(d))) {
+        int id;
+        if (sscanf(e->d_name, "node%d", &id) != 1) {
+            continue;
+        }
+        char path[128], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 id);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        int *cpus = NULL;
+        int n = fgets(list, sizeof(list), f) ? parseCpuList(list, &cpus) : 0;
+        fclose(f);
+        if (n < 0) {
+            free(cpus);
+            goto fail;
+        }
+        int k = 0;
+        for (int i = 0; i < n; i++) {
+            if (CPU_ISSET(cpus[i], &allowed)) {
+                cpus[k++] = cpus[i];
+            }
+        }
+        if (k == 0) {
+            free(cpus);
+            continue;
+        }
+        Node *p = realloc(*nodes, (nNodes + 1) * sizeof(Node));
+        if (p == NULL) {
+            free(cpus);
+            goto fail;
+        }
+        *nodes = p;
+        (*nodes)[nNodes].nCpus = k;
+        (*nodes)[nNodes].cpus = cpus;
+        nNodes++;
+    }
+    if (d) {
+        closedir(d);
+    }
+
+    if (nNodes == 0) {
+        Node *n = malloc(sizeof(Node));
+        if (n == NULL) {
+            return -1;
+        }
+        n->cpus = malloc(CPU_SETSIZE * sizeof(int));
+        if (n->cpus == NULL) {
+            free(n);
+            return -1;
+        }
+        n->nCpus = 0;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &allowed)) {
+                n->cpus[n->nCpus++] = c;
+            }
+        }
+        *nodes = n;
+        nNodes = 1;
+    }
+    return nNodes;
+
+fail:
+    closedir(d);
+    for (int i = 0; i < nNodes; i++) {
+        free((*nodes)[i].cpus);
+    }
+    free(*nodes);
+    *nodes = NULL;
+    return -1;
+}
+
+static void *workerThread(void *arg) {
+    Worker *w = arg;
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    /* first touch of the fat segment happens here, on the right node */
+    linkFreeBlocks(&w->img, w->lo, w->hi - 1);
+    w->super.avail = w->hi - 1;
+
+    for (int k = 0; k < w->nFiles; k++) {
+        int i = w->files[k];
+        uint32_t x = oneFile(&w->img, w->spec->fileNames[i], NULL);
+        if (x == 0) {
+            w->failed = 1;
+            break;
+        }
+        pthread_mutex_lock(w->doneLock);
+        int rc = w->done(w->arg, i, x, NULL);
+        pthread_mutex_unlock(w->doneLock);
+        if (rc < 0) {
+            w->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int byDirOrder(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * @brief give every file to a worker (largest first, to the least loaded)
+ *        and cut the blocks from @first to the end of the disk into regions.
+ * @return 0, or -1 if the files cannot fit.
+ */
+static int planRegions(Worker *workers, int nWorkers, const BuildSpec *spec,
+                       uint32_t first, uint32_t nBlocks) {
+    int nFiles = spec->nFiles;
+    uint64_t *need = malloc((nFiles ? nFiles : 1) * sizeof(uint64_t));
+    int *order = malloc((nFiles ? nFiles : 1) * sizeof(int));
+    if (need == NULL || order == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(need);
+        free(order);
+        return -1;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < nFiles; i++) {
+        struct stat st;
+        if (stat(spec->fileNames[i], &st) < 0) {
+            perror(spec->fileNames[i]);
+            free(need);
+            free(order);
+            return -1;
+        }
+        need[i] = blocksFor(st.st_size);
+        total += need[i];
+        order[i] = i;
+    }
+    /* insertion sort by size, largest first; the directory is small */
+    for (int i = 1; i < nFiles; i++) {
+        int f = order[i], j = i;
+        while (j > 0 && need[order[j - 1]] < need[f]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = f;
+    }
+    for (int k = 0; k < nFiles; k++) {
+        int least = 0;
+        for (int t = 1; t < nWorkers; t++) {
+            if (workers[t].need < workers[least].need) {
+                least = t;
+            }
+        }
+        workers[least].files[workers[least].nFiles++] = order[k];
+        workers[least].need += need[order[k]];
+        /* reused below: the worker of each file */
+        need[order[k]] = least;
+    }
+    free(order);
+
+    /* each worker reads its files in directory order, or in source order */
+    if (spec->order) {
+        for (int t = 0; t < nWorkers; t++) {
+            workers[t].nFiles = 0;
+        }
+        for (int k = 0; k < nFiles; k++) {
+            Worker *w = &workers[need[spec->order[k]]];
+            w->files[w->nFiles++] = spec->order[k];
+        }
+    }
+    free(need);
+
+    if (total > nBlocks - first) {
+        fprintf(stderr, "disk is full\n");
+        return -1;
+    }
+
+    /* the spare blocks are shared equally; a region boundary is moved down
+       to a fat page boundary when the region still fits */
+    uint64_t spare = (nBlocks - first) - total;
+    uint64_t lo = first, wanted = first;
+    for (int t = 0; t < nWorkers; t++) {
+        Worker *w = &workers[t];
+        if (spec->order == NULL) {
+            qsort(w->files, w->nFiles, sizeof(int), byDirOrder);
+        }
+        wanted += w->need + spare / nWorkers;
+        uint64_t hi = (t == nWorkers - 1) ? nBlocks : wanted;
+        uint64_t aligned = hi / FAT_PAGE_BLOCKS * FAT_PAGE_BLOCKS;
+        if (t < nWorkers - 1 && aligned >= lo + w->need && aligned > lo) {
+            hi = aligned;
+        }
+        w->lo = lo;
+        w->hi = hi;
+        lo = hi;
+    }
+    return 0;
+}
+
+int ingestParallel(Image *img, const BuildSpec *spec, FileDoneFn done,
+                   void *arg) {
+    int nWorkers = spec->threads;
+    if (nWorkers > spec->nFiles) {
+        nWorkers = spec->nFiles ? spec->nFiles : 1;
+    }
+    uint32_t nBlocks = img->super->nBlocks;
+
+    /* the root directory took the lowest data block; the rest is split up */
+    uint32_t first = img->super->root + 1;
+    if (nBlocks - first < (uint32_t)nWorkers) {
+        nWorkers = 1;
+    }
+
+    Node *nodes = NULL;
+    int nNodes = spec->pin ? readTopology(&nodes) : 0;
+    if (nNodes < 0) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    pthread_mutex_t doneLock = PTHREAD_MUTEX_INITIALIZER;
+    Worker *workers = calloc(nWorkers, sizeof(Worker));
+    int rc = workers ? 0 : -1;
+    for (int t = 0; rc == 0 && t < nWorkers; t++) {
+        Worker *w = &workers[t];
+        w->img = *img;
+        w->super = *img->super;
+        w->img.super = &w->super;
+        w->files = malloc((spec->nFiles ? spec->nFiles : 1) * sizeof(int));
+        if (w->files == NULL) {
+            rc = -1;
+        }
+        w->spec = spec;
+        w->done = done;
+        w->arg = arg;
+        w->doneLock = &doneLock;
+        w->cpu = -1;
+        if (nNodes) {
+            Node *n = &nodes[t % nNodes];
+            w->cpu = n->cpus[(t / nNodes) % n->nCpus];
+        }
+    }
+
+    pthread_t *threads = rc == 0 ? malloc(nWorkers * sizeof(pthread_t)) : NULL;
+    if (threads == NULL) {
+        fprintf(stderr, "out of memory\n");
+        rc = -1;
+    } else {
+        rc = planRegions(workers, nWorkers, spec, first, nBlocks);
+    }
+    int started = 0;
+    if (rc == 0) {
+        while (started < nWorkers) {
+            int err = pthread_create(&threads[started], NULL, workerThread,
+                                     &workers[started]);
+            if (err) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                rc = -1;
+                break;
+            }
+            started++;
+        }
+        for (int t = 0; t < started; t++) {
+            pthread_join(threads[t], NULL);
+            if (workers[t].failed) {
+                rc = -1;
+            }
+        }
+    }
+    free(threads);
+
+    /* chain the region free lists, top region first; a region that is not
+       used up still has its lowest block free, at the end of its list, so
+       that is where the next region's list is hooked on. A region whose
+       worker never ran has no free list at all. */
+    if (started == nWorkers) {
+        uint32_t *link = &img->super->avail;
+        for (int t = nWorkers - 1; t >= 0; t--) {
+            if (workers[t].super.avail != 0) {
+                *link = workers[t].super.avail;
+                link = &img->fat[workers[t].lo];
+            }
+        }
+        *link = 0;
+    }
+
+    for (int t = 0; workers && t < nWorkers; t++) {
+        free(workers[t].files);
+    }
+    free(workers);
+    for (int n = 0; n < nNodes; n++) {
+        free(nodes[n].cpus);
+    }
+    free(nodes);
+    return rc;
+}
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perfctr.h"
+
+const char *const perfNames[PERF_NCOUNTERS] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses", "page_faults"
+};
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERF_NCOUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+
+int perfOpen(PerfCounters *pc) {
+    int n = 0;
+    for (int k = 0; k < PERF_NCOUNTERS; k++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[k].type;
+        attr.config = events[k].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* count the ingest threads too; inherit rules out group reads, so
+           every counter is read on its own */
+        attr.inherit = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pc->fd[k] = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                            PERF_FLAG_FD_CLOEXEC);
+        if (pc->fd[k] >= 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+void perfClose(PerfCounters *pc) {
+    for (int k = 0; k < PERF_NCOUNTERS; k++) {
+        if (pc->fd[k] >= 0) {
+            close(pc->fd[k]);
+            pc->fd[k] = -1;
+        }
+    }
+}
+
+void perfRead(const PerfCounters *pc, PerfSample *s) {
+    for (int k = 0; k < PERF_NCOUNTERS; k++) {
+        uint64_t v[3];   /* value, time enabled, time running */
+        s->valid[k] = pc->fd[k] >= 0 &&
+                      read(pc->fd[k], v, sizeof(v)) == sizeof(v);
+        if (!s->valid[k]) {
+            v[0] = v[1] = v[2] = 0;
+        }
+        s->value[k] = v[0];
+        s->enabled[k] = v[1];
+        s->running[k] = v[2];
+    }
+    if (!s->valid[PERF_PAGE_FAULTS]) {
+        struct rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru) == 0) {
+            s->value[PERF_PAGE_FAULTS] = ru.ru_minflt + ru.ru_majflt;
+            s->valid[PERF_PAGE_FAULTS] = 1;
+        }
+    }
+}
+
+void perfJson(FILE *out, const PerfSample *from, const PerfSample *to) {
+    for (int k = 0; k < PERF_NCOUNTERS; k++) {
+        uint64_t enabled = to->enabled[k] - from->enabled[k];
+        uint64_t running = to->running[k] - from->running[k];
+        if (!from->valid[k] || !to->valid[k] ||
+            to->value[k] < from->value[k] || (enabled > 0 && running == 0)) {
+            fprintf(out, ",\"%s\":null", perfNames[k]);
+            continue;
+        }
+        double count = to->value[k] - from->value[k];
+        if (running < enabled) {
+            /* multiplexed: extrapolate to the whole interval */
+            count = count * enabled / running;
+        }
+        fprintf(out, ",\"%s\":%lu", perfNames[k], (unsigned long)count);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Hardware and software event counters of the calling process (and of the
+ * threads it starts later), through perf_event_open(2), to tell whether a
+ * phase is bound by the CPU or by memory: an IPC well below 1 with many LLC
+ * or dTLB misses per MB points at memory.
+ *
+ * Counters that cannot be opened (no PMU in a VM, perf_event_paranoid, a
+ * seccomp filter) are simply missing; page faults then come from
+ * getrusage() instead. Counts are scaled up when the kernel had to
+ * multiplex the counters, by how long each ran in the interval reported.
+ */
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_PAGE_FAULTS,
+    PERF_NCOUNTERS
+};
+
+/* the JSON keys of the counters, in the order above */
+extern const char *const perfNames[PERF_NCOUNTERS];
+
+typedef struct {
+    int fd[PERF_NCOUNTERS];   /* -1 where unavailable */
+} PerfCounters;
+
+/* raw counts; the times are 0 where the count does not come from perf */
+typedef struct {
+    uint64_t value[PERF_NCOUNTERS];
+    uint64_t enabled[PERF_NCOUNTERS];   /* ns the counter was enabled */
+    uint64_t running[PERF_NCOUNTERS];   /* ns it was actually counting */
+    int valid[PERF_NCOUNTERS];
+} PerfSample;
+
+/* @return how many counters could be opened */
+int perfOpen(PerfCounters *pc);
+void perfClose(PerfCounters *pc);
+
+/* the counts so far */
+void perfRead(const PerfCounters *pc, PerfSample *s);
+
+/* ,"cycles":n,... for the counts between @from and @to; null if missing,
+   or if a multiplexed counter did not run in between */
+void perfJson(FILE *out, const PerfSample *from, const PerfSample *to);
+
+#endif
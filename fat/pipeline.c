@@ -0,0 +1,356 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mkfs.h"
+#include "entropy.h"
+#include "probes.h"
+
+/**
+ * The ingest pipeline splits what oneFile() does in one loop into stages that
+ * run on their own threads, so that work on the data does not wait for I/O:
+ *
+ *   read stage          transform stage          place stage
+ *   (reader thread) --> (transform thread) -->   (calling thread)
+ *   read() inputs       crc32 of every file,     copy into image blocks,
+ *   into chunks         sampled entropy          directory, checkpoints
+ *
+ * Chunks come from a fixed pool of buffers (--buffers x --buffer-kb), which
+ * is all the memory the pipeline ever uses. A stage that runs ahead blocks
+ * when the next queue is full or no free buffer is left, and that is the
+ * backpressure. Each queue has exactly one producer and one consumer, so it
+ * is a ring of chunk numbers with an atomic head and tail. A stage that has
+ * to wait spins briefly and then sleeps on the queue's condition variable;
+ * the other side only takes the lock when it sees a sleeper, so a balanced
+ * pipeline never touches it:
+ *
+ *   free: place -> read    q1: read -> transform    q2: transform -> place
+ *
+ * The rings are as large as the pool, so a push never finds them full; a
+ * stage only ever waits for a buffer or for work.
+ *
+ * With --decompress the read stage also unpacks compressed inputs (input.c),
+ * so the unpacking overlaps with the rest of the pipeline.
+ *
+ * The entropy of every chunk (see entropy.h) decides whether that extent of
+ * the file is worth compressing, and the samples of all chunks together
+ * decide it for the whole file. The result is reported in the build stats.
+ */
+
+enum {
+    CHUNK_FIRST = 1,  /* first chunk of a file */
+    CHUNK_LAST = 2,   /* last chunk of a file (may also be the first) */
+    CHUNK_ERROR = 4,  /* the file could not be read */
+    CHUNK_END = 8,    /* no more files; the stage passes it on and stops */
+};
+
+typedef struct {
+    char *data;
+    uint32_t length;
+    uint32_t flags;
+    int file;         /* index into BuildSpec.fileNames */
+    FileInfo info;    /* so far for the file, set by the transform */
+} Chunk;
+
+/* single producer, single consumer ring of chunk numbers */
+typedef struct {
+    uint32_t *slots;
+    uint32_t mask;
+    _Atomic uint32_t head;  /* next slot to pop, owned by the consumer */
+    _Atomic uint32_t tail;  /* next slot to push, owned by the producer */
+    atomic_int waiting;     /* one side sleeps on wake */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} Queue;
+
+typedef struct {
+    const BuildSpec *spec;
+    int firstFile;
+    Chunk *chunks;
+    uint32_t nChunks;
+    size_t bufferSize;
+    Queue freeQ, q1, q2;
+    atomic_int stop;   /* set by the place stage when the build failed */
+} Pipeline;
+
+
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void crcInit(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crcTable[i] = c;
+    }
+}
+
+/* update a crc32 (the zlib/cksum -o3 polynomial) with @length bytes */
+static uint32_t crc32Update(uint32_t crc, const char *data, size_t length) {
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = crcTable[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static int queueInit(Queue *q, uint32_t capacity) {
+    uint32_t n = 1;
+    while (n < capacity) {
+        n <<= 1;
+    }
+    q->slots = malloc(n * sizeof(uint32_t));
+    q->mask = n - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->waiting, 0);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wake, NULL);
+    return q->slots ? 0 : -1;
+}
+
+static void queueFree(Queue *q) {
+    free(q->slots);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->wake);
+}
+
+/* whether a push (@push) or a pop on @q can go ahead */
+static int queueReady(Queue *q, int push) {
+    uint32_t head = atomic_load(&q->head);
+    uint32_t tail = atomic_load(&q->tail);
+    return push ? tail - head <= q->mask : tail != head;
+}
+
+/**
+ * @brief wait until a push (@push) or a pop on @q can go ahead.
+ * Spins for a little while, since waits are short when the pipeline is
+ * balanced, and then sleeps until the other side moves. The sleeper raises
+ * waiting before it checks again and the other side checks waiting after it
+ * moved, both sequentially consistent, so at least one of them sees the
+ * other and no wakeup is lost. Only one side of a queue can be waiting: a
+ * ring is never empty and full at once.
+ */
+static void queueWait(Queue *q, int push) {
+    for (int spins = 0; spins < 64; spins++) {
+        if (queueReady(q, push)) {
+            return;
+        }
+    }
+    pthread_mutex_lock(&q->lock);
+    atomic_store(&q->waiting, 1);
+    while (!queueReady(q, push)) {
+        pthread_cond_wait(&q->wake, &q->lock);
+    }
+    atomic_store(&q->waiting, 0);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* wake the other side of @q if it went to sleep */
+static void queueWake(Queue *q) {
+    if (atomic_load(&q->waiting)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->wake);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+static void queuePush(Queue *q, uint32_t chunk) {
+    queueWait(q, 1);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    q->slots[tail & q->mask] = chunk;
+    atomic_store(&q->tail, tail + 1);
+    queueWake(q);
+}
+
+static uint32_t queuePop(Queue *q) {
+    queueWait(q, 0);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t chunk = q->slots[head & q->mask];
+    atomic_store(&q->head, head + 1);
+    queueWake(q);
+    return chunk;
+}
+
+/* read stage: every input, in reading order, cut into buffer sized chunks */
+static void *readStage(void *arg) {
+    Pipeline *p = arg;
+    const BuildSpec *spec = p->spec;
+
+    for (int k = p->firstFile; k < spec->nFiles; k++) {
+        if (atomic_load(&p->stop)) {
+            break;
+        }
+        int i = specInput(spec, k);
+        F439_PROBE1(file_start, spec->fileNames[i]);
+        InputReader in;
+        int opened = inputOpen(&in, spec->fileNames[i], spec->decompress) == 0;
+        if (opened) {
+            sourceAdvise(in.fd);
+        }
+        off_t dropped = 0;
+        uint32_t flags = CHUNK_FIRST;
+        for (;;) {
+            uint32_t c = queuePop(&p->freeQ);
+            Chunk *ch = &p->chunks[c];
+            ch->file = i;
+            ch->length = 0;
+            ch->flags = flags;
+            flags = 0;
+
+            ssize_t n = opened ? inputRead(&in, ch->data, p->bufferSize) : -1;
+            if (n < 0) {
+                fprintf(stderr, "%s: %s\n", spec->fileNames[i], strerror(errno));
+                ch->flags |= CHUNK_ERROR | CHUNK_LAST;
+            } else if (n == 0) {
+                ch->flags |= CHUNK_LAST;
+                sourceDropBehind(in.fd, &dropped, in.consumed, 1);
+            } else {
+                ch->length = n;
+                sourceDropBehind(in.fd, &dropped, in.consumed, 0);
+            }
+            /* the chunk belongs to the next stage once it is pushed */
+            int last = (ch->flags & CHUNK_LAST) != 0;
+            queuePush(&p->q1, c);
+            if (last) {
+                break;
+            }
+        }
+        if (opened) {
+            inputClose(&in);
+        }
+    }
+
+    uint32_t c = queuePop(&p->freeQ);
+    p->chunks[c].flags = CHUNK_END;
+    queuePush(&p->q1, c);
+    return NULL;
+}
+
+/* transform stage: checksum and entropy of every file */
+static void *transformStage(void *arg) {
+    Pipeline *p = arg;
+    FileInfo info;
+    ByteHistogram fileHist, chunkHist;
+    for (;;) {
+        uint32_t c = queuePop(&p->q1);
+        Chunk *ch = &p->chunks[c];
+        if (ch->flags & CHUNK_FIRST) {
+            memset(&info, 0, sizeof(info));
+            histClear(&fileHist);
+        }
+        info.crc = crc32Update(info.crc, ch->data, ch->length);
+        if (ch->length) {
+            histClear(&chunkHist);
+            histSample(&chunkHist, ch->data, ch->length);
+            histMerge(&fileHist, &chunkHist);
+            info.chunks++;
+            if (entropyPlan(histEntropy(&chunkHist)).compress) {
+                info.compressChunks++;
+            }
+        }
+        if (ch->flags & CHUNK_LAST) {
+            info.entropy = histEntropy(&fileHist);
+            info.level = entropyPlan(info.entropy).level;
+        }
+        ch->info = info;
+        /* once pushed, the chunk may be placed, recycled and refilled */
+        int end = (ch->flags & CHUNK_END) != 0;
+        queuePush(&p->q2, c);
+        if (end) {
+            return NULL;
+        }
+    }
+}
+
+int ingestPipeline(Image *img, const BuildSpec *spec, int firstFile,
+                   FileDoneFn done, void *arg) {
+    pthread_once(&crcOnce, crcInit);
+
+    Pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.spec = spec;
+    p.firstFile = firstFile;
+    p.nChunks = spec->pipelineBuffers > 1 ? spec->pipelineBuffers : 2;
+    p.bufferSize = spec->pipelineBufferSize ? spec->pipelineBufferSize
+                                            : 64 * 1024;
+    p.chunks = calloc(p.nChunks, sizeof(Chunk));
+    char *pool = malloc(p.nChunks * p.bufferSize);
+    /* all three, so that all three can be freed */
+    int rc = queueInit(&p.freeQ, p.nChunks) | queueInit(&p.q1, p.nChunks) |
+             queueInit(&p.q2, p.nChunks);
+    if (rc < 0 || p.chunks == NULL || pool == NULL) {
+        fprintf(stderr, "out of memory for the ingest pipeline\n");
+        rc = -1;
+        goto out;
+    }
+    for (uint32_t c = 0; c < p.nChunks; c++) {
+        p.chunks[c].data = pool + c * p.bufferSize;
+        queuePush(&p.freeQ, c);
+    }
+
+    pthread_t reader, transformer;
+    int err = pthread_create(&transformer, NULL, transformStage, &p);
+    if (err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        rc = -1;
+        goto out;
+    }
+    err = pthread_create(&reader, NULL, readStage, &p);
+    int failed = 0;   /* once set, chunks are only recycled */
+    if (err) {
+        /* stand in for the reader, so the transform stage sees the end */
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        uint32_t c = queuePop(&p.freeQ);
+        p.chunks[c].flags = CHUNK_END;
+        queuePush(&p.q1, c);
+        rc = -1;
+        failed = 1;
+    }
+
+    /* place stage: runs here, because it owns the image */
+    FileWriter w;
+    for (;;) {
+        uint32_t c = queuePop(&p.q2);
+        Chunk *ch = &p.chunks[c];
+        uint32_t flags = ch->flags;
+        if (flags & CHUNK_END) {
+            queuePush(&p.freeQ, c);
+            break;
+        }
+        if (!failed) {
+            if (flags & CHUNK_ERROR) {
+                failed = 1;
+            } else if (((flags & CHUNK_FIRST) && writerStart(img, &w) < 0) ||
+                       writerAppend(img, &w, ch->data, ch->length) < 0) {
+                failed = 1;
+            } else if ((flags & CHUNK_LAST) &&
+                       done(arg, ch->file, writerFinish(img, &w),
+                            &ch->info) < 0) {
+                failed = 1;
+            }
+            if (failed) {
+                rc = -1;
+                atomic_store(&p.stop, 1);
+            }
+        }
+        queuePush(&p.freeQ, c);
+    }
+
+    if (!err) {
+        pthread_join(reader, NULL);
+    }
+    pthread_join(transformer, NULL);
+out:
+    queueFree(&p.freeQ);
+    queueFree(&p.q1);
+    queueFree(&p.q2);
+    free(pool);
+    free(p.chunks);
+    return rc;
+}
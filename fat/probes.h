@@ -0,0 +1,47 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/**
+ * Statically defined tracepoints (USDT) of provider f439, for bpftrace,
+ * perf or systemtap on a live host:
+ *
+ *      bpftrace -l 'usdt:./mkfs:f439:*'
+ *      bpftrace -e 'usdt:./mkfs:f439:file_done { @[str(arg0)] = arg2; }'
+ *
+ * Each probe is a single nop in the code plus a note in the ELF file that
+ * tells a tracer where it is and where its arguments live; nothing runs
+ * until a tracer attaches. The arguments are still evaluated every time,
+ * so they should be values at hand anyway (locals, fields, one load).
+ *
+ * The probes need <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel).
+ * Without it, or with -DF439_NO_PROBES, they compile to nothing.
+ *
+ *      mkfs   block_alloc(block, next avail)
+ *             file_start(path)     file_done(path, first block, bytes)
+ *             dir_write(slot, name, first block)
+ *             sync_start(files)    sync_done(status)
+ *      readfs read_block(block, cache hit)
+ *      async  read_done(buffer, result)
+ */
+
+#if !defined(F439_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define F439_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef F439_HAVE_PROBES
+#define F439_PROBE1(name, a) DTRACE_PROBE1(f439, name, a)
+#define F439_PROBE2(name, a, b) DTRACE_PROBE2(f439, name, a, b)
+#define F439_PROBE3(name, a, b, c) DTRACE_PROBE3(f439, name, a, b, c)
+#else
+/* sizeof() keeps the arguments "used" without evaluating them */
+#define F439_PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define F439_PROBE2(name, a, b) \
+    do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define F439_PROBE3(name, a, b, c) \
+    do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,250 @@
+#define _POSIX_C_SOURCE 200809L   /* pthread_barrier_t */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "rank.h"
+
+/**
+ * Pointer jumping (Wyllie's list ranking), run backwards along the chains:
+ *
+ * 1. every block starts out as its own ancestor at distance 0;
+ * 2. every block b with fat[b] = n makes itself the ancestor of n, at
+ *    distance 1, so each block now points one hop towards its head;
+ * 3. then, in rounds, every block replaces its ancestor by its ancestor's
+ *    ancestor and adds up the distances. After k rounds a block points 2^k
+ *    hops up, so after log2(longest chain) rounds every block points at its
+ *    head and its distance is its position.
+ *
+ * Every step reads one generation of the arrays and writes the other, so the
+ * blocks are independent and are split between the threads in contiguous
+ * segments, with a barrier between rounds. The rounds stop as soon as one
+ * changes nothing, or after 32. A block only has an owner if the block it
+ * ended at had no predecessor after (2): the blocks of a cycle never reach
+ * such a head, even when a cycle whose length is a power of two makes them
+ * their own ancestors.
+ *
+ * A block that two chains point to (a cross-link) gets one of them as its
+ * ancestor; which one is not defined. fsck finds those.
+ */
+
+#define RANK_MAX_ROUNDS 33  /* 2^32 hops: longer than any chain */
+
+
+typedef struct {
+    uint32_t block;
+    uint32_t index;       /* into the caller's heads */
+} HeadEntry;
+
+typedef struct {
+    const Image *img;
+    uint32_t first;       /* the first data block */
+    uint32_t nBlocks;
+    uint32_t *anc[2];     /* the two generations of ancestors */
+    uint32_t *dist[2];    /* and of distances to them */
+    uint8_t *hasPred;     /* some block points to it, after (2) */
+    int cur;              /* the generation being read */
+    atomic_int changed;
+    int rounds;           /* left before giving up on cycles */
+    int done;
+    pthread_barrier_t barrier;
+    pthread_mutex_t lock;   /* the workers wait on @go until @nJobs is */
+    pthread_cond_t go;      /* known, that is until they have all started */
+    int nJobs;
+    const HeadEntry *heads; /* sorted by block */
+    uint32_t nHeads;
+} Ranker;
+
+typedef struct {
+    Ranker *r;
+    uint32_t lo, hi;      /* blocks [lo, hi) */
+    int leader;           /* the one thread that flips generations */
+} RankJob;
+
+
+/* the index into the caller's heads of block @b, or RANK_NONE */
+static uint32_t headOf(const Ranker *r, uint32_t b) {
+    uint32_t lo = 0, hi = r->nHeads;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (r->heads[mid].block < b) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < r->nHeads && r->heads[lo].block == b ? r->heads[lo].index
+                                                     : RANK_NONE;
+}
+
+static void *rankThread(void *arg) {
+    RankJob *job = arg;
+    Ranker *r = job->r;
+    const uint32_t *fat = r->img->fat;
+
+    pthread_mutex_lock(&r->lock);
+    while (r->nJobs == 0) {
+        pthread_cond_wait(&r->go, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    /* 1. */
+    for (uint32_t b = job->lo; b < job->hi; b++) {
+        r->anc[0][b] = b;
+        r->dist[0][b] = 0;
+    }
+    pthread_barrier_wait(&r->barrier);
+
+    /* 2. writes go to the successors, which may be in another segment;
+       every block has at most one predecessor unless it is cross-linked,
+       and then several threads store to it at once */
+    for (uint32_t b = job->lo; b < job->hi; b++) {
+        uint32_t n = fat[b];
+        if (b >= r->first && n >= r->first && n < r->nBlocks && n != b) {
+            __atomic_store_n(&r->anc[0][n], b, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->dist[0][n], 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_barrier_wait(&r->barrier);
+    for (uint32_t b = job->lo; b < job->hi; b++) {
+        r->hasPred[b] = r->anc[0][b] != b;
+    }
+
+    /* 3. */
+    for (;;) {
+        const uint32_t *anc = r->anc[r->cur], *dist = r->dist[r->cur];
+        uint32_t *nextAnc = r->anc[r->cur ^ 1];
+        uint32_t *nextDist = r->dist[r->cur ^ 1];
+        int changed = 0;
+        for (uint32_t b = job->lo; b < job->hi; b++) {
+            uint32_t a = anc[b];
+            uint32_t up = anc[a];
+            nextAnc[b] = up;
+            nextDist[b] = dist[b] + dist[a];
+            changed |= up != a;
+        }
+        if (changed) {
+            atomic_store_explicit(&r->changed, 1, memory_order_relaxed);
+        }
+        pthread_barrier_wait(&r->barrier);
+        if (job->leader) {
+            r->cur ^= 1;
+            r->done = !atomic_load(&r->changed) || --r->rounds == 0;
+            atomic_store(&r->changed, 0);
+        }
+        pthread_barrier_wait(&r->barrier);
+        if (r->done) {
+            break;
+        }
+    }
+
+    /* the head a block ended at is only its owner if nothing points to it;
+       the result goes to the generation not being read */
+    const uint32_t *anc = r->anc[r->cur], *dist = r->dist[r->cur];
+    uint32_t *owner = r->anc[r->cur ^ 1], *pos = r->dist[r->cur ^ 1];
+    for (uint32_t b = job->lo; b < job->hi; b++) {
+        uint32_t a = anc[b];
+        owner[b] = (b >= r->first && anc[a] == a && !r->hasPred[a])
+                   ? headOf(r, a) : RANK_NONE;
+        pos[b] = dist[b];
+    }
+    return NULL;
+}
+
+static int byBlock(const void *x, const void *y) {
+    uint32_t a = ((const HeadEntry *)x)->block;
+    uint32_t b = ((const HeadEntry *)y)->block;
+    return (a > b) - (a < b);
+}
+
+int rankChains(const Image *img, const uint32_t *heads, uint32_t nHeads,
+               uint32_t *owner, uint32_t *pos, int nThreads) {
+    Ranker r;
+    memset(&r, 0, sizeof(r));
+    r.img = img;
+    r.nBlocks = img->super->nBlocks;
+    r.first = imageFirstData(r.nBlocks);
+    r.nHeads = nHeads;
+    /* the caller's arrays are the second generation */
+    r.anc[0] = malloc((size_t)r.nBlocks * sizeof(uint32_t));
+    r.dist[0] = malloc((size_t)r.nBlocks * sizeof(uint32_t));
+    r.hasPred = malloc(r.nBlocks ? r.nBlocks : 1);
+    r.anc[1] = owner;
+    r.dist[1] = pos;
+    HeadEntry *sorted = malloc((nHeads + 1) * sizeof(HeadEntry));
+    if (nThreads < 1) {
+        nThreads = 1;
+    }
+    if ((uint32_t)nThreads > r.nBlocks) {
+        nThreads = r.nBlocks ? r.nBlocks : 1;
+    }
+    RankJob *jobs = malloc(nThreads * sizeof(RankJob));
+    pthread_t *threads = malloc(nThreads * sizeof(pthread_t));
+    if (r.anc[0] == NULL || r.dist[0] == NULL || r.hasPred == NULL ||
+        sorted == NULL || jobs == NULL || threads == NULL) {
+        free(r.anc[0]);
+        free(r.dist[0]);
+        free(r.hasPred);
+        free(sorted);
+        free(jobs);
+        free(threads);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < nHeads; i++) {
+        sorted[i].block = heads[i];
+        sorted[i].index = i;
+    }
+    qsort(sorted, nHeads, sizeof(HeadEntry), byBlock);
+    r.heads = sorted;
+    r.rounds = RANK_MAX_ROUNDS;
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.go, NULL);
+    for (int t = 0; t < nThreads; t++) {
+        jobs[t].r = &r;
+    }
+    int started = 1;    /* this thread is job 0 */
+    while (started < nThreads) {
+        int err = pthread_create(&threads[started], NULL, rankThread,
+                                 &jobs[started]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+        started++;
+    }
+
+    /* the blocks are split between the threads that did start */
+    pthread_barrier_init(&r.barrier, NULL, started);
+    uint32_t per = (r.nBlocks + started - 1) / started;
+    for (int t = 0; t < started; t++) {
+        uint64_t lo = (uint64_t)t * per, hi = lo + per;
+        jobs[t].lo = lo < r.nBlocks ? lo : r.nBlocks;
+        jobs[t].hi = hi < r.nBlocks ? hi : r.nBlocks;
+        jobs[t].leader = t == 0;
+    }
+    pthread_mutex_lock(&r.lock);
+    r.nJobs = started;
+    pthread_cond_broadcast(&r.go);
+    pthread_mutex_unlock(&r.lock);
+
+    rankThread(&jobs[0]);
+    for (int t = 1; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_barrier_destroy(&r.barrier);
+    pthread_cond_destroy(&r.go);
+    pthread_mutex_destroy(&r.lock);
+
+    /* the result is in the generation that was not read last */
+    if (r.cur == 1) {
+        memcpy(owner, r.anc[0], (size_t)r.nBlocks * sizeof(uint32_t));
+        memcpy(pos, r.dist[0], (size_t)r.nBlocks * sizeof(uint32_t));
+    }
+    free(r.anc[0]);
+    free(r.dist[0]);
+    free(r.hasPred);
+    free(sorted);
+    free(jobs);
+    free(threads);
+    return 0;
+}
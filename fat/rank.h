@@ -0,0 +1,37 @@
+#ifndef RANK_H
+#define RANK_H
+
+#include <stdint.h>
+#include "f439.h"
+
+/**
+ * List ranking over the fat: for every block of an image, which chain it is
+ * in and how far down that chain, computed for all blocks at once instead of
+ * by walking chains one hop at a time. The cost is O(n log n) work for n
+ * blocks, but every step is a parallel sweep over the whole fat, so a huge
+ * file is no slower to map than many small ones (see rank.c).
+ */
+
+#define RANK_NONE UINT32_MAX
+
+/**
+ * @brief rank the chains of @img.
+ * @param heads the first blocks of the chains of interest, e.g. the files of
+ *        the root directory; need not be sorted
+ * @param owner filled in for every block b < nBlocks: the index into @heads
+ *        of the chain holding b, or RANK_NONE for blocks in no such chain
+ *        (metadata, free blocks, orphans, cycles)
+ * @param pos filled in for every block: its position in its chain, 0 for
+ *        the head (undefined where @owner is RANK_NONE)
+ * @return 0, or -1 if out of memory.
+ */
+int rankChains(const Image *img, const uint32_t *heads, uint32_t nHeads,
+               uint32_t *owner, uint32_t *pos, int nThreads);
+
+/* byte offset in its file of the data of the block at chain position @pos */
+static inline uint64_t rankOffset(uint32_t pos) {
+    return pos == 0 ? 0 : (F439_BLOCK_SIZE - F439_HEADER_SIZE) +
+                          (uint64_t)(pos - 1) * F439_BLOCK_SIZE;
+}
+
+#endif
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE   /* sync_file_range() */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+#include "mkfs.h"
+
+/**
+ * Limits on the I/O of a build (mkfs --read-mbps, --read-iops,
+ * --write-mbps, --write-iops), so that a background build has a known
+ * impact on a shared host, and its I/O and CPU priority (--ioprio, --nice).
+ *
+ * Every limit is a token bucket that refills at the limit per second and
+ * holds up to BUCKET_SECONDS of it. A caller takes what it used and, when
+ * that leaves the bucket in debt, sleeps until the debt is paid back; so
+ * long reads are allowed but paid for, and threads that share a limit
+ * share it fairly over time.
+ *
+ * Reads are charged as the inputs are read. An operation is a read() of up
+ * to IO_OP_SIZE bytes; larger ones count as several, which is what the
+ * block layer turns them into.
+ *
+ * Writes go through the mapping of the image, so they reach the disk
+ * whenever the kernel decides to write dirty pages back, usually in bursts
+ * long after mkfs produced them. With a write limit, getBlock() charges
+ * every LIMIT_PIECE of blocks it hands out (counted, since a free list
+ * reused from a previous image is not in order), which paces the producer,
+ * and starts the writeback of the piece above the block it is at, which is
+ * usually full, wherever its blocks live (the image file, stripes, the
+ * bulk file); so what is written goes out at the pace it was produced, and
+ * syncImage() at the end finds little left to do. Copying a previous image
+ * (--prev) is charged as it goes, too.
+ */
+
+#define BUCKET_SECONDS 0.1
+
+typedef struct {
+    double rate;          /* per second; 0: no limit */
+    double tokens;        /* may go negative: the debt */
+    struct timespec last;
+    pthread_mutex_t lock;
+} TokenBucket;
+
+static TokenBucket readBytes = {0, 0, {0, 0}, PTHREAD_MUTEX_INITIALIZER};
+static TokenBucket readOps = {0, 0, {0, 0}, PTHREAD_MUTEX_INITIALIZER};
+static TokenBucket writeBytes = {0, 0, {0, 0}, PTHREAD_MUTEX_INITIALIZER};
+static TokenBucket writeOps = {0, 0, {0, 0}, PTHREAD_MUTEX_INITIALIZER};
+static atomic_ulong handedOut;      /* blocks, by getBlock() */
+
+
+static void bucketInit(TokenBucket *b, double rate) {
+    b->rate = rate > 0 ? rate : 0;
+    b->tokens = b->rate * BUCKET_SECONDS;
+    clock_gettime(CLOCK_MONOTONIC, &b->last);
+}
+
+static void bucketTake(TokenBucket *b, double n) {
+    if (b->rate == 0 || n <= 0) {
+        return;
+    }
+    struct timespec now;
+    pthread_mutex_lock(&b->lock);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - b->last.tv_sec) +
+                     (now.tv_nsec - b->last.tv_nsec) / 1e9;
+    b->last = now;
+    b->tokens += elapsed * b->rate;
+    if (b->tokens > b->rate * BUCKET_SECONDS) {
+        b->tokens = b->rate * BUCKET_SECONDS;
+    }
+    b->tokens -= n;
+    double wait = b->tokens < 0 ? -b->tokens / b->rate : 0;
+    pthread_mutex_unlock(&b->lock);
+
+    if (wait > 0) {
+        struct timespec ts = {(time_t)wait,
+                              (long)((wait - (time_t)wait) * 1e9)};
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+void ioLimitsSet(double readMBps, double readIops, double writeMBps,
+                 double writeIops) {
+    bucketInit(&readBytes, readMBps * 1e6);
+    bucketInit(&readOps, readIops);
+    bucketInit(&writeBytes, writeMBps * 1e6);
+    bucketInit(&writeOps, writeIops);
+}
+
+int ioLimitsWrite(void) {
+    return writeBytes.rate > 0 || writeOps.rate > 0;
+}
+
+void ioLimitRead(size_t bytes) {
+    bucketTake(&readOps, (bytes + IO_OP_SIZE - 1) / IO_OP_SIZE);
+    bucketTake(&readBytes, bytes);
+}
+
+void ioLimitWrite(size_t bytes) {
+    bucketTake(&writeOps, (bytes + IO_OP_SIZE - 1) / IO_OP_SIZE);
+    bucketTake(&writeBytes, bytes);
+}
+
+static void startPiece(int fd, off_t off, size_t length, char *map) {
+    (void)map;
+    sync_file_range(fd, off, length, SYNC_FILE_RANGE_WRITE);
+}
+
+void ioLimitBlock(Image *img, uint32_t idx) {
+    const uint64_t piece = LIMIT_PIECE / F439_BLOCK_SIZE;
+    if ((atomic_fetch_add(&handedOut, 1) + 1) % piece != 0) {
+        return;
+    }
+    ioLimitWrite(LIMIT_PIECE);
+    uint64_t full = (uint64_t)idx + piece;
+    forBlockRuns(img, full, full + piece, startPiece);
+}
+
+int ioPrioritySet(const char *how, int nice) {
+    if (how) {
+        int class, level = 4;
+        char name[8];
+        if (sscanf(how, "%7[a-z]:%d", name, &level) < 1 || level < 0 ||
+            level >= IOPRIO_NR_LEVELS) {
+            fprintf(stderr, "%s: not an I/O priority (idle, be[:0-7] or "
+                            "rt[:0-7])\n", how);
+            return -1;
+        }
+        if (strcmp(name, "idle") == 0) {
+            class = IOPRIO_CLASS_IDLE;
+            level = 0;
+        } else if (strcmp(name, "be") == 0) {
+            class = IOPRIO_CLASS_BE;
+        } else if (strcmp(name, "rt") == 0) {
+            class = IOPRIO_CLASS_RT;
+        } else {
+            fprintf(stderr, "%s: not an I/O priority (idle, be[:0-7] or "
+                            "rt[:0-7])\n", how);
+            return -1;
+        }
+        /* threads started later inherit it */
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                    IOPRIO_PRIO_VALUE(class, level)) < 0) {
+            perror("ioprio_set");
+            return -1;
+        }
+    }
+    if (nice && setpriority(PRIO_PROCESS, 0, nice) < 0) {
+        perror("setpriority");
+        return -1;
+    }
+    return 0;
+}
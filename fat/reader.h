@@ -0,0 +1,225 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdint.h>
+#include <string.h>
+#include "f439.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * reader.h reads F439 images of any geometry (block size and fat entry
+ * width, see Geometry in f439.h) from memory, without any of the decoding
+ * that index.c does up front. It is header only, for services that map an
+ * image and read files out of it directly.
+ *
+ * F439_READER(BS, W) expands to a set of functions for BS byte blocks and
+ * W bit fat entries. With both known at compile time, a block address is a
+ * shift, a chain hop is one load of a fixed width, the location of an
+ * offset within a file is a shift and a mask, and the directory scan
+ * compares 16 byte entries at a fixed stride without early exits, which
+ * the compiler can vectorize. f439ReaderOpen() picks the instantiation for
+ * an image once, from its block 0; every later call goes through one
+ * function pointer straight into code specialized for that image:
+ *
+ *      F439Reader r;
+ *      F439File f;
+ *      if (f439ReaderOpen(&r, map, length) == 0 &&
+ *          r.lookup(&r, "name", &f) == 0) {
+ *          long n = r.read(&r, &f, offset, buf, sizeof(buf));
+ *      }
+ *
+ * Images with a layout (striped or tiered) are spread over several files
+ * and are read with imageOpen() instead.
+ */
+
+typedef struct {
+    char name[F439_NAME_LEN + 1]; /* NUL terminated */
+    uint32_t start;
+    uint32_t type;   /* F439_TYPE_FILE, ... */
+    uint32_t size;
+} F439File;
+
+typedef struct F439Reader F439Reader;
+
+struct F439Reader {
+    const char *base;   /* the mapped image */
+    size_t length;
+    uint32_t nBlocks;
+    uint32_t root;
+    uint32_t nFiles;
+    uint32_t blockSize;
+    uint32_t fatWidth;
+    /* the instantiation for blockSize and fatWidth; all return -1 on a
+       missing file or a corrupted image */
+    int (*file)(const F439Reader *r, uint32_t i, F439File *f);
+    int (*lookup)(const F439Reader *r, const char *name, F439File *f);
+    long (*read)(const F439Reader *r, const F439File *f, uint64_t offset,
+                 char *buf, size_t length);
+};
+
+
+#define F439_READER(BS, W)                                                    \
+static inline const char *f439Ptr##BS##_##W(const F439Reader *r,             \
+                                            uint32_t idx, uint32_t offset) {  \
+    return r->base + (size_t)idx * BS + offset;                               \
+}                                                                             \
+                                                                              \
+static inline uint32_t f439Seek##BS##_##W(const F439Reader *r, uint32_t b,   \
+                                          uint32_t hops) {                    \
+    const uint##W##_t *fat = (const uint##W##_t *)(r->base + BS);            \
+    for (; hops && b != 0; hops--) {                                          \
+        b = fat[b];                                                           \
+        if (b >= r->nBlocks) {                                                \
+            return 0;                                                         \
+        }                                                                     \
+    }                                                                         \
+    return b;                                                                 \
+}                                                                             \
+                                                                              \
+static int f439File##BS##_##W(const F439Reader *r, uint32_t i, F439File *f) { \
+    if (i >= r->nFiles) {                                                     \
+        return -1;                                                            \
+    }                                                                         \
+    const char *e = f439Ptr##BS##_##W(r, r->root,                             \
+                                      F439_HEADER_SIZE + i * F439_DIRENT_SIZE); \
+    memset(f->name, 0, sizeof(f->name));                                      \
+    memcpy(f->name, e, F439_NAME_LEN);                                        \
+    memcpy(&f->start, e + F439_NAME_LEN, sizeof(f->start));                   \
+    if (f->start == 0 || f->start >= r->nBlocks) {                            \
+        return -1;                                                            \
+    }                                                                         \
+    const uint32_t *meta = (const uint32_t *)f439Ptr##BS##_##W(r, f->start, 0); \
+    f->type = meta[0];                                                        \
+    f->size = meta[1];                                                        \
+    return 0;                                                                 \
+}                                                                             \
+                                                                              \
+static int f439Lookup##BS##_##W(const F439Reader *r, const char *name,       \
+                                F439File *f) {                                \
+    char key[16] = {0};                                                       \
+    strncpy(key, name, F439_NAME_LEN);                                        \
+    uint64_t k0;                                                              \
+    uint32_t k1;                                                              \
+    memcpy(&k0, key, sizeof(k0));                                             \
+    memcpy(&k1, key + 8, sizeof(k1));                                         \
+    const char *e = f439Ptr##BS##_##W(r, r->root, F439_HEADER_SIZE);          \
+    int32_t hit = -1;                                                         \
+    for (uint32_t i = r->nFiles; i-- > 0; ) {                                 \
+        uint64_t n0;                                                          \
+        uint32_t n1;                                                          \
+        memcpy(&n0, e + i * F439_DIRENT_SIZE, sizeof(n0));                    \
+        memcpy(&n1, e + i * F439_DIRENT_SIZE + 8, sizeof(n1));                \
+        hit = ((n0 ^ k0) | (n1 ^ k1)) == 0 ? (int32_t)i : hit;                \
+    }                                                                         \
+    return hit < 0 ? -1 : f439File##BS##_##W(r, hit, f);                      \
+}                                                                             \
+                                                                              \
+static long f439Read##BS##_##W(const F439Reader *r, const F439File *f,       \
+                               uint64_t offset, char *buf, size_t length) {   \
+    if (f->type != F439_TYPE_FILE) {                                          \
+        return -1;                                                            \
+    }                                                                         \
+    if (offset >= f->size) {                                                  \
+        return 0;                                                             \
+    }                                                                         \
+    if (length > f->size - offset) {                                          \
+        length = f->size - offset;                                            \
+    }                                                                         \
+    uint32_t pos, off;                                                        \
+    if (offset < BS - F439_HEADER_SIZE) {                                     \
+        pos = 0;                                                              \
+        off = F439_HEADER_SIZE + offset;                                      \
+    } else {                                                                  \
+        pos = 1 + (offset - (BS - F439_HEADER_SIZE)) / BS;                    \
+        off = (offset - (BS - F439_HEADER_SIZE)) % BS;                        \
+    }                                                                         \
+    uint32_t b = f439Seek##BS##_##W(r, f->start, pos);                        \
+    size_t done = 0;                                                          \
+    while (done < length) {                                                   \
+        if (b == 0) {                                                         \
+            return -1;                                                        \
+        }                                                                     \
+        size_t n = BS - off;                                                  \
+        if (n > length - done) {                                              \
+            n = length - done;                                                \
+        }                                                                     \
+        memcpy(buf + done, f439Ptr##BS##_##W(r, b, off), n);                  \
+        done += n;                                                            \
+        off = 0;                                                              \
+        b = f439Seek##BS##_##W(r, b, 1);                                      \
+    }                                                                         \
+    return done;                                                              \
+}
+
+F439_READER(512, 32)
+F439_READER(1024, 32)
+F439_READER(2048, 32)
+F439_READER(4096, 32)
+F439_READER(512, 16)
+F439_READER(1024, 16)
+F439_READER(2048, 16)
+F439_READER(4096, 16)
+
+#define F439_PICK(BS, W)                                                      \
+    if (r->blockSize == BS && r->fatWidth == W) {                             \
+        r->file = f439File##BS##_##W;                                         \
+        r->lookup = f439Lookup##BS##_##W;                                     \
+        r->read = f439Read##BS##_##W;                                         \
+        return 0;                                                             \
+    }
+
+/**
+ * @brief check the image mapped at @map and pick the reader for its
+ *        geometry.
+ * @return 0 on success, -1 if it is not a single file F439 image of a
+ *         geometry that has an instantiation above.
+ */
+static inline int f439ReaderOpen(F439Reader *r, const void *map,
+                                 size_t length) {
+    const Super *super = (const Super *)map;
+    if (length < F439_BLOCK_SIZE || memcmp(super->magic, "F439", 4) != 0 ||
+        memcmp((const char *)map + sizeof(Super), F439_LAYOUT_MAGIC, 4) == 0) {
+        return -1;
+    }
+    r->base = (const char *)map;
+    r->length = length;
+    r->nBlocks = super->nBlocks;
+    r->root = super->root;
+    imageGeometry(map, &r->blockSize, &r->fatWidth);
+
+    uint64_t fatBlocks = ((uint64_t)r->nBlocks * (r->fatWidth / 8) +
+                          r->blockSize - 1) / r->blockSize;
+    if ((uint64_t)r->nBlocks * r->blockSize > length ||
+        (r->fatWidth == 16 && r->nBlocks > UINT16_MAX + 1u) ||
+        r->root <= fatBlocks || r->root >= r->nBlocks) {
+        return -1;
+    }
+    const uint32_t *rootMetaData =
+        (const uint32_t *)(r->base + (size_t)r->root * r->blockSize);
+    if (rootMetaData[0] != F439_TYPE_DIR ||
+        rootMetaData[1] > r->blockSize - F439_HEADER_SIZE) {
+        return -1;
+    }
+    r->nFiles = rootMetaData[1] / F439_DIRENT_SIZE;
+
+    F439_PICK(512, 32)
+    F439_PICK(1024, 32)
+    F439_PICK(2048, 32)
+    F439_PICK(4096, 32)
+    F439_PICK(512, 16)
+    F439_PICK(1024, 16)
+    F439_PICK(2048, 16)
+    F439_PICK(4096, 16)
+    return -1;
+}
+
+#undef F439_PICK
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,330 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include "async.h"
+#include "f439.h"
+#include "index.h"
+#include "probes.h"
+#include "reader.h"
+#include "shcache.h"
+
+/**
+ * readfs lists the root directory of an F439 image, or copies files out of it
+ * to stdout:
+ *
+ *      readfs [-s /shmName] [-c cacheBlocks] [-u] [-a depth] <image> [file ...]
+ *
+ * Without -s every process decodes the FAT into its own private index. With
+ * -s the index and a block cache live in the named shared memory segment, so
+ * all readers of the same image share one warm copy (see shcache.h). The
+ * first reader creates the segment; -u removes the name when done.
+ *
+ * With -a files are copied out through the asynchronous reader (async.h):
+ * every file is cut into pieces that are all read at once, with up to
+ * @depth requests in flight, and written out in order when all are in.
+ *
+ * Images with another block size or fat width (see convert) are read
+ * through reader.h instead, from a private mapping and without -s.
+ */
+
+
+/* everything needed to read blocks, with or without the shared cache */
+typedef struct {
+    Image img;
+    const Index *index;
+    ShmCache cache;
+    int shared;
+} Reader;
+
+/**
+ * @brief read block @idx, going through the shared cache when there is one.
+ *        Blocks are read with pread() instead of through the mapping so that
+ *        a cache hit really saves an I/O.
+ */
+static int readBlock(Reader *r, uint32_t idx, char *buf) {
+    if (r->shared && shcacheGet(&r->cache, idx, buf)) {
+        F439_PROBE2(read_block, idx, 1);
+        return 0;
+    }
+    F439_PROBE2(read_block, idx, 0);
+    off_t off;
+    int fd = imageBlockFd(&r->img, idx, &off);
+    ssize_t n = pread(fd, buf, F439_BLOCK_SIZE, off);
+    if (n != F439_BLOCK_SIZE) {
+        perror("pread");
+        return -1;
+    }
+    if (r->shared) {
+        shcachePut(&r->cache, idx, buf);
+    }
+    return 0;
+}
+
+static void listFiles(const Index *idx) {
+    IndexFile *files = indexFiles(idx);
+    for (uint32_t i = 0; i < idx->nFiles; i++) {
+        printf("%-12s %10u bytes %6u blocks %4u extents\n", files[i].name,
+               files[i].size, files[i].nBlocks, files[i].nExtents);
+    }
+}
+
+/* a chunked file: the chunk list is read from the mapping, the chunks
+   block by block following the fat */
+static int catChunked(Reader *r, const IndexFile *f) {
+    char buf[F439_BLOCK_SIZE];
+    ChunkCursor c;
+    ChunkRef ref;
+    int more;
+    imageChunkStart(&r->img, f->head, &c);
+    while ((more = imageChunkNext(&r->img, &c, &ref)) > 0) {
+        uint32_t b = ref.start;
+        for (uint32_t done = 0; done < ref.length; done += F439_BLOCK_SIZE) {
+            if (b == 0 || b >= r->img.super->nBlocks || readBlock(r, b, buf) < 0) {
+                fprintf(stderr, "%s: chunk is shorter than its length\n",
+                        f->name);
+                return -1;
+            }
+            uint32_t n = ref.length - done;
+            fwrite(buf, 1, n < F439_BLOCK_SIZE ? n : F439_BLOCK_SIZE, stdout);
+            b = r->img.fat[b];
+        }
+    }
+    if (more < 0) {
+        fprintf(stderr, "%s: corrupted chunk list\n", f->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int catFile(Reader *r, const char *name) {
+    const IndexFile *f = indexLookup(r->index, name);
+    if (f == NULL) {
+        fprintf(stderr, "%s: no such file\n", name);
+        return -1;
+    }
+    if (imageFileType(&r->img, f->head) == F439_TYPE_CHUNKED) {
+        return catChunked(r, f);
+    }
+
+    char buf[F439_BLOCK_SIZE];
+    uint32_t done = 0;
+    while (done < f->size) {
+        uint32_t pos, offset;
+        imageLocate(done, &pos, &offset);
+        uint32_t b = indexBlock(r->index, f, pos);
+        if (b == 0 || readBlock(r, b, buf) < 0) {
+            fprintf(stderr, "%s: chain is shorter than the file\n", name);
+            return -1;
+        }
+        uint32_t n = F439_BLOCK_SIZE - offset;
+        if (n > f->size - done) {
+            n = f->size - done;
+        }
+        fwrite(buf + offset, 1, n, stdout);
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief list or copy out files of an image that is not in the default
+ *        geometry, through the reader specialized for it.
+ * @return the exit status, or -1 if @path has the default geometry and is
+ *         left to imageOpen().
+ */
+static int readGeometry(const char *path, char **names, int nNames) {
+    char block0[F439_BLOCK_SIZE];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || pread(fd, block0, sizeof(block0), 0) != sizeof(block0)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;  /* imageOpen() reports it */
+    }
+    uint32_t blockSize, fatWidth;
+    imageGeometry(block0, &blockSize, &fatWidth);
+    if (blockSize == F439_BLOCK_SIZE && fatWidth == 32) {
+        close(fd);
+        return -1;
+    }
+
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    F439Reader r;
+    if (map == MAP_FAILED || f439ReaderOpen(&r, map, st.st_size) < 0) {
+        fprintf(stderr, "%s: cannot read %u byte blocks with %u bit fat "
+                        "entries\n", path, blockSize, fatWidth);
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+        return 1;
+    }
+
+    int rc = 0;
+    F439File f;
+    for (uint32_t k = 0; nNames == 0 && k < r.nFiles; k++) {
+        if (r.file(&r, k, &f) == 0) {
+            printf("%-12s %10u bytes\n", f.name, f.size);
+        }
+    }
+    for (int k = 0; k < nNames; k++) {
+        if (r.lookup(&r, names[k], &f) < 0) {
+            fprintf(stderr, "%s: no such file\n", names[k]);
+            rc = 1;
+            continue;
+        }
+        static char buf[1 << 16];
+        uint64_t done = 0;
+        long n;
+        while ((n = r.read(&r, &f, done, buf, sizeof(buf))) > 0) {
+            fwrite(buf, 1, n, stdout);
+            done += n;
+        }
+        if (n < 0) {
+            fprintf(stderr, "%s: chain is shorter than the file\n", names[k]);
+            rc = 1;
+        }
+    }
+    munmap(map, st.st_size);
+    return rc;
+}
+
+/* one piece of a file read with -a */
+typedef struct {
+    long result;
+    size_t length;
+} Piece;
+
+static void pieceDone(void *arg, long result) {
+    ((Piece *)arg)->result = result;
+}
+
+static int catAsync(AsyncReader *ar, const IndexFile *f, const char *name) {
+    const size_t pieceSize = 64 * 1024;
+    size_t nPieces = (f->size + pieceSize - 1) / pieceSize;
+    char *buf = malloc(f->size ? f->size : 1);
+    Piece *pieces = calloc(nPieces ? nPieces : 1, sizeof(Piece));
+    if (buf == NULL || pieces == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(buf);
+        free(pieces);
+        return -1;
+    }
+    int rc = 0;
+    for (size_t k = 0; k < nPieces && rc == 0; k++) {
+        uint64_t offset = k * pieceSize;
+        pieces[k].length = f->size - offset < pieceSize ? f->size - offset
+                                                        : pieceSize;
+        rc = asyncRead(ar, name, offset, buf + offset, pieces[k].length,
+                       pieceDone, &pieces[k]);
+    }
+    if (asyncRun(ar) < 0) {
+        rc = -1;
+    }
+    for (size_t k = 0; k < nPieces && rc == 0; k++) {
+        if (pieces[k].result != (long)pieces[k].length) {
+            fprintf(stderr, "%s: %s\n", name, pieces[k].result < 0
+                    ? strerror(-pieces[k].result) : "short read");
+            rc = -1;
+        }
+    }
+    if (rc == 0) {
+        fwrite(buf, 1, f->size, stdout);
+    }
+    free(buf);
+    free(pieces);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    const char *shmName = NULL;
+    uint32_t cacheBlocks = 4096;
+    int unlinkWhenDone = 0;
+    unsigned depth = 0;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            shmName = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            cacheBlocks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            unlinkWhenDone = 1;
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            depth = atoi(argv[++i]);
+        } else {
+            break;
+        }
+    }
+    if (i >= argc) {
+        fprintf(stderr, "usage: %s [-s /shmName] [-c cacheBlocks] [-u] "
+                        "[-a depth] <image> [file ...]\n", argv[0]);
+        exit(1);
+    }
+
+    int rc = readGeometry(argv[i], argv + i + 1, argc - i - 1);
+    if (rc >= 0) {
+        return rc;
+    }
+
+    Reader r;
+    memset(&r, 0, sizeof(r));
+    const char *imageName = argv[i];
+    if (imageOpen(&r.img, argv[i++], PROT_READ) < 0) {
+        exit(1);
+    }
+
+    if (shmName && shcacheAttach(&r.cache, shmName, &r.img, cacheBlocks) == 0) {
+        r.shared = 1;
+        r.index = r.cache.index;
+    } else {
+        if (shmName) {
+            fprintf(stderr, "falling back to a private index\n");
+        }
+        size_t size = indexSize(&r.img);
+        Index *idx = size ? malloc(size) : NULL;
+        if (idx == NULL || indexBuild(&r.img, idx, size) < 0) {
+            fprintf(stderr, "cannot index the image\n");
+            exit(1);
+        }
+        r.index = idx;
+    }
+
+    rc = 0;
+    if (i == argc) {
+        listFiles(r.index);
+    }
+    AsyncReader *ar = NULL;
+    if (depth && i < argc && (ar = asyncOpen(imageName, depth)) == NULL) {
+        exit(1);
+    }
+    for (; i < argc; i++) {
+        const IndexFile *f = ar ? indexLookup(r.index, argv[i]) : NULL;
+        if (ar && f && imageFileType(&r.img, f->head) == F439_TYPE_FILE) {
+            rc |= catAsync(ar, f, argv[i]) < 0;
+        } else if (catFile(&r, argv[i]) < 0) {
+            rc = 1;
+        }
+    }
+    if (ar) {
+        asyncClose(ar);
+    }
+
+    if (r.shared) {
+        uint64_t hits, misses;
+        shcacheStats(&r.cache, &hits, &misses);
+        fprintf(stderr, "shared cache: %lu hits, %lu misses\n",
+                (unsigned long)hits, (unsigned long)misses);
+        shcacheDetach(&r.cache);
+        if (unlinkWhenDone) {
+            shcacheUnlink(shmName);
+        }
+    } else {
+        free((void *)r.index);
+    }
+    imageClose(&r.img);
+    return rc;
+}
@@ -0,0 +1,200 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdlib.h>
+#include "rmap.h"
+
+/**
+ * The map is ranked over the files, the chunks, the root directory and the
+ * free list all at once (rankChains() takes any set of heads); the last two
+ * are then folded into RMAP_META and RMAP_FREE.
+ */
+
+
+uint64_t rmapHash(const Image *img) {
+    uint64_t h = 0x439f439f439f439full;
+    const uint32_t *fat = img->fat;
+    uint32_t n = img->super->nBlocks;
+    for (uint32_t b = 0; b < n; b++) {
+        h = (h ^ fat[b]) * 0x100000001b3ull;
+        h ^= h >> 29;
+    }
+    const uint32_t *root = (const uint32_t *)imageToPtr(img, img->super->root,
+                                                        0);
+    for (uint32_t k = 0; k < F439_BLOCK_SIZE / sizeof(uint32_t); k++) {
+        h = (h ^ root[k]) * 0x100000001b3ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static int byValue(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief the first blocks of the files, then of the distinct chunks.
+ * @return the number of heads (into *@heads), or -1 if out of memory.
+ */
+static long collectHeads(const Image *img, uint32_t **heads,
+                         uint32_t *nFiles) {
+    *nFiles = imageDirCount(img);
+    size_t cap = *nFiles + 64, n = 0;
+    *heads = malloc(cap * sizeof(uint32_t));
+    if (*heads == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < *nFiles; i++) {
+        (*heads)[n++] = imageDirEntry(img, i)->start;
+    }
+    for (uint32_t i = 0; i < *nFiles; i++) {
+        uint32_t start = (*heads)[i];
+        if (start == 0 || start >= img->super->nBlocks ||
+            imageFileType(img, start) != F439_TYPE_CHUNKED) {
+            continue;
+        }
+        ChunkCursor c;
+        ChunkRef ref;
+        imageChunkStart(img, start, &c);
+        while (imageChunkNext(img, &c, &ref) > 0) {
+            if (n == cap) {
+                cap *= 2;
+                uint32_t *more = realloc(*heads, cap * sizeof(uint32_t));
+                if (more == NULL) {
+                    free(*heads);
+                    return -1;
+                }
+                *heads = more;
+            }
+            (*heads)[n++] = ref.start;
+        }
+    }
+
+    /* chunks are shared between files; each one is an owner once */
+    uint32_t *chunks = *heads + *nFiles;
+    size_t nChunks = n - *nFiles;
+    qsort(chunks, nChunks, sizeof(uint32_t), byValue);
+    size_t k = 0;
+    for (size_t i = 0; i < nChunks; i++) {
+        if (k == 0 || chunks[i] != chunks[k - 1]) {
+            chunks[k++] = chunks[i];
+        }
+    }
+    return *nFiles + k;
+}
+
+int rmapBuild(const Image *img, Rmap *m, int nThreads) {
+    memset(m, 0, sizeof(*m));
+    uint32_t *heads;
+    long nOwners = collectHeads(img, &heads, &m->nFiles);
+    if (nOwners < 0) {
+        return -1;
+    }
+    uint32_t nBlocks = img->super->nBlocks;
+    uint32_t *all = realloc(heads, (nOwners + 2) * sizeof(uint32_t));
+    if (all == NULL) {
+        free(heads);
+        return -1;
+    }
+    heads = all;
+    uint32_t nHeads = nOwners;
+    heads[nHeads++] = img->super->root;
+    if (img->super->avail != 0) {
+        heads[nHeads++] = img->super->avail;
+    }
+
+    m->nBlocks = nBlocks;
+    m->nOwners = nOwners;
+    m->heads = heads;
+    m->owner = malloc((size_t)nBlocks * sizeof(uint32_t));
+    m->pos = malloc((size_t)nBlocks * sizeof(uint32_t));
+    if (m->owner == NULL || m->pos == NULL ||
+        rankChains(img, heads, nHeads, m->owner, m->pos, nThreads) < 0) {
+        rmapFree(m);
+        return -1;
+    }
+
+    uint32_t first = imageFirstData(nBlocks);
+    for (uint32_t b = 0; b < nBlocks; b++) {
+        uint32_t o = m->owner[b];
+        if (b < first || o == (uint32_t)nOwners) {
+            m->owner[b] = RMAP_META;
+            m->pos[b] = 0;
+        } else if (o == (uint32_t)nOwners + 1) {
+            m->owner[b] = RMAP_FREE;
+        }
+    }
+    m->fatHash = rmapHash(img);
+    return 0;
+}
+
+void rmapPath(const char *imageName, char *buf, size_t size) {
+    snprintf(buf, size, "%s.rmap", imageName);
+}
+
+int rmapSave(const Rmap *m, const char *path, FILE *err) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(err, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    RmapHeader h;
+    memcpy(h.magic, RMAP_MAGIC, 4);
+    h.nBlocks = m->nBlocks;
+    h.nOwners = m->nOwners;
+    h.nFiles = m->nFiles;
+    h.fatHash = m->fatHash;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(m->heads, sizeof(uint32_t), m->nOwners, f) == m->nOwners &&
+             fwrite(m->owner, sizeof(uint32_t), m->nBlocks, f) == m->nBlocks &&
+             fwrite(m->pos, sizeof(uint32_t), m->nBlocks, f) == m->nBlocks;
+    if (fclose(f) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(err, "%s: cannot write the reverse map\n", path);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+int rmapLoad(const Image *img, Rmap *m, const char *path) {
+    memset(m, 0, sizeof(*m));
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    RmapHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 ||
+        memcmp(h.magic, RMAP_MAGIC, 4) != 0 ||
+        h.nBlocks != img->super->nBlocks || h.nFiles > h.nOwners ||
+        h.fatHash != rmapHash(img)) {
+        fclose(f);
+        return -1;
+    }
+    m->nBlocks = h.nBlocks;
+    m->nOwners = h.nOwners;
+    m->nFiles = h.nFiles;
+    m->fatHash = h.fatHash;
+    m->heads = malloc((h.nOwners + 1) * sizeof(uint32_t));
+    m->owner = malloc((size_t)h.nBlocks * sizeof(uint32_t));
+    m->pos = malloc((size_t)h.nBlocks * sizeof(uint32_t));
+    int ok = m->heads && m->owner && m->pos &&
+             fread(m->heads, sizeof(uint32_t), h.nOwners, f) == h.nOwners &&
+             fread(m->owner, sizeof(uint32_t), h.nBlocks, f) == h.nBlocks &&
+             fread(m->pos, sizeof(uint32_t), h.nBlocks, f) == h.nBlocks;
+    fclose(f);
+    if (!ok) {
+        rmapFree(m);
+        return -1;
+    }
+    return 0;
+}
+
+void rmapFree(Rmap *m) {
+    free(m->heads);
+    free(m->owner);
+    free(m->pos);
+    m->heads = m->owner = m->pos = NULL;
+}
@@ -0,0 +1,85 @@
+#ifndef RMAP_H
+#define RMAP_H
+
+#include <stdint.h>
+#include "f439.h"
+#include "rank.h"
+
+/**
+ * The reverse map of an image: for every block, the chain that owns it and
+ * the block's position in that chain, so that finding who uses a block is
+ * one array lookup instead of a walk over every chain.
+ *
+ * Owners are numbered: first the files of the root directory, in directory
+ * order, then the chunks of chunked files, in block order. @heads gives the
+ * first block of every owner. Blocks outside any of them are marked with
+ * one of the RMAP_ values.
+ *
+ * It is built with one parallel list ranking pass over the fat (rank.h),
+ * and can be saved next to the image as <image>.rmap (mkfs --rmap does so
+ * right after building it):
+ *
+ *      | RmapHeader | heads[nOwners] | owner[nBlocks] | pos[nBlocks] |
+ *
+ * The header carries a hash of the fat and the root directory, so a map
+ * that no longer matches its image is noticed when it is loaded.
+ */
+
+#define RMAP_MAGIC "RMP1"
+
+#define RMAP_NONE 0xffffffffu   /* in no chain: an orphan, or in a cycle */
+#define RMAP_FREE 0xfffffffeu   /* on the free list */
+#define RMAP_META 0xfffffffdu   /* super block, fat or root directory */
+
+typedef struct {
+    char magic[4];
+    uint32_t nBlocks;
+    uint32_t nOwners;
+    uint32_t nFiles;     /* owners [0, nFiles) are files, the rest chunks */
+    uint64_t fatHash;
+} RmapHeader;
+
+typedef struct {
+    uint32_t nBlocks;
+    uint32_t nOwners;
+    uint32_t nFiles;
+    uint64_t fatHash;
+    uint32_t *heads;     /* [nOwners] */
+    uint32_t *owner;     /* [nBlocks]: owner id or RMAP_ */
+    uint32_t *pos;       /* [nBlocks]: position in the owner's chain */
+} Rmap;
+
+/* a hash of the fat and the root directory of @img */
+uint64_t rmapHash(const Image *img);
+
+/**
+ * @brief build the reverse map of @img with @nThreads threads.
+ * @return 0, or -1 if out of memory.
+ */
+int rmapBuild(const Image *img, Rmap *m, int nThreads);
+
+/* "<imageName>.rmap" */
+void rmapPath(const char *imageName, char *buf, size_t size);
+
+/* @return 0, or -1 with an error message on @err */
+int rmapSave(const Rmap *m, const char *path, FILE *err);
+
+/**
+ * @brief load the map saved at @path for @img.
+ * @return 0, or -1 if it cannot be read or belongs to another version of
+ *         the image.
+ */
+int rmapLoad(const Image *img, Rmap *m, const char *path);
+
+void rmapFree(Rmap *m);
+
+/* byte offset, within its file or chunk, of the data of block @b */
+static inline uint64_t rmapOffset(const Rmap *m, uint32_t b) {
+    if (m->owner[b] >= m->nFiles) {
+        /* chunks have no header */
+        return (uint64_t)m->pos[b] * F439_BLOCK_SIZE;
+    }
+    return rankOffset(m->pos[b]);
+}
+
+#endif
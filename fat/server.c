@@ -0,0 +1,356 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "mkfs.h"
+
+/**
+ * A long running mkfs that builds images on request, so that callers who
+ * build thousands of images a day pay for process startup and cold caches
+ * once. Jobs arrive over a Unix stream socket as lines of text:
+ *
+ *      image <path>
+ *      blocks <nBlocks>
+ *      option <word>          (once per word of the options, in order)
+ *      file <path>            (once per input file, in directory order)
+ *      build
+ *
+ * The option words are parsed like the options on the mkfs command line,
+ * so a job can ask for -j, --cdc, --stripes and the rest. The I/O limits
+ * and priorities are the exception: they apply to the whole server and are
+ * given when it starts. The FileCache serves plain builds, which go through
+ * oneFile(); a job whose options call for another ingest path, or for what
+ * only the pipeline does (--decompress, --checksums, --stats), reads its
+ * inputs there instead.
+ *
+ * and the server answers with one line per file placed, followed by either
+ *
+ *      progress <i> <nFiles> <path>
+ *      done <nFiles> files <ms> ms cache <hits> hits <misses> misses <bytes> bytes
+ *      failed
+ *
+ * Error messages of a failed build are sent to the client before "failed".
+ * Jobs are served one at a time; what carries over from one job to the next
+ * is the FileCache (unchanged inputs are not read again) and the job
+ * buffers. Paths are used as given, so clients should send absolute paths;
+ * submitBuild() does that for you, for the option arguments as well.
+ */
+
+#define LINE_MAX_LEN 4096
+
+
+typedef struct {
+    char **items;
+    int n;
+    int cap;
+} StringList;
+
+/* the request being received; reused from one job to the next */
+typedef struct {
+    char *imageName;
+    uint32_t nBlocks;
+    StringList files;
+    StringList options;
+} Job;
+
+static void listClear(StringList *list) {
+    for (int i = 0; i < list->n; i++) {
+        free(list->items[i]);
+    }
+    list->n = 0;
+}
+
+static void jobReset(Job *job) {
+    free(job->imageName);
+    job->imageName = NULL;
+    listClear(&job->files);
+    listClear(&job->options);
+    job->nBlocks = 0;
+}
+
+static int listAdd(StringList *list, const char *s) {
+    if (list->n == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 32;
+        char **p = realloc(list->items, cap * sizeof(char *));
+        if (p == NULL) {
+            return -1;
+        }
+        list->items = p;
+        list->cap = cap;
+    }
+    list->items[list->n] = strdup(s);
+    return list->items[list->n++] ? 0 : -1;
+}
+
+/**
+ * @brief build what @job describes, answering on @out.
+ * @return 0 on success, -1 on failure.
+ */
+static int jobBuild(Job *job, FileCache *cache, FILE *out) {
+    BuildSpec spec;
+    BuildOptions opts;
+    optionsInit(&spec, &opts);
+    int nWords = job->options.n;
+    const char **words = (const char **)job->options.items;
+    for (int i = 0; i < nWords; i++) {
+        BuildOptions limits;
+        int at = i;
+        if (limitOptionParse(nWords, words, &at, &limits) == 0) {
+            fprintf(out, "%s is set when the server starts\n", words[i]);
+            return -1;
+        }
+        if (optionParse(nWords, words, &i, &spec, &opts) < 0) {
+            fprintf(out, "bad option: %s\n", words[i]);
+            return -1;
+        }
+    }
+    if (job->imageName == NULL) {
+        fprintf(out, "no image\n");
+        return -1;
+    }
+    spec.imageName = job->imageName;
+    spec.nBlocks = job->nBlocks;
+    spec.fileNames = (const char **)job->files.items;
+    spec.nFiles = job->files.n;
+    spec.cache = cache;
+    spec.progress = out;
+    /* what the command line prints goes to the client */
+    if (spec.checksums) {
+        spec.checksums = out;
+    }
+    if (spec.stats) {
+        spec.stats = out;
+    }
+    if (optionsApply(&spec, &opts) < 0) {
+        return -1;
+    }
+    int rc = buildImage(&spec);
+    optionsRelease(&spec);
+    return rc;
+}
+
+/**
+ * @brief read requests from one client until it hangs up; every "build"
+ *        line builds what was described since the previous one.
+ */
+static void serveClient(int fd, Job *job, FileCache *cache) {
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    if (in == NULL || out == NULL) {
+        perror("fdopen");
+        if (in) {
+            fclose(in);
+        } else {
+            close(fd);
+        }
+        if (out) {
+            fclose(out);
+        }
+        return;
+    }
+
+    char line[LINE_MAX_LEN];
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "image ", 6) == 0) {
+            free(job->imageName);
+            job->imageName = strdup(line + 6);
+        } else if (strncmp(line, "blocks ", 7) == 0) {
+            job->nBlocks = strtoul(line + 7, NULL, 10);
+        } else if (strncmp(line, "file ", 5) == 0 ||
+                   strncmp(line, "option ", 7) == 0) {
+            int isFile = line[0] == 'f';
+            if (listAdd(isFile ? &job->files : &job->options,
+                        line + (isFile ? 5 : 7)) < 0) {
+                fprintf(out, "out of memory\nfailed\n");
+                break;
+            }
+        } else if (strcmp(line, "build") == 0) {
+            /* the client sees why its build failed, not the server log */
+            mkfsErr = out;
+            int rc = jobBuild(job, cache, out);
+            mkfsErr = stderr;
+            if (rc < 0) {
+                fprintf(out, "failed\n");
+            }
+            fflush(out);
+            jobReset(job);
+        } else {
+            fprintf(out, "unknown request: %s\nfailed\n", line);
+            fflush(out);
+        }
+    }
+    jobReset(job);
+    fclose(in);
+    fclose(out);
+}
+
+/**
+ * @brief remove the socket a previous server left behind at @socketPath;
+ *        anything else there, including a socket a server still listens
+ *        on, is left alone.
+ * @return 0 if the path is free now, -1 if not.
+ */
+static int removeStale(const char *socketPath, const struct sockaddr_un *addr) {
+    struct stat st;
+    if (lstat(socketPath, &st) < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror(socketPath);
+        return -1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "%s: exists and is not a socket\n", socketPath);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int live = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0;
+    close(fd);
+    if (live) {
+        fprintf(stderr, "%s: a server is running there\n", socketPath);
+        return -1;
+    }
+    if (unlink(socketPath) < 0) {
+        perror(socketPath);
+        return -1;
+    }
+    return 0;
+}
+
+int serveBuilds(const char *socketPath, size_t cacheLimit) {
+    struct sockaddr_un addr;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+
+    if (removeStale(socketPath, &addr) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 16) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    /* a client going away mid-build must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+    mkfsErr = stderr;
+
+    Job job;
+    memset(&job, 0, sizeof(job));
+    FileCache cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.limit = cacheLimit;
+
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        serveClient(client, &job, &cache);
+    }
+
+    cacheClear(&cache);
+    free(job.files.items);
+    free(job.options.items);
+    close(fd);
+    return -1;
+}
+
+/* write @path to @out, made absolute against the current directory */
+static void putPath(FILE *out, const char *key, const char *path) {
+    if (path[0] == '/') {
+        fprintf(out, "%s %s\n", key, path);
+        return;
+    }
+    char cwd[LINE_MAX_LEN];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, ".");
+    }
+    fprintf(out, "%s %s/%s\n", key, cwd, path);
+}
+
+/* does the option @name take a path, which the server needs absolute */
+static int takesPath(const char *name) {
+    return strcmp(name, "--checkpoint") == 0 || strcmp(name, "--prev") == 0 ||
+           strcmp(name, "--phases") == 0;
+}
+
+int submitBuild(const char *socketPath, const char **options, int nOptions,
+                const char *imageName, uint32_t nBlocks,
+                const char **fileNames, int nFiles) {
+    struct sockaddr_un addr;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return -1;
+    }
+    FILE *out = fdopen(dup(fd), "w");
+    FILE *in = fdopen(fd, "r");
+
+    putPath(out, "image", imageName);
+    fprintf(out, "blocks %u\n", nBlocks);
+    for (int i = 0; i < nOptions; i++) {
+        /* a --hot without a '/' matches the base name of an input */
+        int path = i > 0 && (takesPath(options[i - 1]) ||
+                             (strcmp(options[i - 1], "--hot") == 0 &&
+                              strchr(options[i], '/')));
+        if (path) {
+            putPath(out, "option", options[i]);
+        } else {
+            fprintf(out, "option %s\n", options[i]);
+        }
+    }
+    for (int i = 0; i < nFiles; i++) {
+        putPath(out, "file", fileNames[i]);
+    }
+    fprintf(out, "build\n");
+    fclose(out);
+
+    /* relay what the server says until the build finishes */
+    int rc = -1;
+    char line[LINE_MAX_LEN];
+    while (fgets(line, sizeof(line), in)) {
+        fputs(line, stderr);
+        if (strncmp(line, "done ", 5) == 0) {
+            rc = 0;
+            break;
+        } else if (strcmp(line, "failed\n") == 0) {
+            break;
+        }
+    }
+    fclose(in);
+    return rc;
+}
@@ -0,0 +1,268 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <signal.h>    /* kill() */
+#include <stdatomic.h>
+#include <time.h>      /* nanosleep() */
+#include <unistd.h>
+#include "shcache.h"
+
+#define SHM_MAGIC 0x34394853 /* "SH94" */
+
+enum {
+    SHM_EMPTY = 0,    /* segment created, nothing in it yet */
+    SHM_BUILDING = 1, /* the creator is decoding the image */
+    SHM_READY = 2,    /* index published; read-only from now on */
+};
+
+/**
+ * Identity of the image the segment was built from. A segment that outlived
+ * its image (the image was rebuilt with the same name) must not be used.
+ */
+struct ShmHeader {
+    uint32_t magic;
+    _Atomic uint32_t state;
+    _Atomic int32_t creator;  /* pid of the process building the index */
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t indexOffset;
+    uint64_t slotsOffset;
+    uint32_t nSlots;
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+};
+
+/**
+ * One cache slot. @seq is even when the slot is stable and odd while a writer
+ * fills it. A reader copies the data and then checks that @seq did not move;
+ * a writer claims the slot by bumping @seq from even to odd with a CAS, and
+ * simply gives up if someone else got there first.
+ */
+struct ShmSlot {
+    _Atomic uint32_t seq;
+    _Atomic uint32_t tag;  /* 1 + block index stored in the slot, 0 if none */
+    char data[F439_BLOCK_SIZE];
+};
+
+
+static void fillIdentity(ShmHeader *h, const struct stat *st) {
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->size = st->st_size;
+    h->mtimeSec = st->st_mtim.tv_sec;
+    h->mtimeNsec = st->st_mtim.tv_nsec;
+}
+
+static int sameIdentity(const ShmHeader *h, const struct stat *st) {
+    return h->dev == (uint64_t)st->st_dev && h->ino == (uint64_t)st->st_ino &&
+           h->size == st->st_size && h->mtimeSec == st->st_mtim.tv_sec &&
+           h->mtimeNsec == st->st_mtim.tv_nsec;
+}
+
+static void pause1ms(void) {
+    struct timespec ts = {0, 1000000};
+    nanosleep(&ts, NULL);
+}
+
+static int mapSegment(ShmCache *c, int fd, size_t length) {
+    void *p = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap shm");
+        return -1;
+    }
+    c->header = (ShmHeader *)p;
+    c->length = length;
+    return 0;
+}
+
+static void finishAttach(ShmCache *c) {
+    char *base = (char *)c->header;
+    c->index = (const Index *)(base + c->header->indexOffset);
+    c->slots = (ShmSlot *)(base + c->header->slotsOffset);
+    c->nSlots = c->header->nSlots;
+}
+
+/**
+ * @brief create the segment and publish the index in it. Only one process
+ *        gets here for a given name, thanks to O_EXCL.
+ */
+static int createSegment(ShmCache *c, int fd, const Image *img,
+                         const struct stat *st, uint32_t nSlots) {
+    size_t indexBytes = indexSize(img);
+    if (indexBytes == 0) {
+        fprintf(stderr, "corrupted image, cannot index it\n");
+        return -1;
+    }
+    size_t indexOffset = (sizeof(ShmHeader) + 63) & ~(size_t)63;
+    size_t slotsOffset = (indexOffset + indexBytes + 63) & ~(size_t)63;
+    size_t length = slotsOffset + (size_t)nSlots * sizeof(ShmSlot);
+
+    /* the new segment is zero-filled, so every slot starts out empty with an
+       even sequence number and state is SHM_EMPTY */
+    if (ftruncate(fd, length) < 0) {
+        perror("ftruncate shm");
+        return -1;
+    }
+    if (mapSegment(c, fd, length) < 0) {
+        return -1;
+    }
+
+    ShmHeader *h = c->header;
+    atomic_store(&h->creator, (int32_t)getpid());
+    atomic_store(&h->state, SHM_BUILDING);
+    h->magic = SHM_MAGIC;
+    fillIdentity(h, st);
+    h->indexOffset = indexOffset;
+    h->slotsOffset = slotsOffset;
+    h->nSlots = nSlots;
+    if (indexBuild(img, (Index *)((char *)h + indexOffset), indexBytes) < 0) {
+        fprintf(stderr, "corrupted image, cannot index it\n");
+        munmap(c->header, c->length);
+        return -1;
+    }
+
+    /* release: the index must be visible before anyone sees SHM_READY */
+    atomic_store_explicit(&h->state, SHM_READY, memory_order_release);
+    finishAttach(c);
+    return 0;
+}
+
+/* is the process that builds the index of @h gone */
+static int creatorDied(ShmHeader *h) {
+    pid_t pid = atomic_load(&h->creator);
+    return atomic_load(&h->state) == SHM_BUILDING && pid > 0 &&
+           kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/**
+ * @brief map a segment somebody else created, waiting until it is sized and
+ *        its index is published.
+ * @return 0, -1 if it cannot be used, -2 if it never will be: its creator
+ *         died, or did not finish in time.
+ */
+static int openSegment(ShmCache *c, int fd, const struct stat *st) {
+    struct stat sst;
+    for (int tries = 0;; tries++) {
+        if (fstat(fd, &sst) < 0) {
+            perror("fstat shm");
+            return -1;
+        }
+        if ((size_t)sst.st_size >= sizeof(ShmHeader)) {
+            break;
+        }
+        if (tries == 5000) {
+            fprintf(stderr, "shared cache was never initialized\n");
+            return -2;
+        }
+        pause1ms(); /* the creator has not called ftruncate() yet */
+    }
+    if (mapSegment(c, fd, sst.st_size) < 0) {
+        return -1;
+    }
+
+    ShmHeader *h = c->header;
+    for (int tries = 0; atomic_load_explicit(&h->state, memory_order_acquire)
+                        != SHM_READY; tries++) {
+        if (tries == 5000 || creatorDied(h)) {
+            fprintf(stderr, "shared cache was never initialized\n");
+            munmap(c->header, c->length);
+            return -2;
+        }
+        pause1ms();
+    }
+    if (h->magic != SHM_MAGIC || !sameIdentity(h, st)) {
+        fprintf(stderr, "shared cache belongs to another image\n");
+        munmap(c->header, c->length);
+        return -1;
+    }
+    finishAttach(c);
+    return 0;
+}
+
+int shcacheAttach(ShmCache *c, const char *name, const Image *img,
+                  uint32_t nSlots) {
+    struct stat st;
+    if (fstat(img->fd, &st) < 0) {
+        perror("fstat");
+        return -1;
+    }
+
+    /* a segment that will never be ready is dropped, and built anew once */
+    int rc = -2;
+    for (int attempt = 0; rc == -2 && attempt < 2; attempt++) {
+        int created = 1;
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            created = 0;
+            fd = shm_open(name, O_RDWR, 0600);
+        }
+        if (fd < 0) {
+            perror("shm_open");
+            return -1;
+        }
+
+        if (created) {
+            rc = createSegment(c, fd, img, &st, nSlots ? nSlots : 1);
+            if (rc < 0) {
+                shm_unlink(name); /* do not leave a half built segment */
+            }
+        } else {
+            rc = openSegment(c, fd, &st);
+            if (rc == -2) {
+                shm_unlink(name);
+            }
+        }
+        close(fd); /* the mapping keeps the segment alive */
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+void shcacheDetach(ShmCache *c) {
+    munmap(c->header, c->length);
+}
+
+int shcacheUnlink(const char *name) {
+    if (shm_unlink(name) < 0) {
+        perror("shm_unlink");
+        return -1;
+    }
+    return 0;
+}
+
+int shcacheGet(ShmCache *c, uint32_t idx, void *buf) {
+    ShmSlot *s = &c->slots[idx % c->nSlots];
+    uint32_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+    if ((seq & 1) == 0 &&
+        atomic_load_explicit(&s->tag, memory_order_relaxed) == idx + 1) {
+        memcpy(buf, s->data, F439_BLOCK_SIZE);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->seq, memory_order_relaxed) == seq) {
+            atomic_fetch_add_explicit(&c->header->hits, 1,
+                                      memory_order_relaxed);
+            return 1;
+        }
+    }
+    atomic_fetch_add_explicit(&c->header->misses, 1, memory_order_relaxed);
+    return 0;
+}
+
+void shcachePut(ShmCache *c, uint32_t idx, const void *buf) {
+    ShmSlot *s = &c->slots[idx % c->nSlots];
+    uint32_t seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    if ((seq & 1) ||
+        !atomic_compare_exchange_strong_explicit(&s->seq, &seq, seq + 1,
+                                                 memory_order_acquire,
+                                                 memory_order_relaxed)) {
+        return; /* another process is filling this slot */
+    }
+    atomic_store_explicit(&s->tag, idx + 1, memory_order_relaxed);
+    memcpy(s->data, buf, F439_BLOCK_SIZE);
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+}
+
+void shcacheStats(const ShmCache *c, uint64_t *hits, uint64_t *misses) {
+    *hits = atomic_load(&c->header->hits);
+    *misses = atomic_load(&c->header->misses);
+}
@@ -0,0 +1,67 @@
+#ifndef SHCACHE_H
+#define SHCACHE_H
+
+#include <stdint.h>
+#include "f439.h"
+#include "index.h"
+
+/**
+ * A shared memory segment (shm_open()) that lets several processes reading
+ * the same image share one decoded index and one block cache, instead of
+ * every process decoding the FAT and warming its own cache.
+ *
+ * | ShmHeader | Index blob | ShmSlot slots[nSlots] |
+ *
+ * The first process to attach creates the segment and builds the index in
+ * it; everyone else waits until it is published. After that nobody takes a
+ * lock: the index is immutable, and every cache slot is guarded by its own
+ * sequence counter (a seqlock), see shcache.c. A segment whose creator died
+ * before publishing the index is removed by the next process to attach,
+ * which then builds it again.
+ *
+ * The segment is created with mode 0600, because readers trust the index
+ * and the cached blocks in it: only processes of the user who created it
+ * can attach, and others fall back to a private index. To share it between
+ * users, run the readers under one account, or chmod /dev/shm/<name>,
+ * which lets those users alter what every reader sees.
+ */
+
+typedef struct ShmHeader ShmHeader;
+typedef struct ShmSlot ShmSlot;
+
+typedef struct {
+    ShmHeader *header;
+    size_t length;       /* size of the whole mapping */
+    const Index *index;  /* decoded metadata, inside the segment */
+    ShmSlot *slots;      /* block cache, inside the segment */
+    uint32_t nSlots;
+} ShmCache;
+
+/**
+ * @brief attach to (or create) the segment @name for the image @img.
+ * @param nSlots number of 512-byte cache slots, used only when creating
+ * @return 0 on success, -1 if the segment cannot be used (for example it
+ *         belongs to a different image); the caller may fall back to a
+ *         private index.
+ */
+int shcacheAttach(ShmCache *c, const char *name, const Image *img,
+                  uint32_t nSlots);
+
+void shcacheDetach(ShmCache *c);
+
+/* remove the segment name; attached processes keep their mapping */
+int shcacheUnlink(const char *name);
+
+/**
+ * @brief copy block @idx into @buf if it is cached.
+ * @return 1 on a hit, 0 on a miss (including a slot being written right now).
+ */
+int shcacheGet(ShmCache *c, uint32_t idx, void *buf);
+
+/* offer block @idx to the cache; silently skipped if the slot is busy */
+void shcachePut(ShmCache *c, uint32_t idx, const void *buf);
+
+/* hit/miss counters shared by all attached processes */
+void shcacheStats(const ShmCache *c, uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include "mkfs.h"
+
+/**
+ * The order the inputs are read in (mkfs --source-order). Reading them in
+ * argv order jumps all over a spinning source disk; sorted by inode number
+ * they come roughly in the order they were created, and sorted by the
+ * physical address of their first extent (FIEMAP) in the order they lie on
+ * the disk, so the reads become mostly sequential. Only the reading is
+ * reordered: every file keeps the directory slot of its place in argv.
+ *
+ * Files on a file system without FIEMAP (tmpfs, NFS, ...), or without any
+ * extent yet, are sorted by inode after those that have one. Inputs that
+ * cannot be stat'ed go last and fail when they are read.
+ */
+
+typedef struct {
+    dev_t dev;
+    int mapped;         /* 0: @key is the physical address, 1: the inode */
+    uint64_t key;
+    int index;          /* in argv order */
+} SourceKey;
+
+
+static int bySource(const void *a, const void *b) {
+    const SourceKey *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->mapped != y->mapped) {
+        return x->mapped - y->mapped;
+    }
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+/* the physical byte address of the first extent of @fd; @return 0 if none */
+static int firstExtent(int fd, uint64_t *physical) {
+    union {
+        struct fiemap map;
+        char space[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } u;
+    memset(&u, 0, sizeof(u));
+    u.map.fm_start = 0;
+    u.map.fm_length = FIEMAP_MAX_OFFSET;
+    u.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &u.map) < 0 || u.map.fm_mapped_extents == 0) {
+        return 0;
+    }
+    /* delayed allocation has no address yet; inline data has no own one */
+    if (u.map.fm_extents[0].fe_flags &
+        (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+         FIEMAP_EXTENT_DATA_INLINE)) {
+        return 0;
+    }
+    *physical = u.map.fm_extents[0].fe_physical;
+    return 1;
+}
+
+int sourceOrder(const BuildSpec *spec, int how, int *order) {
+    SourceKey *keys = malloc((spec->nFiles ? spec->nFiles : 1) *
+                             sizeof(SourceKey));
+    if (keys == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < spec->nFiles; i++) {
+        SourceKey *k = &keys[i];
+        struct stat st;
+        k->index = i;
+        k->mapped = 1;
+        int fd = open(spec->fileNames[i], O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            k->dev = (dev_t)-1;
+            k->key = 0;
+        } else {
+            k->dev = st.st_dev;
+            k->key = st.st_ino;
+            if (how == SOURCE_ORDER_FIEMAP && firstExtent(fd, &k->key)) {
+                k->mapped = 0;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    qsort(keys, spec->nFiles, sizeof(SourceKey), bySource);
+    for (int i = 0; i < spec->nFiles; i++) {
+        order[i] = keys[i].index;
+    }
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mkfs.h"
+#include "probes.h"
+
+/**
+ * A striped image (mkfs --stripes <n> [--stripe-kb <kb>]) spreads its data
+ * blocks over n backing files in units of --stripe-kb, RAID-0 style, so
+ * that building and reading it is not limited to the bandwidth of one disk:
+ *
+ *      image        super block, fat (and the layout in block 0)
+ *      image.s0     units 0, n, 2n, ...
+ *      image.s1     units 1, n+1, 2n+1, ...
+ *
+ * Put the backing files on different disks by creating them beforehand as
+ * symbolic links; mkfs opens them without replacing the links.
+ *
+ * A tiered image (tier.c) is created the same way, with one backing file.
+ *
+ * Everything that goes through imageToPtr() sees one image as before. The
+ * files are placed by the same ingest paths as without stripes (one writer,
+ * or one per region with -j, each region spread over all the stripes);
+ * their writes land in the page cache of each backing file, and only the
+ * flush is parallel per disk: syncImage() writes all of them back at the
+ * same time, one thread per file, so every disk writes its share at once.
+ */
+
+
+typedef struct {
+    char *map;
+    size_t length;
+    int failed;
+} SyncJob;
+
+int createBacking(Image *img, const char *imageName) {
+    const Layout *l = imageLayout(img);
+    off_t length = (off_t)imageStripeBlocks(img->super->nBlocks, l) *
+                   F439_BLOCK_SIZE;
+    for (uint32_t k = 0; k < l->nStripes; k++) {
+        char path[4096];
+        imageBackingName(imageName, l, k, path, sizeof(path));
+        int fd = open(path, O_CREAT | O_RDWR, 0666);
+        if (fd < 0 || ftruncate(fd, length) < 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        close(fd);
+    }
+    return imageMapBacking(img, imageName, PROT_READ | PROT_WRITE);
+}
+
+static void *syncThread(void *arg) {
+    SyncJob *job = arg;
+    if (msync(job->map, job->length, MS_SYNC) < 0) {
+        perror("msync");
+        job->failed = 1;
+    }
+    return NULL;
+}
+
+int syncImage(Image *img) {
+    uint32_t n = 1 + img->nBacking;
+    F439_PROBE1(sync_start, n);
+    SyncJob *jobs = calloc(n, sizeof(SyncJob));
+    pthread_t *threads = malloc(n * sizeof(pthread_t));
+    if (jobs == NULL || threads == NULL) {
+        free(jobs);
+        free(threads);
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    jobs[0].map = img->mapStart;
+    jobs[0].length = img->mapLength;
+    for (uint32_t k = 0; k < img->nBacking; k++) {
+        jobs[k + 1].map = img->backing[k].map;
+        jobs[k + 1].length = img->backing[k].length;
+    }
+
+    /* the image file itself is synced here; the threads take the rest */
+    for (uint32_t k = 1; k < n; k++) {
+        pthread_create(&threads[k], NULL, syncThread, &jobs[k]);
+    }
+    syncThread(&jobs[0]);
+    int rc = jobs[0].failed ? -1 : 0;
+    for (uint32_t k = 1; k < n; k++) {
+        pthread_join(threads[k], NULL);
+        if (jobs[k].failed) {
+            rc = -1;
+        }
+    }
+    free(jobs);
+    free(threads);
+    F439_PROBE1(sync_done, rc);
+    return rc;
+}
@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 200809L
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "mkfs.h"
+
+/**
+ * A tiered image (mkfs --hot <file> ... / --hot-kb <kb>) is split in two
+ * files: the image file itself holds the super block, the fat, the root
+ * directory and the hot files, and everything else goes to <image>.bulk.
+ * The image file is small enough to live on NVMe or tmpfs while the bulk
+ * stays on cheap storage, and a reader that only opens the directory and
+ * the hot files never touches the slow disk.
+ *
+ * Block numbers stay global: the fast tier is blocks [0, headBlocks) and
+ * the bulk tier the rest (see Layout in f439.h), so chains cross from one
+ * tier to the other like from one block to the next.
+ *
+ * Like the regions of parallel ingest, each tier has its own free list
+ * while the files are placed: the fast one in the super block, the bulk
+ * one in a private copy of it. At the end the two lists are chained, top
+ * of the disk first, which is the order mkfs always uses.
+ */
+
+/* spare blocks in a fast tier sized automatically, against files that grow
+   a little between planning and reading */
+#define FAST_SPARE 64
+
+
+/* is input @i hot: named with --hot (by path or by name), or small */
+static int isHot(const BuildSpec *spec, int i, const struct stat *st) {
+    if (spec->hotKB && (uint64_t)st->st_size <= (uint64_t)spec->hotKB * 1024) {
+        return 1;
+    }
+    for (int h = 0; h < spec->nHot; h++) {
+        if (strcmp(spec->hotFiles[h], spec->fileNames[i]) == 0) {
+            return 1;
+        }
+        char *nm = strdup(spec->fileNames[i]);
+        int same = nm && strcmp(spec->hotFiles[h], basename(nm)) == 0;
+        free(nm);
+        if (same) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int planTiers(const BuildSpec *spec, Layout *layout) {
+    uint32_t first = imageFirstData(spec->nBlocks);
+    uint64_t room = spec->nBlocks > first ? spec->nBlocks - first : 0;
+    uint64_t need = spec->fastBlocks;
+    if (need == 0) {
+        need = 1;               /* the root directory */
+        for (int i = 0; i < spec->nFiles; i++) {
+            struct stat st;
+            if (stat(spec->fileNames[i], &st) < 0) {
+                perror(spec->fileNames[i]);
+                return -1;
+            }
+            if (isHot(spec, i, &st)) {
+                need += blocksFor(st.st_size);
+            }
+        }
+        if (need > room) {
+            fprintf(stderr, "the hot files need %lu blocks, the image has "
+                            "%lu\n", (unsigned long)need, (unsigned long)room);
+            return -1;
+        }
+        need += FAST_SPARE;
+    }
+    /* all of it: there is no bulk tier, and build() makes a plain image */
+    if (need > room) {
+        need = room;
+    }
+    layout->kind = F439_LAYOUT_TIERED;
+    layout->headBlocks = first + need;
+    layout->stripeBlocks = 1;
+    layout->nStripes = 1;
+    return 0;
+}
+
+int ingestTiered(Image *img, const BuildSpec *spec, FileDoneFn done,
+                 void *arg) {
+    uint32_t nBlocks = img->super->nBlocks;
+    uint32_t split = img->headBlocks;
+
+    Super bulkSuper = *img->super;
+    Image bulk = *img;
+    bulk.super = &bulkSuper;
+    bulkSuper.avail = 0;
+    if (split < nBlocks) {
+        linkFreeBlocks(&bulk, split, nBlocks - 1);
+        bulkSuper.avail = nBlocks - 1;
+    }
+
+    int rc = 0;
+    for (int k = 0; k < spec->nFiles && rc == 0; k++) {
+        int i = specInput(spec, k);
+        struct stat st;
+        if (stat(spec->fileNames[i], &st) < 0) {
+            perror(spec->fileNames[i]);
+            rc = -1;
+            break;
+        }
+        uint32_t x = oneFile(isHot(spec, i, &st) ? img : &bulk,
+                             spec->fileNames[i], NULL);
+        if (x == 0 || done(arg, i, x, NULL) < 0) {
+            rc = -1;
+        }
+    }
+
+    /* bulk first, then the fast tier; a bulk tier that is not used up still
+       has its lowest block free, at the end of its list */
+    if (bulkSuper.avail != 0) {
+        img->fat[split] = img->super->avail;
+        img->super->avail = bulkSuper.avail;
+    }
+    return rc;
+}
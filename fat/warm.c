@@ -0,0 +1,337 @@
+#define _GNU_SOURCE    /* readahead() */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "f439.h"
+#include "index.h"
+
+/**
+ * warm pulls an image into the page cache before it starts serving reads:
+ *
+ *      warm [-j threads] [-f] <image> [file ...]
+ *
+ * It decodes the directory and FAT, takes the union of the block runs of all
+ * files (or of the files named on the command line) together with the super
+ * block, fat and root directory, and issues readahead() for them in physical
+ * order, so the device sees one ascending sweep rather than the top-down
+ * order mkfs allocates in (one sweep per backing file if the image is
+ * striped). -j bounds how many requests are in flight; -f
+ * uses posix_fadvise(WILLNEED) instead of readahead(). At the end it reports
+ * how much of the requested ranges (and of the whole image) is resident,
+ * according to mincore().
+ */
+
+/* requests larger than this are split so that one big file can still be
+   spread over all threads */
+#define WARM_CHUNK (2u << 20)
+
+
+/* a range of bytes of the image file, or of one of its backing files */
+typedef struct {
+    uint32_t file;  /* 0 for the image file, k + 1 for backing file k */
+    off_t start;
+    off_t length;
+} Range;
+
+typedef struct {
+    Range *ranges;
+    size_t nRanges;
+    atomic_size_t next;  /* the next range to hand out, in physical order */
+    const Image *img;
+    int useFadvise;
+} Warmer;
+
+static int fileFd(const Image *img, uint32_t file) {
+    return file ? img->backing[file - 1].fd : img->fd;
+}
+
+static char *fileMap(const Image *img, uint32_t file) {
+    return file ? img->backing[file - 1].map : (char *)img->mapStart;
+}
+
+static int byStart(const void *a, const void *b) {
+    const Range *x = a, *y = b;
+    if (x->file != y->file) {
+        return (x->file > y->file) - (x->file < y->file);
+    }
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+static void pushRange(Range **ranges, size_t *n, size_t *cap, uint32_t file,
+                      off_t start, off_t length) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *ranges = realloc(*ranges, *cap * sizeof(Range));
+        if (*ranges == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    (*ranges)[*n].file = file;
+    (*ranges)[*n].start = start;
+    (*ranges)[*n].length = length;
+    (*n)++;
+}
+
+/* blocks [first, first+count); on a striped image they are split up by the
+   backing file they are in */
+static void addRange(const Image *img, Range **ranges, size_t *n, size_t *cap,
+                     uint32_t first, uint32_t count) {
+    if (first + count <= img->headBlocks) {
+        pushRange(ranges, n, cap, 0, (off_t)first * F439_BLOCK_SIZE,
+                  (off_t)count * F439_BLOCK_SIZE);
+        return;
+    }
+    for (uint32_t b = first; b < first + count; b++) {
+        off_t offset;
+        imageBlockFd(img, b, &offset);
+        uint32_t file = 0;
+        if (b >= img->headBlocks) {
+            uint32_t local;
+            file = imageStripe(img, b, &local) + 1;
+        }
+        Range *last = *n ? &(*ranges)[*n - 1] : NULL;
+        if (last && last->file == file &&
+            last->start + last->length == offset) {
+            last->length += F439_BLOCK_SIZE;
+        } else {
+            pushRange(ranges, n, cap, file, offset, F439_BLOCK_SIZE);
+        }
+    }
+}
+
+static void addFile(const Image *img, const Index *idx, const IndexFile *f,
+                    Range **ranges, size_t *n, size_t *cap) {
+    Extent *e = indexExtents(idx) + f->firstExtent;
+    for (uint32_t i = 0; i < f->nExtents; i++) {
+        /* a descending run ends at its lowest block */
+        uint32_t lowest = e[i].step > 0 ? e[i].start
+                                        : e[i].start - (e[i].count - 1);
+        addRange(img, ranges, n, cap, lowest, e[i].count);
+    }
+
+    /* the chain of a chunked file is only its chunk list; normalize()
+       merges the blocks of the chunks back into runs */
+    if (imageFileType(img, f->head) != F439_TYPE_CHUNKED) {
+        return;
+    }
+    ChunkCursor c;
+    ChunkRef ref;
+    imageChunkStart(img, f->head, &c);
+    while (imageChunkNext(img, &c, &ref) > 0) {
+        uint32_t b = ref.start;
+        for (uint32_t done = 0; done < ref.length && b != 0 &&
+                                b < img->super->nBlocks;
+             done += F439_BLOCK_SIZE) {
+            addRange(img, ranges, n, cap, b, 1);
+            b = img->fat[b];
+        }
+    }
+}
+
+/**
+ * @brief sort the ranges, merge the ones that touch or overlap, and cut the
+ *        result into chunks of at most WARM_CHUNK bytes.
+ * @return the new number of ranges.
+ */
+static size_t normalize(Range **ranges, size_t n) {
+    qsort(*ranges, n, sizeof(Range), byStart);
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        Range *r = &(*ranges)[i];
+        if (m && (*ranges)[m - 1].file == r->file &&
+            (*ranges)[m - 1].start + (*ranges)[m - 1].length >= r->start) {
+            off_t end = r->start + r->length;
+            Range *last = &(*ranges)[m - 1];
+            if (end > last->start + last->length) {
+                last->length = end - last->start;
+            }
+        } else {
+            (*ranges)[m++] = *r;
+        }
+    }
+
+    size_t nChunks = 0;
+    for (size_t i = 0; i < m; i++) {
+        nChunks += ((*ranges)[i].length + WARM_CHUNK - 1) / WARM_CHUNK;
+    }
+    Range *chunks = malloc(nChunks * sizeof(Range));
+    if (chunks == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < m; i++) {
+        for (off_t off = 0; off < (*ranges)[i].length; off += WARM_CHUNK) {
+            chunks[k].file = (*ranges)[i].file;
+            chunks[k].start = (*ranges)[i].start + off;
+            chunks[k].length = (*ranges)[i].length - off;
+            if (chunks[k].length > WARM_CHUNK) {
+                chunks[k].length = WARM_CHUNK;
+            }
+            k++;
+        }
+    }
+    free(*ranges);
+    *ranges = chunks;
+    return nChunks;
+}
+
+/* each thread takes the next range in physical order until none are left */
+static void *warmThread(void *arg) {
+    Warmer *w = arg;
+    for (;;) {
+        size_t i = atomic_fetch_add(&w->next, 1);
+        if (i >= w->nRanges) {
+            return NULL;
+        }
+        Range *r = &w->ranges[i];
+        int fd = fileFd(w->img, r->file);
+        if (w->useFadvise) {
+            /* returns the error instead of setting errno */
+            int rc = posix_fadvise(fd, r->start, r->length,
+                                   POSIX_FADV_WILLNEED);
+            if (rc != 0) {
+                fprintf(stderr, "posix_fadvise: %s\n", strerror(rc));
+            }
+        } else if (readahead(fd, r->start, r->length) < 0) {
+            perror("readahead");
+        }
+    }
+}
+
+/**
+ * @brief count resident pages of [start, start+length) of the mapping of
+ *        @file.
+ */
+static size_t residentPages(const Image *img, uint32_t file, off_t start,
+                            off_t length, size_t *total) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    off_t first = start / pageSize * pageSize;
+    size_t nPages = (start + length - first + pageSize - 1) / pageSize;
+    unsigned char *vec = malloc(nPages);
+    if (vec == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (mincore(fileMap(img, file) + first, start + length - first, vec) < 0) {
+        perror("mincore");
+        free(vec);
+        *total += nPages;
+        return 0;
+    }
+    size_t resident = 0;
+    for (size_t i = 0; i < nPages; i++) {
+        resident += vec[i] & 1;
+    }
+    free(vec);
+    *total += nPages;
+    return resident;
+}
+
+int main(int argc, char *argv[]) {
+    int nThreads = 4;
+    int useFadvise = 0;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            useFadvise = 1;
+        } else {
+            break;
+        }
+    }
+    if (i >= argc || nThreads < 1) {
+        fprintf(stderr, "usage: %s [-j threads] [-f] <image> [file ...]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    Image img;
+    if (imageOpen(&img, argv[i++], PROT_READ) < 0) {
+        exit(1);
+    }
+    size_t size = indexSize(&img);
+    Index *idx = size ? malloc(size) : NULL;
+    if (idx == NULL || indexBuild(&img, idx, size) < 0) {
+        fprintf(stderr, "cannot index the image\n");
+        exit(1);
+    }
+
+    Range *ranges = NULL;
+    size_t nRanges = 0, cap = 0;
+    /* super block and fat (blocks [0, first data block)), then the root
+       directory */
+    addRange(&img, &ranges, &nRanges, &cap, 0,
+             imageFirstData(img.super->nBlocks));
+    addRange(&img, &ranges, &nRanges, &cap, img.super->root, 1);
+    if (i == argc) {
+        for (uint32_t f = 0; f < idx->nFiles; f++) {
+            addFile(&img, idx, &indexFiles(idx)[f], &ranges, &nRanges, &cap);
+        }
+    }
+    for (; i < argc; i++) {
+        const IndexFile *f = indexLookup(idx, argv[i]);
+        if (f == NULL) {
+            fprintf(stderr, "%s: no such file\n", argv[i]);
+            exit(1);
+        }
+        addFile(&img, idx, f, &ranges, &nRanges, &cap);
+    }
+    nRanges = normalize(&ranges, nRanges);
+
+    Warmer w = {ranges, nRanges, 0, &img, useFadvise};
+    pthread_t *threads = malloc(nThreads * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < nThreads) {
+        int err = pthread_create(&threads[started], NULL, warmThread, &w);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+        started++;
+    }
+    if (started < nThreads) {
+        /* whatever the threads do not get to is warmed on this one */
+        warmThread(&w);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    /* ranges are block runs, and several can share a page: count the
+       merged page spans so that every page is counted once */
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t wanted = 0, resident = 0;
+    for (size_t r = 0; r < nRanges;) {
+        uint32_t file = ranges[r].file;
+        off_t start = ranges[r].start;
+        off_t end = start + ranges[r].length;
+        for (r++; r < nRanges && ranges[r].file == file &&
+                  ranges[r].start < (end + pageSize - 1) / pageSize * pageSize;
+             r++) {
+            if (ranges[r].start + ranges[r].length > end) {
+                end = ranges[r].start + ranges[r].length;
+            }
+        }
+        resident += residentPages(&img, file, start, end - start, &wanted);
+    }
+    size_t whole = 0;
+    size_t wholeResident = residentPages(&img, 0, 0, img.mapLength, &whole);
+    for (uint32_t k = 0; k < img.nBacking; k++) {
+        wholeResident += residentPages(&img, k + 1, 0, img.backing[k].length,
+                                       &whole);
+    }
+    printf("requested: %zu/%zu pages resident (%.1f%%)\n", resident, wanted,
+           wanted ? 100.0 * resident / wanted : 100.0);
+    printf("image:     %zu/%zu pages resident (%.1f%%)\n", wholeResident,
+           whole, whole ? 100.0 * wholeResident / whole : 100.0);
+
+    free(threads);
+    free(ranges);
+    free(idx);
+    imageClose(&img);
+    return 0;
+}